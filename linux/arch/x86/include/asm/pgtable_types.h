@@ -294,6 +294,9 @@ typedef struct {
 	// --- Adaptive-PEBS 新增字段（Welford 在线方差） ---
 	u64 last_hit_time; // 上次采样时间戳（PERF_SAMPLE_TIME）
 	u32 adaptive_hit; // 样本总数 n
+	u16 read_nodes; // nodes that read the page since the last cooling
+	bool written; // a MEMWRITE sample hit the page since the last cooling
+	u8 nr_walks; // STLB miss samples, halved by cooling
 	u64 mean_interval; // 间隔均值（放大 1024 倍，u64避免溢出）
 	u64 fluctuation; // 聚合方差 M2（放大 1024 倍）
 } pginfo_t;
@@ -34,6 +34,9 @@ static inline void tlb_flush(struct mmu_gather *tlb)
  */
 static inline void __tlb_remove_table(void *table)
 {
+#ifdef CONFIG_HTMM
+	free_pginfo_pte(table);
+#endif
 	free_page_and_swap_cache(table);
 }
 
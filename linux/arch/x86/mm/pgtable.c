@@ -6,6 +6,10 @@
 #include <asm/tlb.h>
 #include <asm/fixmap.h>
 #include <asm/mtrr.h>
+#ifdef CONFIG_HTMM
+#include <linux/htmm.h>
+#include <linux/mempolicy.h>
+#endif
 
 #ifdef CONFIG_DYNAMIC_PHYSICAL_MASK
 phys_addr_t physical_mask __ro_after_init = (1ULL << __PHYSICAL_MASK_SHIFT) - 1;
@@ -32,19 +36,41 @@ gfp_t __userpte_alloc_gfp = GFP_PGTABLE_USER | PGTABLE_HIGHMEM;
 static void __pte_alloc_pginfo(struct page *page)
 {
     /* __userpte_alloc_gfp contains __GFP_ZERO */
-    page->pginfo = kmem_cache_alloc(pginfo_cache,
-				    __userpte_alloc_gfp);
+    page->pginfo = kmem_cache_alloc_node(pginfo_cache,
+				    __userpte_alloc_gfp, page_to_nid(page));
     if (page->pginfo)
 	SetPageHtmm(page);
 }
+
+/* PTE pages of htmm tasks are placed on the fast tier; page walks on
+ * TLB misses should not pay the slow tier latency. */
+static struct page *__pte_alloc_one_htmm(struct mm_struct *mm)
+{
+    int nid = htmm_toptier_node(numa_node_id());
+    struct page *pte;
+
+    pte = alloc_pages_node(nid, __userpte_alloc_gfp, 0);
+    if (!pte)
+	return NULL;
+    if (!pgtable_pte_page_ctor(pte)) {
+	__free_page(pte);
+	return NULL;
+    }
+    return pte;
+}
 #endif
 pgtable_t pte_alloc_one(struct mm_struct *mm)
 {
     struct page *pgtable;
 
+#ifdef CONFIG_HTMM
+    if (mm->htmm_enabled && htmm_pgtable_placement)
+	pgtable = __pte_alloc_one_htmm(mm);
+    else
+#endif
     pgtable = __pte_alloc_one(mm, __userpte_alloc_gfp);
 #ifdef CONFIG_HTMM
-    if (mm->htmm_enabled) {
+    if (pgtable && mm->htmm_enabled) {
 	__pte_alloc_pginfo(pgtable);
     }
 #endif
@@ -68,14 +94,34 @@ static int __init setup_userpte(char *arg)
 }
 early_param("userpte", setup_userpte);
 
+#ifdef CONFIG_HTMM
+/*
+ * ksamplingd walks the page tables of htmm tasks without the mmap lock and
+ * from a CPU that is not in mm_cpumask(), so the TLB shootdown does not
+ * serialize against it. Free them after an RCU grace period instead.
+ */
+static inline void htmm_tlb_remove_table(struct mmu_gather *tlb,
+					 struct page *table)
+{
+	if (tlb->mm->htmm_enabled)
+		tlb_remove_table(tlb, table);
+	else
+		paravirt_tlb_remove_table(tlb, table);
+}
+#else
+#define htmm_tlb_remove_table paravirt_tlb_remove_table
+#endif
+
 void ___pte_free_tlb(struct mmu_gather *tlb, struct page *pte)
 {
 #ifdef CONFIG_HTMM
-	free_pginfo_pte(pte);
+	/* pginfo of an RCU freed table is released in __tlb_remove_table() */
+	if (!tlb->mm->htmm_enabled)
+		free_pginfo_pte(pte);
 #endif
 	pgtable_pte_page_dtor(pte);
 	paravirt_release_pte(page_to_pfn(pte));
-	paravirt_tlb_remove_table(tlb, pte);
+	htmm_tlb_remove_table(tlb, pte);
 }
 
 #if CONFIG_PGTABLE_LEVELS > 2
@@ -91,21 +137,21 @@ void ___pmd_free_tlb(struct mmu_gather *tlb, pmd_t *pmd)
 	tlb->need_flush_all = 1;
 #endif
 	pgtable_pmd_page_dtor(page);
-	paravirt_tlb_remove_table(tlb, page);
+	htmm_tlb_remove_table(tlb, page);
 }
 
 #if CONFIG_PGTABLE_LEVELS > 3
 void ___pud_free_tlb(struct mmu_gather *tlb, pud_t *pud)
 {
 	paravirt_release_pud(__pa(pud) >> PAGE_SHIFT);
-	paravirt_tlb_remove_table(tlb, virt_to_page(pud));
+	htmm_tlb_remove_table(tlb, virt_to_page(pud));
 }
 
 #if CONFIG_PGTABLE_LEVELS > 4
 void ___p4d_free_tlb(struct mmu_gather *tlb, p4d_t *p4d)
 {
 	paravirt_release_p4d(__pa(p4d) >> PAGE_SHIFT);
-	paravirt_tlb_remove_table(tlb, virt_to_page(p4d));
+	htmm_tlb_remove_table(tlb, virt_to_page(p4d));
 }
 #endif	/* CONFIG_PGTABLE_LEVELS > 4 */
 #endif	/* CONFIG_PGTABLE_LEVELS > 3 */
@@ -3,6 +3,7 @@
 #define DEFERRED_SPLIT_ISOLATED 1
 
 #define BUFFER_SIZE 32 /* 128: 1MB */
+#define HTMM_BOUNCE_SIZE 64 /* holds a wrapped struct htmm_event */
 #define CPUS_PER_SOCKET 20
 #define MAX_MIGRATION_RATE_IN_MBPS 2048 /* 2048MB per sec */
 #define L2_SAMPLE_PERIOD 50000 /* L2 cache fixed sampling period */
@@ -26,6 +27,13 @@
 #define ALL_LOADS 0x81d0
 #define STLB_MISS_STORES 0x12d0
 #define STLB_MISS_LOADS 0x11d0
+/* counting events, DTLB_LOAD_MISSES.WALK_ACTIVE (cmask=1) and .WALK_COMPLETED */
+#define DTLB_LOAD_WALK_ACTIVE 0x1001008
+#define DTLB_LOAD_WALK_COMPLETED 0x0e08
+/* MEM_TRANS_RETIRED.LOAD_LATENCY, the only event with a PEBS load latency */
+#define LOAD_LATENCY 0x1cd
+#define HTMM_LDLAT_THRESHOLD 64 /* cycles, goes to MSR_PEBS_LD_LAT_THRESHOLD */
+#define HTMM_LDLAT_PERIOD 100003
 
 /* tmm option */
 #define HTMM_NO_MIG 0x0 /* unused */
@@ -92,6 +100,25 @@ struct htmm_event {
 	__u64 addr;
 };
 
+/* compact record written by htmm_overflow_handler() */
+struct htmm_sample {
+	__u64 addr;
+	__u64 time;
+	__u32 pid;
+	__u32 tid;
+	__u32 event;
+};
+
+#define HTMM_RING_SIZE 4096 /* records per cpu, power of 2 */
+
+/* per-cpu single producer (PMI) single consumer (ksamplingd) ring */
+struct htmm_sample_ring {
+	unsigned long head;
+	unsigned long tail ____cacheline_aligned;
+	unsigned long nr_dropped;
+	struct htmm_sample *samples;
+};
+
 enum events {
 	L1_HIT = 0,
 	L1_MISS = 1,
@@ -102,19 +129,53 @@ enum events {
 	DRAMREAD = 6,
 	NVMREAD = 7,
 	MEMWRITE = 8,
-	N_HTMMEVENTS // now 9 events
+	STLB_MISS_LOAD = 9,
+	STLB_MISS_STORE = 10,
+	N_HTMMEVENTS // now 11 events
+};
+
+/* STLB misses measure the page walks of a page, not its hotness */
+static inline bool htmm_walk_event(int event)
+{
+	return event == STLB_MISS_LOAD || event == STLB_MISS_STORE;
+}
+
+/* hotness record of a hugetlb page, kept on pn->hugetlb_list */
+struct htmm_hugetlb_info {
+	struct list_head list;
+	struct page *page; /* head page */
+	struct mem_cgroup *memcg; /* of the first task that sampled it */
+	pginfo_t pginfo; /* samples of the whole page */
+	unsigned int cooling_clock;
+	unsigned int nr_hot_sub; /* hot 2MB regions at the last cooling */
+	unsigned int nr_sub; /* 2MB regions of the page */
+	u32 sub_accesses[];
 };
 
 /* htmm_core.c */
 extern void htmm_mm_init(struct mm_struct *mm);
 extern void htmm_mm_exit(struct mm_struct *mm);
+extern void htmm_task_init(struct task_struct *p);
 extern void __prep_transhuge_page_for_htmm(struct mm_struct *mm,
 					   struct page *page);
 extern void prep_transhuge_page_for_htmm(struct vm_area_struct *vma,
 					 struct page *page);
 extern void clear_transhuge_pginfo(struct page *page);
 extern void copy_transhuge_pginfo(struct page *page, struct page *newpage);
+extern void htmm_node_hg_add(struct mem_cgroup *memcg, int nid,
+			     unsigned int idx, unsigned long nr);
+extern void htmm_node_hg_sub(struct mem_cgroup *memcg, int nid,
+			     unsigned int idx, unsigned long nr);
+extern void htmm_node_hg_move(struct mem_cgroup *memcg, struct page *page,
+			      struct page *newpage, unsigned int idx,
+			      unsigned int cooling_clock, unsigned long nr);
 extern pginfo_t *get_compound_pginfo(struct page *page, unsigned long address);
+extern bool htmm_thp_subpage_accessed(struct page *page, unsigned int i);
+extern bool htmm_region_walk_heavy(pte_t *pte);
+extern void htmm_hugetlb_free(struct page *page);
+extern void htmm_hugetlb_migrate(struct page *page, struct page *newpage);
+extern bool htmm_hugetlb_is_hot(struct htmm_hugetlb_info *info);
+extern bool htmm_hugetlb_is_cold(struct htmm_hugetlb_info *info);
 
 extern void check_transhuge_cooling(void *arg, struct page *page, bool locked);
 extern void check_base_cooling(pginfo_t *pginfo, struct page *page,
@@ -123,9 +184,10 @@ extern int set_page_coolstatus(struct page *page, pte_t *pte,
 			       struct mm_struct *mm);
 
 extern void set_lru_adjusting(struct mem_cgroup *memcg, bool inc_thres);
+extern bool htmm_cooling_done(struct mem_cgroup *memcg, int nid);
 
-extern void update_pginfo(pid_t pid, unsigned long address, enum events e,
-			  u64 timestamp);
+extern int update_pginfo(pid_t pid, pid_t tid, unsigned long address,
+			 enum events e, u64 timestamp, int nid);
 
 extern bool deferred_split_huge_page_for_htmm(struct page *page);
 extern unsigned long
@@ -146,10 +208,39 @@ extern struct page *get_meta_page(struct page *page);
 extern unsigned int get_accesses_from_idx(unsigned int idx);
 extern unsigned int get_idx(unsigned long num);
 extern int get_skew_idx(unsigned long num);
-extern void uncharge_htmm_pte(pte_t *pte, struct mem_cgroup *memcg);
+extern void uncharge_htmm_pte(pte_t *pte, struct page *page,
+			      struct mem_cgroup *memcg);
 extern void uncharge_htmm_page(struct page *page, struct mem_cgroup *memcg);
+extern void htmm_charge_work(struct mem_cgroup *memcg, enum htmm_work work,
+			     u64 start);
+extern bool htmm_over_cpu_budget(struct mem_cgroup *memcg);
+extern bool htmm_node_is_toptier(int nid);
+extern int htmm_toptier_node(int nid);
+extern void htmm_rebalance_pgtables(struct mem_cgroup *memcg);
+extern void htmm_pte_free(struct mm_struct *mm, struct page *pte);
 extern void charge_htmm_page(struct page *page, struct mem_cgroup *memcg);
 
+/* BPF policy hooks (fmod_ret): 0 keeps the built-in policy */
+enum htmm_bpf_verdict {
+	HTMM_BPF_DEFAULT = 0,
+	HTMM_BPF_TRUE,
+	HTMM_BPF_FALSE,
+};
+
+extern int htmm_bpf_sample_weight(struct mem_cgroup *memcg, pginfo_t *pginfo,
+				  int event_id);
+extern int htmm_bpf_promotion_candidate(struct mem_cgroup *memcg,
+					struct page *page, unsigned int idx);
+extern int htmm_bpf_demotion_victim(struct mem_cgroup *memcg,
+				    struct page *page, unsigned int idx);
+extern int htmm_bpf_split_huge_page(struct mem_cgroup *memcg,
+				    struct page *meta);
+extern int htmm_bpf_event_period(int event, u32 score, u64 period);
+extern bool htmm_is_promotion_candidate(struct mem_cgroup *memcg,
+					struct page *page, unsigned int idx);
+extern bool htmm_is_demotion_victim(struct mem_cgroup *memcg,
+				    struct page *page, unsigned int idx);
+
 extern void set_lru_split_pid(pid_t pid);
 extern void adjust_active_threshold(pid_t pid);
 extern void set_lru_cooling_pid(pid_t pid);
@@ -157,6 +248,11 @@ extern void set_lru_cooling_pid(pid_t pid);
 /* htmm_sampler.c */
 extern int ksamplingd_init(pid_t pid, int node);
 extern void ksamplingd_exit(void);
+extern unsigned long htmm_tier_latency(bool fast);
+extern unsigned long htmm_walk_latency(void);
+extern struct dentry *htmm_debugfs_root;
+extern bool htmm_bw_promotion_allowed(void);
+extern bool htmm_bw_demote_warm(void);
 
 static inline unsigned long get_sample_period(unsigned long cur)
 {
@@ -227,12 +323,26 @@ static inline unsigned int decrease_sample_period(unsigned int cur,
 
 /* htmm_migrater.c */
 #define HTMM_MIN_FREE_PAGES 256 * 10 // 10MB
+extern int htmm_promotion_target(int nid);
+extern int htmm_demotion_target(int nid);
+extern unsigned long htmm_nr_resident(struct mem_cgroup *memcg, int nid,
+				      enum htmm_resident type);
 extern unsigned long get_nr_lru_pages_node(struct mem_cgroup *memcg,
 					   pg_data_t *pgdat);
+extern unsigned long get_memcg_fasttier_file_pages(struct mem_cgroup *memcg);
 extern void add_memcg_to_kmigraterd(struct mem_cgroup *memcg, int nid);
 extern void del_memcg_from_kmigraterd(struct mem_cgroup *memcg, int nid);
-extern unsigned long get_memcg_demotion_watermark(unsigned long max_nr_pages);
-extern unsigned long get_memcg_promotion_watermark(unsigned long max_nr_pages);
+extern unsigned long get_memcg_demotion_watermark(struct mem_cgroup *memcg,
+						  int nid);
+extern unsigned long get_memcg_promotion_watermark(struct mem_cgroup *memcg,
+						   int nid);
+extern unsigned long
+get_memcg_fasttier_promotion_watermark(struct mem_cgroup *memcg);
+extern bool htmm_memcg_needs_sampling(struct mem_cgroup *memcg);
+extern bool htmm_node_has_room(int nid, struct mem_cgroup *memcg);
+extern bool htmm_isolate_pin_page(struct page *page, struct list_head *list);
+extern void htmm_promote_pin_pages(struct list_head *page_list);
+extern void htmm_kick_cooling(struct mem_cgroup *memcg);
 extern void kmigraterd_wakeup(int nid);
 extern int kmigraterd_init(void);
 extern void kmigraterd_stop(void);
@@ -21,6 +21,7 @@
 #include <linux/vmstat.h>
 #include <linux/writeback.h>
 #include <linux/page-flags.h>
+#include <linux/percpu_counter.h>
 
 struct mem_cgroup;
 struct obj_cgroup;
@@ -131,6 +132,23 @@ struct lruvec_stats {
 	long state_pending[NR_VM_NODE_STAT_ITEMS];
 };
 
+#ifdef CONFIG_HTMM
+enum htmm_work {
+	HTMM_WORK_SAMPLE,	/* sample processing by ksamplingd */
+	HTMM_WORK_MIGRATE,	/* promotion and demotion */
+	HTMM_WORK_COOLING,	/* cooling, adjusting, split and pgtable passes */
+	NR_HTMM_WORK,
+};
+
+/* pages charged to the memcg on a node, kept by __mod_memcg_lruvec_state() */
+enum htmm_resident {
+	HTMM_RES_ANON,		/* NR_ANON_MAPPED, thps included */
+	HTMM_RES_ANON_THP,	/* NR_ANON_THPS */
+	HTMM_RES_FILE,		/* NR_FILE_PAGES */
+	NR_HTMM_RES,
+};
+#endif
+
 /*
  * per-node information in memory controller.
  */
@@ -150,6 +168,32 @@ struct mem_cgroup_per_node {
 	bool			need_demotion;
 	struct deferred_split	deferred_split_queue;
 	struct list_head	deferred_list;
+	/* records of the hugetlb pages on the node, see htmm_hugetlb_free() */
+	spinlock_t		hugetlb_lock;
+	struct list_head	hugetlb_list;
+	/* hot hugetlb pages the fast tier pool had no room for, per hstate */
+	unsigned int		hugetlb_waiting[HUGE_MAX_HSTATE];
+	/* adaptive fast tier watermarks in pages, see htmm_update_watermarks() */
+	unsigned long		demotion_wmark;
+	unsigned long		promotion_wmark;
+	unsigned long		wmark_alloc_rate;	/* pages/sec */
+	unsigned long		wmark_demote_rate;	/* pages/sec of demotion work */
+	unsigned long		wmark_backlog;		/* pages waiting for promotion */
+	unsigned long		wmark_nr_lru;
+	unsigned long		wmark_nr_demoted;
+	u64			wmark_demote_ns;
+	u64			wmark_stamp;
+	/* isolated pages that were locked or under writeback, see
+	 * retry_busy_pages() */
+	spinlock_t		busy_lock;
+	struct list_head	busy_list;
+	unsigned long		busy_retry;	/* jiffies */
+	unsigned long		busy_nr;	/* base pages on busy_list */
+	unsigned int		busy_backoff;
+	/* resident pages per type, isolated ones included */
+	struct percpu_counter	nr_resident[NR_HTMM_RES];
+	/* memcg->hotness_hg of the pages on this node, under memcg->access_lock */
+	unsigned long		hotness_hg[16];
 #endif
 	struct mem_cgroup_reclaim_iter	iter;
 
@@ -368,6 +412,8 @@ struct mem_cgroup {
 	unsigned long max_dram_sampled; /* accesses to DRAM (estimated) */
 	unsigned long prev_max_dram_sampled; /* accesses to DRAM (estimated) */
 	unsigned long nr_max_sampled; /* the calibrated number of accesses to both DRAM and NVM */
+	unsigned long nr_walk_sampled; /* STLB misses since the last cooling */
+	unsigned int walk_permil; /* STLB misses per 1000 sampled accesses */
 	/* thresholds */
 	unsigned int active_threshold; /* hot */
 	unsigned int warm_threshold;
@@ -389,6 +435,20 @@ struct mem_cgroup {
 	 */
 	unsigned long hotness_hg[16]; // page access histogram
 	unsigned long ebp_hotness_hg[16]; // expected bage page
+	/* miss-ratio curve of the last cooling epoch: the hottest
+	 * htmm_mrc_pages[i] pages capture htmm_mrc_hit[i] permil of the
+	 * sampled accesses, see htmm_update_mrc()
+	 */
+	unsigned long htmm_mrc_pages[16];
+	unsigned int htmm_mrc_hit[16];
+	/* histograms as they were when the last cooling pass completed on
+	 * every node, see htmm_cooling_done()
+	 */
+	unsigned long hotness_snap[16];
+	unsigned long ebp_hotness_snap[16];
+	/* nodes the current cooling pass is still running on */
+	unsigned int nr_cooling_nodes;
+	unsigned long cooling_start; /* jiffies */
 	/* lock for histogram */
 	spinlock_t access_lock;
 	/* etc */
@@ -397,6 +457,14 @@ struct mem_cgroup {
 	bool need_split;
 	unsigned int cooling_clock;
 	unsigned long nr_alloc;
+	/* htmm work done for this memcg by the kthreads, see htmm_charge_work() */
+	atomic64_t htmm_work_ns[NR_HTMM_WORK];
+	atomic64_t htmm_migrate_bytes;
+	atomic64_t htmm_nr_throttled;
+	/* tiering cpu budget: ns of htmm work per second, U64_MAX: no limit */
+	u64 htmm_cpu_budget;
+	u64 htmm_budget_start;
+	atomic64_t htmm_budget_used;
 #endif /* CONFIG_HTMM */
 	struct mem_cgroup_per_node *nodeinfo[];
 };
@@ -1799,5 +1867,7 @@ static inline struct mem_cgroup *mem_cgroup_from_obj(void *p)
 
 #ifdef CONFIG_HTMM
 extern int mem_cgroup_per_node_htmm_init(void);
+extern void mem_cgroup_per_node_htmm_exit(int nid);
+extern void mem_cgroup_htmm_update_dram_max(struct mem_cgroup *memcg);
 #endif
 #endif /* _LINUX_MEMCONTROL_H */
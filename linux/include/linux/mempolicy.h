@@ -205,6 +205,19 @@ extern bool htmm_cxl_mode;
 extern bool htmm_skip_cooling;
 extern unsigned int htmm_thres_cooling_alloc;
 extern unsigned int ksampled_soft_cpu_quota;
+extern bool htmm_pgtable_placement;
+extern bool htmm_sample_ring;
+extern unsigned int htmm_pmu_counters;
+extern unsigned int htmm_rotation_window;
+extern bool htmm_bw_balance;
+extern bool htmm_replica_detect;
+extern bool htmm_coschedule;
+extern bool htmm_hugetlb;
+extern unsigned int htmm_thp_bloat_thres;
+extern bool htmm_pin_fasttier;
+extern bool htmm_stlb_sampling;
+extern unsigned int htmm_walk_thres;
+extern unsigned int htmm_cooling_timeout;
 #endif
 static inline bool mpol_is_preferred_many(struct mempolicy *pol)
 {
@@ -613,6 +613,10 @@ struct mm_struct {
 
 #ifdef CONFIG_HTMM
 		bool htmm_enabled;
+#endif
+#ifdef CONFIG_NUMA
+		/* move_pages_async() requests still migrating this mm */
+		atomic_t nr_move_pages_async;
 #endif
 	} __randomize_layout;
 
@@ -892,6 +892,7 @@ typedef struct pglist_data {
 	struct list_head    kmigraterd_head;
 	spinlock_t	    kmigraterd_lock;
 	wait_queue_head_t   kmigraterd_wait;
+	bool		    kmigraterd_kicked; /* see kick_kmigraterd() */
 #endif
 	/* Fields commonly accessed by the page reclaim scanner */
 
@@ -1284,6 +1284,13 @@ struct task_struct {
 	unsigned long			numa_pages_migrated;
 #endif /* CONFIG_NUMA_BALANCING */
 
+#ifdef CONFIG_HTMM
+	/* Node holding the hot set, from ksamplingd, see htmm_coschedule_vote() */
+	int				htmm_hot_nid;
+	unsigned int			htmm_hot_nid_votes;
+	struct callback_head		htmm_numa_work;
+#endif
+
 #ifdef CONFIG_RSEQ
 	struct rseq __user *rseq;
 	u32 rseq_sig;
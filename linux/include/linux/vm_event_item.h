@@ -122,6 +122,27 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		HTMM_MISSED_WRITE,
 		HTMM_ALLOC_DRAM,
 		HTMM_ALLOC_NVM,
+		HTMM_PGINFO_MOVED,
+		HTMM_PGTABLE_PROMOTED,
+		HTMM_SAMPLE_LOCKLESS,
+		HTMM_SAMPLE_RETRIED,
+		HTMM_SAMPLE_DROPPED,
+		HTMM_SAMPLING_SUSPENDED,
+		HTMM_SAMPLING_RESUMED,
+		HTMM_REPLICA_CANDIDATE,
+		HTMM_REPLICA_CANDIDATE_WRITE,
+		HTMM_COSCHED_HINT,
+		HTMM_HUGETLB_PROMOTED,
+		HTMM_HUGETLB_DEMOTED,
+		HTMM_THP_BLOAT_SPLIT,
+		HTMM_THP_BLOAT_FREED,
+		HTMM_BUSY_DEFERRED,
+		HTMM_BUSY_EXPIRED,
+		HTMM_PIN_SKIPPED,
+		HTMM_PIN_PLACED,
+		HTMM_WALK_SAMPLED,
+		HTMM_COOLING_DONE,
+		HTMM_COOLING_EXPIRED,
 #endif
 #ifdef CONFIG_DEBUG_TLBFLUSH
 		NR_TLB_REMOTE_FLUSH,	/* cpu tried to flush others' tlbs */
@@ -96,6 +96,24 @@ void perf_event_aux_event(struct perf_event *event, unsigned long head,
 extern struct page *
 perf_mmap_to_page(struct perf_buffer *rb, unsigned long pgoff);
 
+/* batched in-kernel reader, see perf_buffer_read_begin() */
+struct perf_buffer_reader {
+	struct perf_buffer		*rb;
+	u64				head;	/* data_head snapshot */
+	u64				tail;	/* next record to hand out */
+	void				*bounce;
+	unsigned long			bounce_size;
+	unsigned long			nr_skipped; /* wrapped, larger than bounce */
+};
+
+extern unsigned long perf_buffer_read_begin(struct perf_buffer_reader *reader,
+					    struct perf_buffer *rb,
+					    void *bounce,
+					    unsigned long bounce_size);
+extern struct perf_event_header *
+perf_buffer_read_next(struct perf_buffer_reader *reader);
+extern void perf_buffer_read_end(struct perf_buffer_reader *reader);
+
 #ifdef CONFIG_PERF_USE_VMALLOC
 /*
  * Back perf_mmap() with vmalloc memory.
@@ -962,3 +962,96 @@ perf_mmap_to_page(struct perf_buffer *rb, unsigned long pgoff)
 
 	return __perf_mmap_to_page(rb, pgoff);
 }
+
+/*
+ * In-kernel consumer of a perf_buffer that was not mmap()ed, see
+ * htmm__perf_event_init().
+ *
+ * perf_buffer_read_begin() snapshots data_head, perf_buffer_read_next() hands
+ * out the records up to that snapshot and perf_buffer_read_end() releases all
+ * of them to the writer with a single data_tail store. A record that wraps
+ * across a data page is copied into the caller's bounce buffer; one that does
+ * not fit there is skipped.
+ */
+unsigned long perf_buffer_read_begin(struct perf_buffer_reader *reader,
+				     struct perf_buffer *rb, void *bounce,
+				     unsigned long bounce_size)
+{
+	struct perf_event_mmap_page *up = rb->user_page;
+
+	reader->rb = rb;
+	reader->bounce = bounce;
+	reader->bounce_size = bounce_size;
+	reader->nr_skipped = 0;
+	reader->tail = READ_ONCE(up->data_tail);
+	reader->head = READ_ONCE(up->data_head);
+	/* matches the smp_wmb() in perf_output_put_handle() */
+	smp_rmb();
+
+	return reader->head - reader->tail;
+}
+
+static void perf_buffer_read_copy(struct perf_buffer *rb, u64 pos, void *dst,
+				  unsigned long len)
+{
+	unsigned long page_size = PAGE_SIZE << page_order(rb);
+
+	while (len) {
+		unsigned long offset = pos & (perf_data_size(rb) - 1);
+		unsigned long pg_index = offset / page_size;
+		unsigned long size;
+
+		offset &= page_size - 1;
+		size = min(len, page_size - offset);
+		memcpy(dst, rb->data_pages[pg_index] + offset, size);
+
+		dst += size;
+		pos += size;
+		len -= size;
+	}
+}
+
+struct perf_event_header *
+perf_buffer_read_next(struct perf_buffer_reader *reader)
+{
+	struct perf_buffer *rb = reader->rb;
+	unsigned long page_size = PAGE_SIZE << page_order(rb);
+	struct perf_event_header *ph;
+	unsigned long offset;
+	u16 size;
+
+again:
+	if (reader->head - reader->tail < sizeof(*ph))
+		return NULL;
+
+	/* records are u64 aligned, so the header never wraps */
+	offset = reader->tail & (perf_data_size(rb) - 1);
+	ph = rb->data_pages[offset / page_size] + (offset & (page_size - 1));
+	size = READ_ONCE(ph->size);
+	if (WARN_ON_ONCE(size < sizeof(*ph) ||
+			 size > reader->head - reader->tail)) {
+		/* corrupted buffer: drop everything up to the snapshot */
+		reader->tail = reader->head;
+		return NULL;
+	}
+
+	if ((offset & (page_size - 1)) + size > page_size) {
+		if (size > reader->bounce_size) {
+			reader->tail += size;
+			reader->nr_skipped++;
+			goto again;
+		}
+		perf_buffer_read_copy(rb, reader->tail, reader->bounce, size);
+		ph = reader->bounce;
+	}
+
+	reader->tail += size;
+	return ph;
+}
+
+void perf_buffer_read_end(struct perf_buffer_reader *reader)
+{
+	/* all records are read before the writer may reuse the space */
+	smp_mb();
+	WRITE_ONCE(reader->rb->user_page->data_tail, reader->tail);
+}
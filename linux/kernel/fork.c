@@ -1065,6 +1065,9 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p,
 #endif
 #ifdef CONFIG_HTMM
 	htmm_mm_init(mm);
+#endif
+#ifdef CONFIG_NUMA
+	atomic_set(&mm->nr_move_pages_async, 0);
 #endif
 	mm_init_uprobes_state(mm);
 	hugetlb_count_init(mm);
@@ -2139,6 +2142,9 @@ static __latent_entropy struct task_struct *copy_process(
 		goto bad_fork_cleanup_threadgroup_lock;
 	}
 #endif
+#ifdef CONFIG_HTMM
+	htmm_task_init(p);
+#endif
 #ifdef CONFIG_CPUSETS
 	p->cpuset_mem_spread_rotor = NUMA_NO_NODE;
 	p->cpuset_slab_spread_rotor = NUMA_NO_NODE;
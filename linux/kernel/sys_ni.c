@@ -296,6 +296,7 @@ COND_SYSCALL(get_mempolicy);
 COND_SYSCALL(set_mempolicy);
 COND_SYSCALL(migrate_pages);
 COND_SYSCALL(move_pages);
+COND_SYSCALL(move_pages_async);
 
 COND_SYSCALL(perf_event_open);
 COND_SYSCALL(accept4);
@@ -22,6 +22,9 @@
 #include <asm/mmu_context.h>
 #include <asm/tlbflush.h>
 
+#ifdef CONFIG_HTMM
+#include <linux/htmm.h>
+#endif
 #include "internal.h"
 
 struct follow_page_context {
@@ -1697,12 +1700,14 @@ struct page *get_dump_page(unsigned long addr)
  */
 static long check_and_migrate_movable_pages(unsigned long nr_pages,
 					    struct page **pages,
-					    unsigned int gup_flags)
+					    unsigned int gup_flags,
+					    bool tier)
 {
 	unsigned long i;
 	unsigned long isolation_error_count = 0;
 	bool drain_allow = true;
 	LIST_HEAD(movable_page_list);
+	LIST_HEAD(tier_page_list);
 	long ret = 0;
 	struct page *prev_head = NULL;
 	struct page *head;
@@ -1716,6 +1721,14 @@ static long check_and_migrate_movable_pages(unsigned long nr_pages,
 		if (head == prev_head)
 			continue;
 		prev_head = head;
+#ifdef CONFIG_HTMM
+		/*
+		 * The pin keeps the page on its memory tier, move it to the
+		 * fast tier first if htmm wants it there.
+		 */
+		if (tier && htmm_isolate_pin_page(head, &tier_page_list))
+			continue;
+#endif
 		/*
 		 * If we get a movable page, since we are going to be pinning
 		 * these entries, try to move them out if possible.
@@ -1747,7 +1760,8 @@ static long check_and_migrate_movable_pages(unsigned long nr_pages,
 	 * If list is empty, and no isolation errors, means that all pages are
 	 * in the correct zone.
 	 */
-	if (list_empty(&movable_page_list) && !isolation_error_count)
+	if (list_empty(&movable_page_list) && !isolation_error_count &&
+	    list_empty(&tier_page_list))
 		return nr_pages;
 
 	if (gup_flags & FOLL_PIN) {
@@ -1763,13 +1777,18 @@ static long check_and_migrate_movable_pages(unsigned long nr_pages,
 		if (ret && !list_empty(&movable_page_list))
 			putback_movable_pages(&movable_page_list);
 	}
+#ifdef CONFIG_HTMM
+	/* best effort, pages left behind are pinned on the slow tier */
+	htmm_promote_pin_pages(&tier_page_list);
+#endif
 
 	return ret > 0 ? -ENOMEM : ret;
 }
 #else
 static long check_and_migrate_movable_pages(unsigned long nr_pages,
 					    struct page **pages,
-					    unsigned int gup_flags)
+					    unsigned int gup_flags,
+					    bool tier)
 {
 	return nr_pages;
 }
@@ -1787,6 +1806,7 @@ static long __gup_longterm_locked(struct mm_struct *mm,
 				  unsigned int gup_flags)
 {
 	unsigned int flags;
+	bool tier = true;
 	long rc;
 
 	if (!(gup_flags & FOLL_LONGTERM))
@@ -1798,7 +1818,10 @@ static long __gup_longterm_locked(struct mm_struct *mm,
 					     NULL, gup_flags);
 		if (rc <= 0)
 			break;
-		rc = check_and_migrate_movable_pages(rc, pages, gup_flags);
+		/* tier placement is tried once, it may fail for good */
+		rc = check_and_migrate_movable_pages(rc, pages, gup_flags,
+						     tier);
+		tier = false;
 	} while (!rc);
 	memalloc_pin_restore(flags);
 
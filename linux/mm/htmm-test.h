@@ -0,0 +1,364 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * htmm unit tests and microbenchmarks
+ *
+ * Included at the end of htmm_sampler.c so that the static helpers of the
+ * sampler can be tested. Each helper is checked against a straightforward
+ * reference implementation; htmm_test_bench reports cycles per call so that
+ * faster versions can be compared.
+ */
+
+#ifdef CONFIG_HTMM_KUNIT_TEST
+
+#ifndef _HTMM_TEST_H
+#define _HTMM_TEST_H
+
+#include <kunit/test.h>
+#include <linux/timex.h>
+
+static unsigned int htmm_ref_get_idx(unsigned long num)
+{
+	return min(fls_long(num + 1) - 1, 15U);
+}
+
+static unsigned int htmm_ref_get_accesses_from_idx(unsigned int idx)
+{
+	return idx ? 1U << idx : 0;
+}
+
+static int htmm_ref_get_skew_idx(unsigned long num)
+{
+	if (num < 1024)
+		return fls_long(num);
+	return 11 + min(9UL, (num - 1) / 1024);
+}
+
+static void htmm_test_get_idx(struct kunit *test)
+{
+	unsigned long num;
+
+	for (num = 0; num < (1UL << 18); num++)
+		KUNIT_EXPECT_EQ(test, get_idx(num), htmm_ref_get_idx(num));
+	KUNIT_EXPECT_EQ(test, get_idx(ULONG_MAX - 1), 15U);
+}
+
+static void htmm_test_get_accesses_from_idx(struct kunit *test)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < 32; idx++)
+		KUNIT_EXPECT_EQ(test, get_accesses_from_idx(idx),
+				htmm_ref_get_accesses_from_idx(idx));
+	/* the lower bound of bucket idx falls into bucket idx */
+	for (idx = 1; idx < 16; idx++)
+		KUNIT_EXPECT_EQ(test,
+				get_idx(get_accesses_from_idx(idx) - 1), idx);
+}
+
+static void htmm_test_get_skew_idx(struct kunit *test)
+{
+	unsigned long num;
+
+	for (num = 0; num < 16 * 1024; num++)
+		KUNIT_EXPECT_EQ(test, get_skew_idx(num),
+				htmm_ref_get_skew_idx(num));
+	KUNIT_EXPECT_EQ(test, get_skew_idx(ULONG_MAX), 20);
+}
+
+/* two-pass mean and M2 of the intervals, in the scaled unit of pginfo */
+static void htmm_ref_fluctuation(const u64 *times, int nr, u64 *mean,
+				 u64 *m2)
+{
+	u64 sum = 0;
+	int i;
+
+	*mean = 0;
+	*m2 = 0;
+	if (nr < 2)
+		return;
+
+	for (i = 1; i < nr; i++)
+		sum += (times[i] - times[i - 1]) << AP_SCALE_SHIFT;
+	*mean = div_u64(sum, nr - 1);
+	for (i = 1; i < nr; i++) {
+		s64 d = (s64)((times[i] - times[i - 1]) << AP_SCALE_SHIFT) -
+			(s64)*mean;
+
+		*m2 += (u64)((d * d) >> AP_SCALE_SHIFT);
+	}
+}
+
+static void htmm_test_update_page_fluctuation(struct kunit *test)
+{
+	static const u64 times[] = { 1000, 1100, 1400, 1450, 2450, 2460,
+				     2600, 2610, 4000, 4100 };
+	pginfo_t pginfo = {};
+	u64 mean, m2;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(times); i++) {
+		update_page_fluctuation(&pginfo, times[i]);
+		KUNIT_EXPECT_EQ(test, pginfo.adaptive_hit, (u32)i + 1);
+		KUNIT_EXPECT_EQ(test, pginfo.last_hit_time, times[i]);
+
+		htmm_ref_fluctuation(times, i + 1, &mean, &m2);
+		/* the online mean truncates once per sample */
+		KUNIT_EXPECT_LE(test, abs((s64)pginfo.mean_interval -
+					  (s64)mean), (s64)i + 1);
+		KUNIT_EXPECT_LE(test, abs((s64)pginfo.fluctuation - (s64)m2),
+				(s64)(m2 >> 7) + 2 * (s64)mean + 1);
+	}
+
+	/* a sample out of order is ignored */
+	update_page_fluctuation(&pginfo, times[0]);
+	KUNIT_EXPECT_EQ(test, pginfo.adaptive_hit, (u32)ARRAY_SIZE(times));
+	KUNIT_EXPECT_EQ(test, pginfo.last_hit_time, times[ARRAY_SIZE(times) - 1]);
+
+	/* evenly spaced samples have no fluctuation */
+	memset(&pginfo, 0, sizeof(pginfo));
+	for (i = 1; i <= 100; i++)
+		update_page_fluctuation(&pginfo, i * 500);
+	KUNIT_EXPECT_EQ(test, pginfo.mean_interval, 500ULL << AP_SCALE_SHIFT);
+	KUNIT_EXPECT_EQ(test, pginfo.fluctuation, 0ULL);
+}
+
+static bool htmm_heap_valid(struct event_heap *heap)
+{
+	u32 i;
+
+	for (i = 1; i < heap->size; i++)
+		if (heap->entries[(i - 1) / 2].event_hit_count >
+		    heap->entries[i].event_hit_count)
+			return false;
+	return true;
+}
+
+static void htmm_test_event_heap(struct kunit *test)
+{
+	struct event_heap heap;
+	pginfo_t pages[8];
+	u32 hits[8] = {};
+	int i, idx;
+
+	KUNIT_ASSERT_EQ(test, heap_init(&heap, 6), 0);
+
+	/* a fixed pattern that raises the root above its children */
+	for (i = 0; i < 64; i++) {
+		int p = (i * 5 + i / 3) % 8;
+
+		heap_update_or_insert(&heap, &pages[p]);
+		KUNIT_EXPECT_TRUE(test, htmm_heap_valid(&heap));
+		idx = heap_find(&heap, &pages[p]);
+		if (idx >= 0)
+			hits[p]++;
+		else
+			/* only a full heap drops a page */
+			KUNIT_EXPECT_EQ(test, heap.size, heap.capacity);
+	}
+
+	KUNIT_EXPECT_EQ(test, heap.size, 6U);
+	for (i = 0; i < 8; i++) {
+		idx = heap_find(&heap, &pages[i]);
+		if (idx < 0) {
+			KUNIT_EXPECT_EQ(test, hits[i], 0U);
+			continue;
+		}
+		KUNIT_EXPECT_EQ(test, heap.entries[idx].event_hit_count,
+				hits[i]);
+	}
+
+	/* sift down from the root after raising it by hand */
+	heap.entries[0].event_hit_count += 1000;
+	heap_sift_down(&heap, 0);
+	KUNIT_EXPECT_TRUE(test, htmm_heap_valid(&heap));
+
+	/* sift up from the last leaf after lowering it by hand */
+	heap.entries[heap.size - 1].event_hit_count = 0;
+	heap_sift_up(&heap, heap.size - 1);
+	KUNIT_EXPECT_TRUE(test, htmm_heap_valid(&heap));
+	KUNIT_EXPECT_EQ(test, heap.entries[0].event_hit_count, 0U);
+
+	heap_destroy(&heap);
+}
+
+static u64 htmm_ref_map_score_to_period(u32 v)
+{
+	if (v >= ADAPTIVE_SCALE)
+		return MIN_PERIOD;
+	return MAX_PERIOD - div_u64((u64)v * (MAX_PERIOD - MIN_PERIOD),
+				    ADAPTIVE_SCALE);
+}
+
+static void htmm_test_map_score_to_period(struct kunit *test)
+{
+	u64 prev = MAX_PERIOD;
+	u32 v;
+
+	KUNIT_EXPECT_EQ(test, map_score_to_period(0), MAX_PERIOD);
+	KUNIT_EXPECT_EQ(test, map_score_to_period(ADAPTIVE_SCALE), MIN_PERIOD);
+	KUNIT_EXPECT_EQ(test, map_score_to_period(U32_MAX), MIN_PERIOD);
+	KUNIT_EXPECT_EQ(test, map_score_to_period(ADAPTIVE_SCALE / 2),
+			101000ULL);
+
+	for (v = 0; v <= ADAPTIVE_SCALE + 10; v++) {
+		u64 period = map_score_to_period(v);
+
+		KUNIT_EXPECT_EQ(test, period, htmm_ref_map_score_to_period(v));
+		/* a higher score never samples less often */
+		KUNIT_EXPECT_LE(test, period, prev);
+		prev = period;
+	}
+}
+
+static void htmm_test_apply_ema_to_period(struct kunit *test)
+{
+	u64 cur, target;
+	int i;
+
+	for (cur = 0; cur <= 2 * MAX_PERIOD; cur += 997) {
+		for (target = MIN_PERIOD; target <= MAX_PERIOD;
+		     target += 9973) {
+			u64 ref = div_u64(EMA_ALPHA_NUM * target +
+					  (EMA_ALPHA_DEN - EMA_ALPHA_NUM) * cur,
+					  EMA_ALPHA_DEN);
+
+			ref = clamp(ref, MIN_PERIOD, MAX_PERIOD);
+			KUNIT_EXPECT_EQ(test, apply_ema_to_period(cur, target),
+					ref);
+		}
+	}
+
+	/* the target is a fixed point and is reached from both ends */
+	KUNIT_EXPECT_EQ(test, apply_ema_to_period(50000, 50000), 50000ULL);
+	cur = MAX_PERIOD;
+	for (i = 0; i < 64; i++)
+		cur = apply_ema_to_period(cur, 50000);
+	KUNIT_EXPECT_LE(test, cur - 50000, 3ULL);
+	cur = MIN_PERIOD;
+	for (i = 0; i < 64; i++)
+		cur = apply_ema_to_period(cur, 50000);
+	KUNIT_EXPECT_LE(test, 50000 - cur, 3ULL);
+}
+
+/* a saturated fast tier, as seen by the PMI, lowers its share of traffic */
+static void htmm_test_bw_balance(struct kunit *test)
+{
+	union perf_mem_data_src fast = {
+		.mem_lvl = PERF_MEM_LVL_HIT | PERF_MEM_LVL_LOC_RAM,
+	};
+	union perf_mem_data_src slow = {
+		.mem_lvl = PERF_MEM_LVL_HIT | PERF_MEM_LVL_REM_RAM1,
+	};
+	union perf_mem_data_src l3 = {
+		.mem_lvl = PERF_MEM_LVL_HIT | PERF_MEM_LVL_L3,
+	};
+	unsigned long saved_ewma[2] = { htmm_lat_ewma[0], htmm_lat_ewma[1] };
+	bool saved_balance = htmm_bw_balance;
+	struct htmm_ldlat_stat *st;
+	int i, j;
+
+	KUNIT_EXPECT_EQ(test, htmm_ldlat_tier(fast.val), 0);
+	KUNIT_EXPECT_EQ(test, htmm_ldlat_tier(slow.val), 1);
+	KUNIT_EXPECT_EQ(test, htmm_ldlat_tier(l3.val), -1);
+
+	htmm_lat_ewma[0] = htmm_lat_ewma[1] = 0;
+	htmm_ldlat_update(); /* catches up with the loads recorded so far */
+	st = get_cpu_ptr(&htmm_ldlat_stats);
+	for (i = 0; i < 100; i++) {
+		htmm_ldlat_record(st, fast.val, 300);
+		htmm_ldlat_record(st, slow.val, 150);
+		htmm_ldlat_record(st, l3.val, 70);
+	}
+	put_cpu_ptr(&htmm_ldlat_stats);
+	htmm_ldlat_update();
+	KUNIT_EXPECT_EQ(test, htmm_tier_latency(true), 300UL);
+	KUNIT_EXPECT_EQ(test, htmm_tier_latency(false), 150UL);
+
+	/* 90% of the hot samples come from the fast tier */
+	WRITE_ONCE(htmm_bw_balance, true);
+	htmm_fast_share_target = 1000;
+	for (i = 0; i < 5; i++) {
+		for (j = 0; j < 1000; j++)
+			htmm_account_share(j < 900 ? DRAMREAD : NVMREAD);
+		htmm_bw_update();
+	}
+	KUNIT_EXPECT_EQ(test, htmm_fast_share_target,
+			1000U - 5 * HTMM_BW_STEP);
+	KUNIT_EXPECT_FALSE(test, htmm_bw_promotion_allowed());
+	KUNIT_EXPECT_TRUE(test, htmm_bw_demote_warm());
+
+	/* without samples, the next update resets the target and the flags */
+	WRITE_ONCE(htmm_bw_balance, saved_balance);
+	htmm_bw_update();
+	KUNIT_EXPECT_EQ(test, htmm_fast_share_target, 1000U);
+	KUNIT_EXPECT_TRUE(test, htmm_bw_promotion_allowed());
+	htmm_lat_ewma[0] = saved_ewma[0];
+	htmm_lat_ewma[1] = saved_ewma[1];
+}
+
+#define HTMM_BENCH_ITERS 100000
+
+/* reports the average cost of @expr in cycles per 100 calls */
+#define htmm_bench(test, name, expr)					\
+do {									\
+	unsigned long i, sink = 0;					\
+	cycles_t start = get_cycles();					\
+									\
+	for (i = 0; i < HTMM_BENCH_ITERS; i++) {			\
+		sink += (expr);						\
+		OPTIMIZER_HIDE_VAR(sink);				\
+	}								\
+	kunit_info(test, "%s: %llu cycles per 100 calls\n", name,	\
+		   div_u64((u64)(get_cycles() - start) * 100,		\
+			   HTMM_BENCH_ITERS));				\
+} while (0)
+
+static void htmm_test_bench(struct kunit *test)
+{
+	struct event_heap heap;
+	pginfo_t *pages;
+	pginfo_t pginfo = {};
+
+	pages = kunit_kcalloc(test, 1024, sizeof(*pages), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pages);
+	KUNIT_ASSERT_EQ(test, heap_init(&heap, 1000), 0);
+
+	htmm_bench(test, "get_idx", get_idx(i * 37));
+	htmm_bench(test, "get_accesses_from_idx",
+		   get_accesses_from_idx(i & 15));
+	htmm_bench(test, "get_skew_idx", get_skew_idx(i & 0x3fff));
+	htmm_bench(test, "update_page_fluctuation",
+		   (update_page_fluctuation(&pginfo, 1000 + i * 100 + (i & 7)),
+		    0));
+	htmm_bench(test, "heap_update_or_insert",
+		   (heap_update_or_insert(&heap, &pages[(i * 7) & 1023]), 0));
+	htmm_bench(test, "map_score_to_period",
+		   map_score_to_period(i % (ADAPTIVE_SCALE + 1)));
+	htmm_bench(test, "apply_ema_to_period",
+		   apply_ema_to_period(MIN_PERIOD + i, MAX_PERIOD - i));
+
+	heap_destroy(&heap);
+}
+
+static struct kunit_case htmm_test_cases[] = {
+	KUNIT_CASE(htmm_test_get_idx),
+	KUNIT_CASE(htmm_test_get_accesses_from_idx),
+	KUNIT_CASE(htmm_test_get_skew_idx),
+	KUNIT_CASE(htmm_test_update_page_fluctuation),
+	KUNIT_CASE(htmm_test_event_heap),
+	KUNIT_CASE(htmm_test_map_score_to_period),
+	KUNIT_CASE(htmm_test_apply_ema_to_period),
+	KUNIT_CASE(htmm_test_bw_balance),
+	KUNIT_CASE(htmm_test_bench),
+	{},
+};
+
+static struct kunit_suite htmm_test_suite = {
+	.name = "htmm",
+	.test_cases = htmm_test_cases,
+};
+kunit_test_suite(htmm_test_suite);
+
+#endif /* _HTMM_TEST_H */
+
+#endif /* CONFIG_HTMM_KUNIT_TEST */
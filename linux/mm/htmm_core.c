@@ -15,10 +15,19 @@
 #include <linux/xarray.h>
 #include <linux/math.h>
 #include <linux/random.h>
+#include <linux/pagewalk.h>
+#include <linux/mmu_notifier.h>
+#include <linux/rmap.h>
+#include <linux/sched/mm.h>
+#include <linux/error-injection.h>
+#include <linux/task_work.h>
+#include <linux/sched/numa_balancing.h>
+#include <linux/hugetlb.h>
 #include <trace/events/htmm.h>
 
 #include "internal.h"
 #include <asm/pgtable.h>
+#include <asm/pgalloc.h>
 
 void htmm_mm_init(struct mm_struct *mm)
 {
@@ -62,8 +71,10 @@ void __prep_transhuge_page_for_htmm(struct mm_struct *mm, struct page *page)
 
 	if (hotness_factor < 0)
 		hotness_factor = 0;
+	/* nr_accesses only counts samples: try_to_unmap_clean() and the THP
+	 * bloat scanner tell untouched subpages by it
+	 */
 	pginfo.total_accesses = hotness_factor;
-	pginfo.nr_accesses = hotness_factor;
 	/* fourth~ tail pages */
 	for (i = 0; i < HPAGE_PMD_NR; i++) {
 		idx = 4 + i / 4;
@@ -100,6 +111,41 @@ void clear_transhuge_pginfo(struct page *page)
 	set_page_private(page, 0);
 }
 
+/* per node share of memcg->hotness_hg, under memcg->access_lock */
+void htmm_node_hg_add(struct mem_cgroup *memcg, int nid, unsigned int idx,
+		      unsigned long nr)
+{
+	memcg->nodeinfo[nid]->hotness_hg[idx] += nr;
+}
+
+void htmm_node_hg_sub(struct mem_cgroup *memcg, int nid, unsigned int idx,
+		      unsigned long nr)
+{
+	unsigned long *hg = &memcg->nodeinfo[nid]->hotness_hg[idx];
+
+	*hg -= min(*hg, nr);
+}
+
+/* a migrated page takes its histogram share along if it was counted in
+ * the current cooling period
+ */
+void htmm_node_hg_move(struct mem_cgroup *memcg, struct page *page,
+		       struct page *newpage, unsigned int idx,
+		       unsigned int cooling_clock, unsigned long nr)
+{
+	int nid = page_to_nid(page), new_nid = page_to_nid(newpage);
+
+	if (!memcg || !memcg->htmm_enabled || nid == new_nid)
+		return;
+
+	spin_lock(&memcg->access_lock);
+	if (cooling_clock == memcg->cooling_clock) {
+		htmm_node_hg_sub(memcg, nid, idx, nr);
+		htmm_node_hg_add(memcg, new_nid, idx, nr);
+	}
+	spin_unlock(&memcg->access_lock);
+}
+
 void copy_transhuge_pginfo(struct page *page, struct page *newpage)
 {
 	int i, idx, offset;
@@ -121,6 +167,8 @@ void copy_transhuge_pginfo(struct page *page, struct page *newpage)
 	newpage[3].idx = page[3].idx;
 
 	SetPageHtmm(&newpage[3]);
+	htmm_node_hg_move(page_memcg(page), page, newpage, page[3].idx,
+			  page[3].cooling_clock, HPAGE_PMD_NR);
 
 	for (i = 0; i < HPAGE_PMD_NR; i++) {
 		idx = 4 + i / 4;
@@ -148,6 +196,12 @@ pginfo_t *get_compound_pginfo(struct page *page, unsigned long address)
 	return &(page[idx].compound_pginfo[offset]);
 }
 
+/* whether subpage @i of the THP @page has been sampled */
+bool htmm_thp_subpage_accessed(struct page *page, unsigned int i)
+{
+	return page[4 + i / 4].compound_pginfo[i % 4].nr_accesses > 0;
+}
+
 void check_transhuge_cooling(void *arg, struct page *page, bool locked)
 {
 	struct mem_cgroup *memcg =
@@ -197,6 +251,9 @@ void check_transhuge_cooling(void *arg, struct page *page, bool locked)
 			/* halves access counts of subpages */
 			for (j = 0; j < diff; j++)
 				pginfo->total_accesses >>= 1;
+			pginfo->nr_walks >>= min(diff, 8U);
+			pginfo->read_nodes = 0;
+			pginfo->written = false;
 
 			/* updates estimated base page histogram */
 			cur_idx = get_idx(pginfo->total_accesses);
@@ -210,6 +267,8 @@ void check_transhuge_cooling(void *arg, struct page *page, bool locked)
 		cur_idx = meta_page->total_accesses;
 		cur_idx = get_idx(cur_idx);
 		memcg->hotness_hg[cur_idx] += HPAGE_PMD_NR;
+		htmm_node_hg_add(memcg, page_to_nid(page), cur_idx,
+				 HPAGE_PMD_NR);
 		meta_page->idx = cur_idx;
 
 		/* updates skewness */
@@ -265,12 +324,16 @@ void check_base_cooling(pginfo_t *pginfo, struct page *page, bool locked)
 		/* halves access count */
 		for (j = 0; j < diff; j++)
 			pginfo->total_accesses >>= 1;
+		pginfo->nr_walks >>= min(diff, 8U);
+		pginfo->read_nodes = 0;
+		pginfo->written = false;
 		//if (pginfo->total_accesses == 0)
 		//  pginfo->total_accesses = 1;
 
 		cur_idx = get_idx(pginfo->total_accesses);
 		memcg->hotness_hg[cur_idx]++;
 		memcg->ebp_hotness_hg[cur_idx]++;
+		htmm_node_hg_add(memcg, page_to_nid(page), cur_idx, 1);
 
 		pginfo->cooling_clock = memcg_cclock;
 	} else
@@ -385,6 +448,7 @@ void check_failed_list(struct mem_cgroup_per_node *pn, struct list_head *tmp,
 
 		spin_lock(&memcg->access_lock);
 		memcg->hotness_hg[idx] += HPAGE_PMD_NR;
+		htmm_node_hg_add(memcg, page_to_nid(page), idx, HPAGE_PMD_NR);
 		spin_unlock(&memcg->access_lock);
 	}
 }
@@ -599,7 +663,32 @@ void free_pginfo_pte(struct page *pte)
 	ClearPageHtmm(pte);
 }
 
-void uncharge_htmm_pte(pte_t *pte, struct mem_cgroup *memcg)
+static void htmm_pte_free_rcu(struct rcu_head *head)
+{
+	struct page *pte = container_of(head, struct page, rcu_head);
+
+	free_pginfo_pte(pte);
+	__free_page(pte);
+}
+
+/* Frees a PTE page unhooked outside of mmu_gather (e.g. by khugepaged,
+ * under the mmap lock). ksamplingd may still be walking it, see
+ * ___pte_free_tlb(), so the page and its pginfo go after a grace period;
+ * rcu_head does not overlap page->pginfo.
+ */
+void htmm_pte_free(struct mm_struct *mm, struct page *pte)
+{
+	if (!mm->htmm_enabled) {
+		pte_free(mm, pte);
+		return;
+	}
+	/* pte_free() in two halves */
+	pgtable_pte_page_dtor(pte);
+	call_rcu(&pte->rcu_head, htmm_pte_free_rcu);
+}
+
+void uncharge_htmm_pte(pte_t *pte, struct page *page,
+		       struct mem_cgroup *memcg)
 {
 	struct page *pte_page;
 	unsigned int idx;
@@ -622,6 +711,7 @@ void uncharge_htmm_pte(pte_t *pte, struct mem_cgroup *memcg)
 		memcg->hotness_hg[idx]--;
 	if (memcg->ebp_hotness_hg[idx] > 0)
 		memcg->ebp_hotness_hg[idx]--;
+	htmm_node_hg_sub(memcg, page_to_nid(page), idx, 1);
 	spin_unlock(&memcg->access_lock);
 }
 
@@ -645,6 +735,7 @@ void uncharge_htmm_page(struct page *page, struct mem_cgroup *memcg)
 			memcg->hotness_hg[idx] -= nr_pages;
 		else
 			memcg->hotness_hg[idx] = 0;
+		htmm_node_hg_sub(memcg, page_to_nid(page), idx, nr_pages);
 
 		for (i = 0; i < HPAGE_PMD_NR; i++) {
 			int base_idx = 4 + i / 4;
@@ -660,6 +751,297 @@ void uncharge_htmm_page(struct page *page, struct mem_cgroup *memcg)
 	}
 }
 
+/* cxl mode: the cpu-less nodes (expanders) form the slow tier */
+bool htmm_node_is_toptier(int nid)
+{
+	if (htmm_cxl_mode)
+		return node_state(nid, N_CPU);
+	return node_is_toptier(nid);
+}
+
+/* returns the fast tier node closest to @nid (or @nid itself) */
+int htmm_toptier_node(int nid)
+{
+	int target;
+
+	if (htmm_node_is_toptier(nid))
+		return nid;
+
+	target = htmm_promotion_target(nid);
+	return target == NUMA_NO_NODE ? nid : target;
+}
+
+static int htmm_lowertier_node(int nid)
+{
+	int target;
+
+	if (!htmm_node_is_toptier(nid))
+		return nid;
+
+	target = htmm_demotion_target(nid);
+	return target == NUMA_NO_NODE ? nid : target;
+}
+
+/* Page table placement.
+ * PTE pages of htmm tasks are allocated on the fast tier (see pte_alloc_one())
+ * since they are walked on every TLB miss. After each cooling, the page
+ * tables of the memcg are revisited: the pginfo array of a PTE page that
+ * maps no warm page is moved to the slow tier, and a PTE page that maps hot
+ * pages or is walked often (htmm_region_walk_heavy()) but lives on the slow
+ * tier is migrated to the fast tier.
+ */
+#define HTMM_PGTABLE_BATCH 32
+
+struct htmm_pgtable_walk {
+	struct mem_cgroup *memcg;
+	unsigned int nr_hot;
+	unsigned long hot_addr[HTMM_PGTABLE_BATCH];
+	int hot_nid[HTMM_PGTABLE_BATCH];
+	/* replaced pginfo arrays and page tables, freed after a grace period */
+	unsigned int nr_stale;
+	pginfo_t *stale_pginfo[HTMM_PGTABLE_BATCH];
+	struct page *stale_pte[HTMM_PGTABLE_BATCH];
+};
+
+static bool pte_page_is_hot(struct mem_cgroup *memcg, pte_t *pte,
+			    pginfo_t *pginfo)
+{
+	int i;
+
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		if (!pte_present(pte[i]))
+			continue;
+		if (get_idx(pginfo[i].total_accesses) >= memcg->warm_threshold)
+			return true;
+	}
+	return false;
+}
+
+/* Whether the STLB misses sampled in the region mapped by the PTE page of
+ * @pte reach htmm_walk_thres: the page table is walked often enough to
+ * belong on the fast tier, and a huge page would save these walks.
+ */
+bool htmm_region_walk_heavy(pte_t *pte)
+{
+	struct page *pte_page = virt_to_page((unsigned long)pte);
+	unsigned int thres = READ_ONCE(htmm_walk_thres);
+	unsigned int nr_walks = 0;
+	pginfo_t *pginfo;
+	int i;
+
+	if (!htmm_stlb_sampling || !thres || !PageHtmm(pte_page))
+		return false;
+
+	pginfo = READ_ONCE(pte_page->pginfo);
+	if (!pginfo)
+		return false;
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		nr_walks += pginfo[i].nr_walks;
+		if (nr_walks >= thres)
+			return true;
+	}
+	return false;
+}
+
+static int htmm_pgtable_pmd_entry(pmd_t *pmd, unsigned long addr,
+				  unsigned long next, struct mm_walk *walk)
+{
+	struct htmm_pgtable_walk *hw = walk->private;
+	pginfo_t *pginfo, *new_pginfo = NULL, *old_pginfo = NULL;
+	struct page *pte_page;
+	spinlock_t *ptl;
+	pte_t *pte;
+	int nid, target;
+	bool hot, walked;
+
+	if (pmd_trans_unstable(pmd))
+		return 0;
+
+	pte = pte_offset_map_lock(walk->mm, pmd, addr, &ptl);
+	pte_page = virt_to_page((unsigned long)pte);
+	if (!PageHtmm(pte_page))
+		goto pte_unlock;
+
+	pginfo = pte_page->pginfo;
+	hot = pte_page_is_hot(hw->memcg, pte - pte_index(addr), pginfo);
+	walked = htmm_region_walk_heavy(pte);
+
+	/* pginfo array follows the hotness of the region */
+	nid = page_to_nid(virt_to_page(pginfo));
+	target = hot ? htmm_toptier_node(nid) : htmm_lowertier_node(nid);
+	if (target != nid && hw->nr_stale < HTMM_PGTABLE_BATCH) {
+		new_pginfo = kmem_cache_alloc_node(pginfo_cache,
+				GFP_NOWAIT | __GFP_NOWARN, target);
+		if (new_pginfo &&
+		    page_to_nid(virt_to_page(new_pginfo)) == target) {
+			memcpy(new_pginfo, pginfo,
+			       sizeof(pginfo_t) * PTRS_PER_PTE);
+			WRITE_ONCE(pte_page->pginfo, new_pginfo);
+			/* lockless samplers may still update the old one */
+			hw->stale_pginfo[hw->nr_stale++] = pginfo;
+			count_vm_event(HTMM_PGINFO_MOVED);
+		} else {
+			/* slab fell back to another node */
+			old_pginfo = new_pginfo;
+		}
+	}
+
+	/* page table itself is only promoted, under the mmap write lock */
+	nid = page_to_nid(pte_page);
+	if ((hot || walked) && !htmm_node_is_toptier(nid) &&
+	    hw->nr_hot < HTMM_PGTABLE_BATCH) {
+		target = htmm_toptier_node(nid);
+		if (target != nid) {
+			hw->hot_addr[hw->nr_hot] = addr & PMD_MASK;
+			hw->hot_nid[hw->nr_hot] = target;
+			hw->nr_hot++;
+		}
+	}
+
+pte_unlock:
+	pte_unmap_unlock(pte, ptl);
+	if (old_pginfo)
+		kmem_cache_free(pginfo_cache, old_pginfo);
+	cond_resched();
+	return 0;
+}
+
+static const struct mm_walk_ops htmm_pgtable_walk_ops = {
+	.pmd_entry = htmm_pgtable_pmd_entry,
+};
+
+/* Replaces the PTE page mapping [haddr, haddr + PMD_SIZE) by a copy on @nid.
+ * Must be called with the mmap write lock held. The anon_vma lock keeps rmap
+ * walkers away, the same way khugepaged does for collapsing.
+ */
+static struct page *htmm_migrate_pte_page(struct mm_struct *mm,
+					  unsigned long haddr, int nid)
+{
+	struct vm_area_struct *vma;
+	struct mmu_notifier_range range;
+	struct page *old = NULL, *new;
+	spinlock_t *pml, *ptl;
+	pmd_t *pmd;
+
+	vma = find_vma(mm, haddr);
+	if (!vma || !vma_is_anonymous(vma) || !vma->anon_vma)
+		return NULL;
+	/* the PTE page must not be shared with other vmas */
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return NULL;
+
+	pmd = mm_find_pmd(mm, haddr);
+	if (!pmd)
+		return NULL;
+
+	new = alloc_pages_node(nid, GFP_PGTABLE_USER | __GFP_THISNODE |
+			       __GFP_NOWARN, 0);
+	if (!new)
+		return NULL;
+	if (!pgtable_pte_page_ctor(new)) {
+		__free_page(new);
+		return NULL;
+	}
+
+	anon_vma_lock_write(vma->anon_vma);
+	mmu_notifier_range_init(&range, MMU_NOTIFY_CLEAR, 0, NULL, mm,
+				haddr, haddr + HPAGE_PMD_SIZE);
+	mmu_notifier_invalidate_range_start(&range);
+
+	pml = pmd_lock(mm, pmd);
+	if (!pmd_present(*pmd) || pmd_trans_huge(*pmd) || pmd_devmap(*pmd))
+		goto pmd_unlock;
+
+	old = pmd_page(*pmd);
+	ptl = pte_lockptr(mm, pmd);
+	if (ptl != pml)
+		spin_lock_nested(ptl, SINGLE_DEPTH_NESTING);
+	/* no more hardware A/D updates to the old table after this */
+	pmdp_collapse_flush(vma, haddr, pmd);
+	copy_page(page_address(new), page_address(old));
+	if (PageHtmm(old)) {
+		new->pginfo = old->pginfo;
+		old->pginfo = NULL;
+		ClearPageHtmm(old);
+		SetPageHtmm(new);
+	}
+	if (ptl != pml)
+		spin_unlock(ptl);
+
+	smp_wmb(); /* make the copied ptes visible before pmd_populate */
+	pmd_populate(mm, pmd, new);
+pmd_unlock:
+	spin_unlock(pml);
+	mmu_notifier_invalidate_range_end(&range);
+	anon_vma_unlock_write(vma->anon_vma);
+
+	if (!old)
+		pte_free(mm, new);
+	/* the old table is freed by the caller after a grace period */
+	return old;
+}
+
+static int htmm_rebalance_task_pgtables(struct task_struct *task, void *arg)
+{
+	struct htmm_pgtable_walk *hw = arg;
+	struct mm_struct *mm;
+	struct page *old;
+	unsigned int i, nr_old;
+
+	/* threads share the page tables of their leader */
+	if (!thread_group_leader(task))
+		return 0;
+
+	mm = get_task_mm(task);
+	if (!mm)
+		return 0;
+	if (!mm->htmm_enabled)
+		goto out;
+
+	hw->nr_hot = 0;
+	hw->nr_stale = 0;
+	if (!mmap_read_trylock(mm))
+		goto out;
+	walk_page_range(mm, 0, mm->highest_vm_end, &htmm_pgtable_walk_ops, hw);
+	mmap_read_unlock(mm);
+
+	nr_old = 0;
+	if (hw->nr_hot && mmap_write_trylock(mm)) {
+		for (i = 0; i < hw->nr_hot; i++) {
+			old = htmm_migrate_pte_page(mm, hw->hot_addr[i],
+						    hw->hot_nid[i]);
+			if (!old)
+				continue;
+			hw->stale_pte[nr_old++] = old;
+			count_vm_event(HTMM_PGTABLE_PROMOTED);
+		}
+		mmap_write_unlock(mm);
+	}
+
+	/* wait for lockless samplers before freeing what they may use */
+	if (hw->nr_stale || nr_old)
+		synchronize_rcu();
+	for (i = 0; i < hw->nr_stale; i++)
+		kmem_cache_free(pginfo_cache, hw->stale_pginfo[i]);
+	for (i = 0; i < nr_old; i++)
+		pte_free(mm, hw->stale_pte[i]);
+out:
+	mmput(mm);
+	return 0;
+}
+
+void htmm_rebalance_pgtables(struct mem_cgroup *memcg)
+{
+	struct htmm_pgtable_walk hw = {
+		.memcg = memcg,
+	};
+
+	if (!htmm_pgtable_placement || mem_cgroup_is_root(memcg))
+		return;
+
+	mem_cgroup_scan_tasks(memcg, htmm_rebalance_task_pgtables, &hw);
+}
+
 static bool need_cooling(struct mem_cgroup *memcg)
 {
 	struct mem_cgroup_per_node *pn;
@@ -676,22 +1058,75 @@ static bool need_cooling(struct mem_cgroup *memcg)
 	return false;
 }
 
-static void set_lru_cooling(struct mm_struct *mm)
+/* protected by memcg->access_lock, returns the number of nodes to cool */
+static unsigned int set_lru_cooling(struct mem_cgroup *memcg)
 {
-	struct mem_cgroup *memcg = get_mem_cgroup_from_mm(mm);
 	struct mem_cgroup_per_node *pn;
+	unsigned int nr_nodes = 0;
 	int nid;
 
-	if (!memcg || !memcg->htmm_enabled)
-		return;
-
 	for_each_node_state (nid, N_MEMORY) {
 		pn = memcg->nodeinfo[nid];
 		if (!pn)
 			continue;
 
 		WRITE_ONCE(pn->need_cooling, true);
+		nr_nodes++;
+	}
+	return nr_nodes;
+}
+
+/* protected by memcg->access_lock. the histograms now hold every node's
+ * cooled pages: they are saved for the threshold adjustment.
+ */
+static void cooling_complete(struct mem_cgroup *memcg)
+{
+	memcpy(memcg->hotness_snap, memcg->hotness_hg,
+	       sizeof(memcg->hotness_snap));
+	memcpy(memcg->ebp_hotness_snap, memcg->ebp_hotness_hg,
+	       sizeof(memcg->ebp_hotness_snap));
+	memcg->cooled = true;
+}
+
+/* called by the kmigraterd of @nid once its share of the cooling pass is
+ * done; the last node to finish completes the pass and gets true
+ */
+bool htmm_cooling_done(struct mem_cgroup *memcg, int nid)
+{
+	struct mem_cgroup_per_node *pn = memcg->nodeinfo[nid];
+	bool last = false;
+
+	spin_lock(&memcg->access_lock);
+	if (pn->need_cooling) {
+		WRITE_ONCE(pn->need_cooling, false);
+		if (!--memcg->nr_cooling_nodes) {
+			cooling_complete(memcg);
+			count_vm_event(HTMM_COOLING_DONE);
+			last = true;
+		}
+	}
+	spin_unlock(&memcg->access_lock);
+	return last;
+}
+
+/* protected by memcg->access_lock. nodes that overran htmm_cooling_timeout
+ * leave the rest of their pages to be cooled when they are next sampled.
+ */
+static void cooling_expire(struct mem_cgroup *memcg)
+{
+	struct mem_cgroup_per_node *pn;
+	int nid;
+
+	for_each_node_state (nid, N_MEMORY) {
+		pn = memcg->nodeinfo[nid];
+		if (!pn || !pn->need_cooling)
+			continue;
+
+		WRITE_ONCE(pn->need_cooling, false);
+		count_vm_event(HTMM_COOLING_EXPIRED);
 	}
+	memcg->nr_cooling_nodes = 0;
+	cooling_complete(memcg);
 }
 
 void set_lru_adjusting(struct mem_cgroup *memcg, bool inc_thres)
@@ -710,6 +1145,86 @@ void set_lru_adjusting(struct mem_cgroup *memcg, bool inc_thres)
 	}
 }
 
+/* BPF policy hooks
+ * Each hook is an empty function that a BPF_MODIFY_RETURN (fmod_ret) program
+ * can attach to. Returning 0 keeps the built-in decision, so htmm behaves
+ * as before while no program is attached; a non-zero return overrides it.
+ */
+
+/* the value added to total_accesses for this sample */
+noinline int htmm_bpf_sample_weight(struct mem_cgroup *memcg, pginfo_t *pginfo,
+				    int event_id)
+{
+	return 0;
+}
+ALLOW_ERROR_INJECTION(htmm_bpf_sample_weight, ERRNO);
+
+/* enum htmm_bpf_verdict: is the page hot (promoted / kept active) */
+noinline int htmm_bpf_promotion_candidate(struct mem_cgroup *memcg,
+					  struct page *page, unsigned int idx)
+{
+	return 0;
+}
+ALLOW_ERROR_INJECTION(htmm_bpf_promotion_candidate, ERRNO);
+
+/* enum htmm_bpf_verdict: may the page be demoted */
+noinline int htmm_bpf_demotion_victim(struct mem_cgroup *memcg,
+				      struct page *page, unsigned int idx)
+{
+	return 0;
+}
+ALLOW_ERROR_INJECTION(htmm_bpf_demotion_victim, ERRNO);
+
+/* enum htmm_bpf_verdict: should the huge page be split */
+noinline int htmm_bpf_split_huge_page(struct mem_cgroup *memcg,
+				      struct page *meta)
+{
+	return 0;
+}
+ALLOW_ERROR_INJECTION(htmm_bpf_split_huge_page, ERRNO);
+
+/* the sample period of @event; @period is the built-in choice */
+noinline int htmm_bpf_event_period(int event, u32 score, u64 period)
+{
+	return 0;
+}
+ALLOW_ERROR_INJECTION(htmm_bpf_event_period, ERRNO);
+
+bool htmm_is_promotion_candidate(struct mem_cgroup *memcg, struct page *page,
+				 unsigned int idx)
+{
+	switch (htmm_bpf_promotion_candidate(memcg, page, idx)) {
+	case HTMM_BPF_TRUE:
+		return true;
+	case HTMM_BPF_FALSE:
+		return false;
+	}
+	return idx >= memcg->active_threshold;
+}
+
+bool htmm_is_demotion_victim(struct mem_cgroup *memcg, struct page *page,
+			     unsigned int idx)
+{
+	switch (htmm_bpf_demotion_victim(memcg, page, idx)) {
+	case HTMM_BPF_TRUE:
+		return true;
+	case HTMM_BPF_FALSE:
+		return false;
+	}
+	/* bandwidth balancing: warm pages may go too, see htmm_bw_update() */
+	if (htmm_bw_demote_warm())
+		return idx < memcg->active_threshold;
+	return idx < memcg->warm_threshold;
+}
+
+static unsigned long htmm_sample_weight(struct mem_cgroup *memcg,
+					pginfo_t *pginfo, int event_id)
+{
+	int weight = htmm_bpf_sample_weight(memcg, pginfo, event_id);
+
+	return weight > 0 ? weight : HPAGE_PMD_NR;
+}
+
 bool check_split_huge_page(struct mem_cgroup *memcg, struct page *meta,
 			   bool hot)
 {
@@ -730,6 +1245,13 @@ bool check_split_huge_page(struct mem_cgroup *memcg, struct page *meta,
 		return false;
 	}
 
+	switch (htmm_bpf_split_huge_page(memcg, meta)) {
+	case HTMM_BPF_TRUE:
+		return true;
+	case HTMM_BPF_FALSE:
+		return false;
+	}
+
 	/* check split thres */
 	if (meta->skewness_idx < split_thres_tail)
 		return false;
@@ -856,12 +1378,149 @@ lru_unlock:
 		BUG();
 }
 
-static void update_base_page(struct vm_area_struct *vma, struct page *page,
-			     pginfo_t *pginfo, u64 timestamp, int event_id)
+/* the nodes of a sample being resolved by update_pginfo() */
+struct htmm_sample_nid {
+	int cpu_nid;	/* node of the cpu whose PEBS buffer held the sample */
+	int page_nid;	/* set to the node of the sampled page */
+};
+
+/*
+ * Replication candidates: pages read from several nodes without any
+ * MEMWRITE sample since the last cooling. The reader node is the node of
+ * the cpu that took the sample. Detection only: no replica is created, the
+ * candidates are just counted.
+ */
+static bool htmm_is_replica_candidate(pginfo_t *pginfo)
+{
+	return htmm_replica_detect && !pginfo->written &&
+	       hweight16(pginfo->read_nodes) > 1;
+}
+
+static void htmm_track_replication(pginfo_t *pginfo, int event_id,
+				   struct htmm_sample_nid *snid)
+{
+	bool candidate;
+
+	if (!htmm_replica_detect || snid->cpu_nid == NUMA_NO_NODE)
+		return;
+
+	candidate = htmm_is_replica_candidate(pginfo);
+	if (event_id == MEMWRITE) {
+		/* a replica would have to collapse back to one copy here */
+		if (candidate)
+			count_vm_event(HTMM_REPLICA_CANDIDATE_WRITE);
+		pginfo->written = true;
+		return;
+	}
+
+	if (snid->cpu_nid >= BITS_PER_TYPE(pginfo->read_nodes))
+		return;
+	pginfo->read_nodes |= 1U << snid->cpu_nid;
+	if (!candidate && htmm_is_replica_candidate(pginfo))
+		count_vm_event(HTMM_REPLICA_CANDIDATE);
+}
+
+/*
+ * Co-scheduling: ksamplingd keeps a majority vote over the nodes of the fast
+ * tier pages each task hits. When the winner is a remote node and the task's
+ * own node has no room left for the hot set, moving the task is cheaper than
+ * moving the pages (which would first need a demotion). The vote is then
+ * fed to NUMA balancing as private hinting faults on the winning node from
+ * the task's own context, so that task placement picks it as preferred node.
+ */
+#define HTMM_COSCHED_VOTES	64
+#define HTMM_COSCHED_MAX_VOTES	256
+
+static void htmm_numa_hint_work(struct callback_head *work)
+{
+	struct task_struct *p = current;
+	int nid = READ_ONCE(p->htmm_hot_nid);
+	unsigned int votes = READ_ONCE(p->htmm_hot_nid_votes);
+
+	work->next = work; /* protect against double add */
+	if (nid == NUMA_NO_NODE || !votes || (p->flags & PF_EXITING))
+		return;
+
+	task_numa_fault(cpu_pid_to_cpupid(raw_smp_processor_id(), p->pid), nid,
+			votes, TNF_NO_GROUP);
+	WRITE_ONCE(p->htmm_hot_nid_votes, 0);
+}
+
+void htmm_task_init(struct task_struct *p)
+{
+	p->htmm_hot_nid = NUMA_NO_NODE;
+	p->htmm_hot_nid_votes = 0;
+	p->htmm_numa_work.next = &p->htmm_numa_work;
+	init_task_work(&p->htmm_numa_work, htmm_numa_hint_work);
+}
+
+static void __htmm_coschedule_vote(struct task_struct *p,
+				   struct mem_cgroup *memcg, int page_nid)
+{
+	struct callback_head *work = &p->htmm_numa_work;
+	unsigned int votes = READ_ONCE(p->htmm_hot_nid_votes);
+	int task_nid;
+
+	if (p->flags & (PF_EXITING | PF_KTHREAD))
+		return;
+
+	if (READ_ONCE(p->htmm_hot_nid) == page_nid) {
+		votes = min(votes + 1, HTMM_COSCHED_MAX_VOTES);
+	} else if (votes) {
+		votes--;
+	} else {
+		WRITE_ONCE(p->htmm_hot_nid, page_nid);
+		votes = 1;
+	}
+	WRITE_ONCE(p->htmm_hot_nid_votes, votes);
+
+	if (votes < HTMM_COSCHED_VOTES || work->next != work)
+		return;
+
+	task_nid = cpu_to_node(task_cpu(p));
+	if (task_nid == page_nid || htmm_node_has_room(task_nid, memcg))
+		return;
+
+	if (!task_work_add(p, work, TWA_RESUME))
+		count_vm_event(HTMM_COSCHED_HINT);
+}
+
+/* the vote goes to the sampled thread, not to its thread group leader */
+static void htmm_coschedule_vote(pid_t tid, struct mem_cgroup *memcg,
+				 int page_nid)
+{
+	struct task_struct *p;
+
+	if (!htmm_coschedule)
+		return;
+
+	rcu_read_lock();
+	p = find_task_by_vpid(tid);
+	if (p)
+		get_task_struct(p);
+	rcu_read_unlock();
+	if (!p)
+		return;
+
+	__htmm_coschedule_vote(p, memcg, page_nid);
+	put_task_struct(p);
+}
+
+/* updates the access stat of a base page; returns true if the page is hot */
+static bool __update_base_page(struct mem_cgroup *memcg, struct page *page,
+			       pginfo_t *pginfo, u64 timestamp, int event_id,
+			       struct htmm_sample_nid *snid)
 {
-	struct mem_cgroup *memcg = get_mem_cgroup_from_mm(vma->vm_mm);
 	unsigned long prev_accessed, prev_idx, cur_idx;
-	bool hot;
+
+	if (htmm_walk_event(event_id)) {
+		check_base_cooling(pginfo, page, false);
+		if (pginfo->nr_walks < U8_MAX)
+			pginfo->nr_walks++;
+		/* the hotness is unchanged, so is the lru */
+		return htmm_is_promotion_candidate(memcg, page,
+				get_idx(pginfo->total_accesses));
+	}
 
 	// 🆕 Phase 3.1: 统计Event采样开销
 	if (event_id >= 0 && event_id < 9) {
@@ -877,10 +1536,11 @@ static void update_base_page(struct vm_area_struct *vma, struct page *page,
 
 	/* check cooling status and perform cooling if the page needs to be cooled */
 	check_base_cooling(pginfo, page, false);
+	htmm_track_replication(pginfo, event_id, snid);
 
 	prev_accessed = pginfo->total_accesses;
 	pginfo->nr_accesses++;
-	pginfo->total_accesses += HPAGE_PMD_NR;
+	pginfo->total_accesses += htmm_sample_weight(memcg, pginfo, event_id);
 
 	prev_idx = get_idx(prev_accessed);
 	cur_idx = get_idx(pginfo->total_accesses);
@@ -891,6 +1551,8 @@ static void update_base_page(struct vm_area_struct *vma, struct page *page,
 		if (memcg->hotness_hg[prev_idx] > 0)
 			memcg->hotness_hg[prev_idx]--;
 		memcg->hotness_hg[cur_idx]++;
+		htmm_node_hg_sub(memcg, page_to_nid(page), prev_idx, 1);
+		htmm_node_hg_add(memcg, page_to_nid(page), cur_idx, 1);
 
 		if (memcg->ebp_hotness_hg[prev_idx] > 0)
 			memcg->ebp_hotness_hg[prev_idx]--;
@@ -906,8 +1568,11 @@ static void update_base_page(struct vm_area_struct *vma, struct page *page,
 
 	spin_unlock(&memcg->access_lock);
 
-	hot = cur_idx >= memcg->active_threshold;
+	return htmm_is_promotion_candidate(memcg, page, cur_idx);
+}
 
+static void update_base_page_lru(struct page *page, bool hot)
+{
 	if (PageActive(page) && !hot)
 		move_page_to_inactive_lru(page);
 	else if (!PageActive(page) && hot)
@@ -919,10 +1584,21 @@ static void update_base_page(struct vm_area_struct *vma, struct page *page,
 		move_page_to_inactive_lru(page);
 }
 
-static void update_huge_page(struct vm_area_struct *vma, pmd_t *pmd,
-			     struct page *page, unsigned long address)
+static void update_base_page(struct mem_cgroup *memcg, struct page *page,
+			     pginfo_t *pginfo, u64 timestamp, int event_id,
+			     struct htmm_sample_nid *snid)
+{
+	bool hot;
+
+	hot = __update_base_page(memcg, page, pginfo, timestamp, event_id,
+				 snid);
+	update_base_page_lru(page, hot);
+}
+
+static void update_huge_page(struct mem_cgroup *memcg, struct page *page,
+			     unsigned long address, int event_id,
+			     struct htmm_sample_nid *snid)
 {
-	struct mem_cgroup *memcg = get_mem_cgroup_from_mm(vma->vm_mm);
 	struct page *meta_page;
 	pginfo_t *pginfo;
 	unsigned long prev_idx, cur_idx;
@@ -934,10 +1610,16 @@ static void update_huge_page(struct vm_area_struct *vma, pmd_t *pmd,
 
 	/* check cooling status */
 	check_transhuge_cooling((void *)memcg, page, false);
+	if (htmm_walk_event(event_id)) {
+		if (pginfo->nr_walks < U8_MAX)
+			pginfo->nr_walks++;
+		return;
+	}
+	htmm_track_replication(pginfo, event_id, snid);
 
 	pginfo_prev = pginfo->total_accesses;
 	pginfo->nr_accesses++;
-	pginfo->total_accesses += HPAGE_PMD_NR;
+	pginfo->total_accesses += htmm_sample_weight(memcg, pginfo, event_id);
 
 	meta_page->total_accesses++;
 
@@ -976,6 +1658,10 @@ static void update_huge_page(struct vm_area_struct *vma, pmd_t *pmd,
 			memcg->hotness_hg[prev_idx] = 0;
 
 		memcg->hotness_hg[cur_idx] += HPAGE_PMD_NR;
+		htmm_node_hg_sub(memcg, page_to_nid(page), prev_idx,
+				 HPAGE_PMD_NR);
+		htmm_node_hg_add(memcg, page_to_nid(page), cur_idx,
+				 HPAGE_PMD_NR);
 		spin_unlock(&memcg->access_lock);
 	}
 	meta_page->idx = cur_idx;
@@ -983,7 +1669,7 @@ static void update_huge_page(struct vm_area_struct *vma, pmd_t *pmd,
 	if (pg_split)
 		return;
 
-	hot = cur_idx >= memcg->active_threshold;
+	hot = htmm_is_promotion_candidate(memcg, page, cur_idx);
 	if (PageActive(page) && !hot) {
 		move_page_to_inactive_lru(page);
 	} else if (!PageActive(page) && hot) {
@@ -996,9 +1682,359 @@ static void update_huge_page(struct vm_area_struct *vma, pmd_t *pmd,
 		move_page_to_inactive_lru(page);
 }
 
-static int __update_pte_pginfo(struct vm_area_struct *vma, pmd_t *pmd,
+/* 1: the page is in the fast tier, 2: the page is in the slow tier */
+static int htmm_page_tier(struct page *page, struct htmm_sample_nid *snid)
+{
+	snid->page_nid = page_to_nid(page);
+	return htmm_node_is_toptier(snid->page_nid) ? 1 : 2;
+}
+
+/*
+ * hugetlb pages are neither on the LRU nor charged to the memcg, and their
+ * tail pages are owned by hugetlb, so their hotness lives in a side table:
+ * a record per head page, indexed by pfn and created on the first sample.
+ * Records are dropped by free_huge_page() and follow the page through
+ * move_hugetlb_state(). Lock order: htmm_hugetlb_xa, then pn->hugetlb_lock;
+ * both are taken with interrupts off since pages may be freed from any
+ * context.
+ */
+static DEFINE_XARRAY_FLAGS(htmm_hugetlb_xa, XA_FLAGS_LOCK_IRQ);
+
+static struct htmm_hugetlb_info *htmm_hugetlb_info_get(struct mem_cgroup *memcg,
+						       struct page *page)
+{
+	struct htmm_hugetlb_info *info, *old;
+	struct mem_cgroup_per_node *pn;
+	unsigned long pfn = page_to_pfn(page);
+	unsigned int nr_sub;
+	unsigned long flags;
+
+	info = xa_load(&htmm_hugetlb_xa, pfn);
+	if (info || !htmm_hugetlb)
+		return info;
+
+	nr_sub = max(1U, pages_per_huge_page(page_hstate(page)) / HPAGE_PMD_NR);
+	info = kzalloc(struct_size(info, sub_accesses, nr_sub),
+		       GFP_NOWAIT | __GFP_NOWARN);
+	if (!info)
+		return NULL;
+	info->page = page;
+	info->memcg = memcg;
+	info->nr_sub = nr_sub;
+	info->cooling_clock = READ_ONCE(memcg->cooling_clock);
+	css_get(&memcg->css);
+
+	xa_lock_irqsave(&htmm_hugetlb_xa, flags);
+	old = __xa_cmpxchg(&htmm_hugetlb_xa, pfn, NULL, info, GFP_ATOMIC);
+	if (!old) {
+		pn = memcg->nodeinfo[page_to_nid(page)];
+		spin_lock(&pn->hugetlb_lock);
+		list_add_tail(&info->list, &pn->hugetlb_list);
+		spin_unlock(&pn->hugetlb_lock);
+	}
+	xa_unlock_irqrestore(&htmm_hugetlb_xa, flags);
+
+	if (old) {
+		css_put(&memcg->css);
+		kfree(info);
+		return xa_is_err(old) ? NULL : old;
+	}
+	return info;
+}
+
+static void htmm_hugetlb_unlink(struct htmm_hugetlb_info *info)
+{
+	struct mem_cgroup_per_node *pn;
+
+	pn = info->memcg->nodeinfo[page_to_nid(info->page)];
+	spin_lock(&pn->hugetlb_lock);
+	list_del(&info->list);
+	spin_unlock(&pn->hugetlb_lock);
+}
+
+static void htmm_hugetlb_info_free(struct htmm_hugetlb_info *info)
+{
+	css_put(&info->memcg->css);
+	kfree(info);
+}
+
+void htmm_hugetlb_free(struct page *page)
+{
+	struct htmm_hugetlb_info *info;
+	unsigned long flags;
+
+	if (xa_empty(&htmm_hugetlb_xa))
+		return;
+
+	xa_lock_irqsave(&htmm_hugetlb_xa, flags);
+	info = __xa_erase(&htmm_hugetlb_xa, page_to_pfn(page));
+	if (info)
+		htmm_hugetlb_unlink(info);
+	xa_unlock_irqrestore(&htmm_hugetlb_xa, flags);
+
+	if (info)
+		htmm_hugetlb_info_free(info);
+}
+
+void htmm_hugetlb_migrate(struct page *page, struct page *newpage)
+{
+	struct htmm_hugetlb_info *info;
+	struct mem_cgroup_per_node *pn;
+	unsigned long flags;
+
+	if (xa_empty(&htmm_hugetlb_xa))
+		return;
+
+	xa_lock_irqsave(&htmm_hugetlb_xa, flags);
+	info = __xa_erase(&htmm_hugetlb_xa, page_to_pfn(page));
+	if (!info)
+		goto unlock;
+
+	htmm_hugetlb_unlink(info);
+	if (xa_is_err(__xa_store(&htmm_hugetlb_xa, page_to_pfn(newpage), info,
+				 GFP_ATOMIC))) {
+		xa_unlock_irqrestore(&htmm_hugetlb_xa, flags);
+		htmm_hugetlb_info_free(info);
+		return;
+	}
+	info->page = newpage;
+	pn = info->memcg->nodeinfo[page_to_nid(newpage)];
+	spin_lock(&pn->hugetlb_lock);
+	list_add_tail(&info->list, &pn->hugetlb_list);
+	spin_unlock(&pn->hugetlb_lock);
+unlock:
+	xa_unlock_irqrestore(&htmm_hugetlb_xa, flags);
+}
+
+/* halves the counters once per cooling period, as for THPs */
+static void check_hugetlb_cooling(struct htmm_hugetlb_info *info)
+{
+	struct mem_cgroup *memcg = info->memcg;
+	unsigned int memcg_cclock, diff, hot_thres, i;
+
+	spin_lock(&memcg->access_lock);
+	memcg_cclock = READ_ONCE(memcg->cooling_clock);
+	if (memcg_cclock > info->cooling_clock) {
+		diff = min(memcg_cclock - info->cooling_clock, 31U);
+		hot_thres = min(memcg->active_threshold,
+				memcg->bp_active_threshold);
+
+		info->nr_hot_sub = 0;
+		for (i = 0; i < info->nr_sub; i++) {
+			if (get_idx(info->sub_accesses[i]) >= hot_thres)
+				info->nr_hot_sub++;
+			info->sub_accesses[i] >>= diff;
+		}
+		info->pginfo.total_accesses >>= diff;
+		info->pginfo.read_nodes = 0;
+		info->pginfo.written = false;
+	}
+	info->cooling_clock = memcg_cclock;
+	spin_unlock(&memcg->access_lock);
+}
+
+/*
+ * Samples are counted per 2MB like the meta page of a THP, so the thresholds
+ * of the memcg apply unchanged. hugetlb pages are kept out of its histograms
+ * as they do not count against its fast tier share.
+ */
+static unsigned int htmm_hugetlb_idx(struct htmm_hugetlb_info *info)
+{
+	check_hugetlb_cooling(info);
+	return get_idx(info->pginfo.total_accesses / info->nr_sub);
+}
+
+bool htmm_hugetlb_is_hot(struct htmm_hugetlb_info *info)
+{
+	if (!htmm_is_promotion_candidate(info->memcg, info->page,
+					 htmm_hugetlb_idx(info)))
+		return false;
+	/* a 1GB page takes the room of 512 THPs: a quarter of it must be hot */
+	return info->nr_sub == 1 || info->nr_hot_sub * 4 >= info->nr_sub;
+}
+
+bool htmm_hugetlb_is_cold(struct htmm_hugetlb_info *info)
+{
+	return htmm_is_demotion_victim(info->memcg, info->page,
+				       htmm_hugetlb_idx(info));
+}
+
+/* @page is a pinned hugetlb head page */
+static int update_hugetlb_page(struct mem_cgroup *memcg, struct page *page,
+			       unsigned long address, int event_id,
+			       struct htmm_sample_nid *snid)
+{
+	struct htmm_hugetlb_info *info;
+	unsigned int sub;
+
+	info = htmm_hugetlb_info_get(memcg, page);
+	if (!info)
+		return 0;
+
+	check_hugetlb_cooling(info);
+	if (htmm_walk_event(event_id))
+		return htmm_page_tier(page, snid);
+	htmm_track_replication(&info->pginfo, event_id, snid);
+
+	sub = (address & ~huge_page_mask(page_hstate(page))) >> HPAGE_PMD_SHIFT;
+	spin_lock(&info->memcg->access_lock);
+	info->pginfo.nr_accesses++;
+	info->pginfo.total_accesses++;
+	info->sub_accesses[sub]++;
+	spin_unlock(&info->memcg->access_lock);
+
+	return htmm_page_tier(page, snid);
+}
+
+/* Resolves a sample without the mmap lock, following the fast GUP pattern:
+ * page tables of htmm tasks are freed after an RCU grace period (see
+ * ___pte_free_tlb()) and pginfo arrays are replaced the same way, so both
+ * can be accessed with interrupts disabled. No vma is needed; the filters of
+ * the locked path are applied on the pte and the page instead. The entry is
+ * re-read after pinning the page to catch a racing unmap or migration.
+ * Returns like __update_pginfo(), or -EAGAIN if the locked path has to be
+ * taken.
+ */
+static int htmm_update_pginfo_lockless(struct mm_struct *mm,
+				       struct mem_cgroup *memcg,
+				       unsigned long address, u64 timestamp,
+				       int event_id,
+				       struct htmm_sample_nid *snid)
+{
+	unsigned long flags;
+	pgd_t *pgdp, pgd;
+	p4d_t *p4dp, p4d;
+	pud_t *pudp, pud;
+	pmd_t *pmdp, pmd;
+	pte_t *ptep, pte;
+	struct page *page, *pte_page;
+	pginfo_t *pginfo;
+	bool hot;
+	int ret = 0;
+
+	local_irq_save(flags);
+	pgdp = pgd_offset(mm, address);
+	pgd = READ_ONCE(*pgdp);
+	if (pgd_none(pgd) || unlikely(pgd_bad(pgd)))
+		goto out;
+
+	p4dp = p4d_offset_lockless(pgdp, pgd, address);
+	p4d = READ_ONCE(*p4dp);
+	if (p4d_none(p4d) || unlikely(p4d_bad(p4d)))
+		goto out;
+
+	pudp = pud_offset_lockless(p4dp, p4d, address);
+	pud = READ_ONCE(*pudp);
+	if (pud_none(pud) || !pud_present(pud))
+		goto out;
+
+	if (pud_huge(pud)) {
+		page = pud_page(pud);
+		if (!PageHuge(page) || !get_page_unless_zero(page))
+			goto out;
+		if (unlikely(pud_val(pud) != pud_val(READ_ONCE(*pudp)))) {
+			put_page(page);
+			ret = -EAGAIN;
+			goto out;
+		}
+		local_irq_restore(flags);
+
+		ret = update_hugetlb_page(memcg, page, address, event_id,
+					  snid);
+		put_page(page);
+		return ret;
+	}
+
+	if (unlikely(pud_bad(pud)))
+		goto out;
+
+	pmdp = pmd_offset_lockless(pudp, pud, address);
+	pmd = READ_ONCE(*pmdp);
+	/* pmd migration entries and dax are skipped as in the locked path */
+	if (pmd_none(pmd) || !pmd_present(pmd) || pmd_devmap(pmd))
+		goto out;
+
+	if (pmd_trans_huge(pmd) || pmd_huge(pmd)) {
+		if (is_huge_zero_pmd(pmd))
+			goto out;
+		page = pmd_page(pmd);
+		if (!PageCompound(page) || !get_page_unless_zero(page))
+			goto out;
+		if (unlikely(pmd_val(pmd) != pmd_val(READ_ONCE(*pmdp)))) {
+			put_page(page);
+			ret = -EAGAIN;
+			goto out;
+		}
+		local_irq_restore(flags);
+
+		if (PageHuge(page)) {
+			ret = update_hugetlb_page(memcg, page, address,
+						  event_id, snid);
+			put_page(page);
+			return ret;
+		}
+		update_huge_page(memcg, page, address, event_id, snid);
+		ret = htmm_page_tier(page, snid);
+		put_page(page);
+		return ret;
+	}
+
+	if (unlikely(pmd_bad(pmd)))
+		goto out;
+
+	ptep = pte_offset_map(&pmd, address);
+	pte = READ_ONCE(*ptep);
+	if (!pte_present(pte) || pte_special(pte) || pte_devmap(pte))
+		goto unmap;
+	if (!pfn_valid(pte_pfn(pte)))
+		goto unmap;
+
+	page = pte_page(pte);
+	if (PageKsm(page) || page != compound_head(page))
+		goto unmap;
+	/* read-only file mappings (text, rodata) are not tracked */
+	if (!PageAnon(page) && !pte_write(pte))
+		goto unmap;
+
+	pte_page = virt_to_page((unsigned long)ptep);
+	if (!PageHtmm(pte_page))
+		goto unmap;
+
+	if (!get_page_unless_zero(page))
+		goto unmap;
+	if (unlikely(pmd_val(pmd) != pmd_val(READ_ONCE(*pmdp)) ||
+		     pte_val(pte) != pte_val(READ_ONCE(*ptep)))) {
+		put_page(page);
+		ret = -EAGAIN;
+		goto unmap;
+	}
+
+	pginfo = get_pginfo_from_pte(ptep);
+	if (!pginfo) {
+		put_page(page);
+		goto unmap;
+	}
+	hot = __update_base_page(memcg, page, pginfo, timestamp, event_id,
+				 snid);
+	pte_unmap(ptep);
+	local_irq_restore(flags);
+
+	update_base_page_lru(page, hot);
+	ret = htmm_page_tier(page, snid);
+	put_page(page);
+	return ret;
+
+unmap:
+	pte_unmap(ptep);
+out:
+	local_irq_restore(flags);
+	return ret;
+}
+
+static int __update_pte_pginfo(struct vm_area_struct *vma,
+			       struct mem_cgroup *memcg, pmd_t *pmd,
 			       unsigned long address, u64 timestamp,
-			       int event_id)
+			       int event_id, struct htmm_sample_nid *snid)
 {
 	pte_t *pte, ptent;
 	spinlock_t *ptl;
@@ -1026,28 +2062,19 @@ static int __update_pte_pginfo(struct vm_area_struct *vma, pmd_t *pmd,
 	if (!pginfo)
 		goto pte_unlock;
 
-	update_base_page(vma, page, pginfo, timestamp, event_id);
+	update_base_page(memcg, page, pginfo, timestamp, event_id, snid);
 	pte_unmap_unlock(pte, ptl);
-	if (htmm_cxl_mode) {
-		if (page_to_nid(page) == 0)
-			return 1;
-		else
-			return 2;
-	} else {
-		if (node_is_toptier(page_to_nid(page)))
-			return 1;
-		else
-			return 2;
-	}
+	return htmm_page_tier(page, snid);
 
 pte_unlock:
 	pte_unmap_unlock(pte, ptl);
 	return ret;
 }
 
-static int __update_pmd_pginfo(struct vm_area_struct *vma, pud_t *pud,
+static int __update_pmd_pginfo(struct vm_area_struct *vma,
+			       struct mem_cgroup *memcg, pud_t *pud,
 			       unsigned long address, u64 timestamp,
-			       int event_id)
+			       int event_id, struct htmm_sample_nid *snid)
 {
 	pmd_t *pmd, pmdval;
 	bool ret = 0;
@@ -1080,28 +2107,52 @@ static int __update_pmd_pginfo(struct vm_area_struct *vma, pud_t *pud,
 			goto pmd_unlock;
 		}
 
-		update_huge_page(vma, pmd, page, address);
-		if (htmm_cxl_mode) {
-			if (page_to_nid(page) == 0)
-				return 1;
-			else
-				return 2;
-		} else {
-			if (node_is_toptier(page_to_nid(page)))
-				return 1;
-			else
-				return 2;
-		}
+		update_huge_page(memcg, page, address, event_id, snid);
+		return htmm_page_tier(page, snid);
 	pmd_unlock:
 		return 0;
 	}
 
 	/* base page */
-	return __update_pte_pginfo(vma, pmd, address, timestamp, event_id);
+	return __update_pte_pginfo(vma, memcg, pmd, address, timestamp,
+				   event_id, snid);
+}
+
+static int __update_hugetlb_pginfo(struct vm_area_struct *vma,
+				   struct mem_cgroup *memcg,
+				   unsigned long address, int event_id,
+				   struct htmm_sample_nid *snid)
+{
+	struct hstate *h = hstate_vma(vma);
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t *ptep, pte;
+	int ret;
+
+	ptep = huge_pte_offset(vma->vm_mm, address & huge_page_mask(h),
+			       huge_page_size(h));
+	if (!ptep)
+		return 0;
+
+	ptl = huge_pte_lock(h, vma->vm_mm, ptep);
+	pte = huge_ptep_get(ptep);
+	if (!pte_present(pte)) {
+		spin_unlock(ptl);
+		return 0;
+	}
+	page = pte_page(pte);
+	get_page(page);
+	spin_unlock(ptl);
+
+	ret = update_hugetlb_page(memcg, page, address, event_id, snid);
+	put_page(page);
+	return ret;
 }
 
-static int __update_pginfo(struct vm_area_struct *vma, unsigned long address,
-			   u64 timestamp, int event_id)
+static int __update_pginfo(struct vm_area_struct *vma,
+			   struct mem_cgroup *memcg, unsigned long address,
+			   u64 timestamp, int event_id,
+			   struct htmm_sample_nid *snid)
 {
 	pgd_t *pgd;
 	p4d_t *p4d;
@@ -1119,7 +2170,8 @@ static int __update_pginfo(struct vm_area_struct *vma, unsigned long address,
 	if (pud_none_or_clear_bad(pud))
 		return 0;
 
-	return __update_pmd_pginfo(vma, pud, address, timestamp, event_id);
+	return __update_pmd_pginfo(vma, memcg, pud, address, timestamp,
+				   event_id, snid);
 }
 
 static void set_memcg_split_thres(struct mem_cgroup *memcg)
@@ -1152,8 +2204,10 @@ static void set_memcg_split_thres(struct mem_cgroup *memcg)
 static void set_memcg_nr_split(struct mem_cgroup *memcg)
 {
 	unsigned long ehr, rhr;
-	unsigned long captier_lat =
-		htmm_cxl_mode ? CXL_ACCESS_LATENCY : NVM_ACCESS_LATENCY;
+	unsigned long captier_lat = htmm_tier_latency(false);
+	unsigned long fasttier_lat = htmm_tier_latency(true);
+	/* measured page walk cost per access, which splitting only raises */
+	unsigned long walk_cost = memcg->walk_permil * htmm_walk_latency() / 1000;
 	unsigned long nr_records;
 	unsigned int avg_accesses_hp;
 
@@ -1166,6 +2220,9 @@ static void set_memcg_nr_split(struct mem_cgroup *memcg)
 		return;
 	if (memcg->num_util == 0)
 		return;
+	/* the slow tier is not slower than the walks: nothing to gain */
+	if (captier_lat <= fasttier_lat + walk_cost)
+		return;
 
 	/* cooling halves the access counts so that
      * NR_SAMPLE(n) = cooling_period + NR_SAMPLE(n-1) / 2
@@ -1186,9 +2243,9 @@ static void set_memcg_nr_split(struct mem_cgroup *memcg)
      */
 	memcg->nr_split = (ehr - rhr) * memcg->sum_util / nr_records;
 	memcg->nr_split /= avg_accesses_hp;
-	/* reflects latency gap */
-	memcg->nr_split *= (captier_lat - DRAM_ACCESS_LATENCY);
-	memcg->nr_split /= DRAM_ACCESS_LATENCY;
+	/* reflects latency gap, less the page walk cost */
+	memcg->nr_split *= (captier_lat - fasttier_lat - walk_cost);
+	memcg->nr_split /= fasttier_lat;
 	/* multiply hugepage size (counting granularity) */
 	memcg->nr_split *= HPAGE_PMD_NR;
 	/* scale down */
@@ -1199,13 +2256,17 @@ static void set_memcg_nr_split(struct mem_cgroup *memcg)
 /* protected by memcg->access_lock */
 static void reset_memcg_stat(struct mem_cgroup *memcg)
 {
-	int i;
+	int i, nid;
 
 	for (i = 0; i < 16; i++) {
 		memcg->hotness_hg[i] = 0;
 		memcg->ebp_hotness_hg[i] = 0;
 	}
 
+	for_each_node(nid)
+		memset(memcg->nodeinfo[nid]->hotness_hg, 0,
+		       sizeof(memcg->nodeinfo[nid]->hotness_hg));
+
 	for (i = 0; i < 21; i++)
 		memcg->access_map[i] = 0;
 
@@ -1213,30 +2274,58 @@ static void reset_memcg_stat(struct mem_cgroup *memcg)
 	memcg->num_util = 0;
 }
 
+/* builds the miss-ratio curve from the estimated base page histogram of
+ * the epoch that ends. A page in bucket i is weighted with the midpoint of
+ * the bucket's access range. Called with access_lock held.
+ */
+static void htmm_update_mrc(struct mem_cgroup *memcg)
+{
+	unsigned long nr_pages = 0;
+	u64 accesses = 0, total = 0;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		total += (u64)memcg->ebp_hotness_hg[i] *
+			 ((get_accesses_from_idx(i) +
+			   get_accesses_from_idx(i + 1)) >> 1);
+	/* keeps the previous curve for an idle epoch */
+	if (!total)
+		return;
+
+	for (i = 15; i >= 0; i--) {
+		nr_pages += memcg->ebp_hotness_hg[i];
+		accesses += (u64)memcg->ebp_hotness_hg[i] *
+			    ((get_accesses_from_idx(i) +
+			      get_accesses_from_idx(i + 1)) >> 1);
+		memcg->htmm_mrc_pages[15 - i] = nr_pages;
+		memcg->htmm_mrc_hit[15 - i] = div64_u64(accesses * 1000, total);
+	}
+}
+
+/* starts a cooling pass that the kmigraterds of all nodes run at once */
 static bool __cooling(struct mm_struct *mm, struct mem_cgroup *memcg)
 {
-	int nid;
+	spin_lock(&memcg->access_lock);
 
-	/* check whether the previous cooling is done or not. */
-	for_each_node_state (nid, N_MEMORY) {
-		struct mem_cgroup_per_node *pn = memcg->nodeinfo[nid];
-		if (pn && READ_ONCE(pn->need_cooling)) {
-			spin_lock(&memcg->access_lock);
-			memcg->cooling_clock++;
+	/* the previous pass is still running, until it times out */
+	if (memcg->nr_cooling_nodes) {
+		if (time_before(jiffies, memcg->cooling_start +
+				msecs_to_jiffies(htmm_cooling_timeout))) {
 			spin_unlock(&memcg->access_lock);
 			return false;
 		}
+		cooling_expire(memcg);
 	}
 
-	spin_lock(&memcg->access_lock);
-
+	htmm_update_mrc(memcg);
 	reset_memcg_stat(memcg);
 	memcg->cooling_clock++;
 	memcg->bp_active_threshold--;
-	memcg->cooled = true;
+	memcg->cooling_start = jiffies;
+	memcg->nr_cooling_nodes = set_lru_cooling(memcg);
 	smp_mb();
 	spin_unlock(&memcg->access_lock);
-	set_lru_cooling(mm);
+	htmm_kick_cooling(memcg);
 	return true;
 }
 
@@ -1246,17 +2335,28 @@ static void __adjust_active_threshold(struct mm_struct *mm,
 	unsigned long nr_active = 0;
 	unsigned long max_nr_pages =
 		memcg->max_nr_dram_pages -
-		get_memcg_promotion_watermark(memcg->max_nr_dram_pages);
+		min(memcg->max_nr_dram_pages,
+		    get_memcg_fasttier_promotion_watermark(memcg));
+	unsigned long *hotness_hg, *ebp_hotness_hg;
 	bool need_warm = false;
 	int idx_hot, idx_bp;
 
-	//if (need_cooling(memcg))
-	//	return;
+	/* the histograms only hold what the fast tier leaves to them */
+	max_nr_pages -= min(max_nr_pages, get_memcg_fasttier_file_pages(memcg));
+
+	/* a cooling pass is half done: some nodes are not counted yet */
+	if (need_cooling(memcg))
+		return;
 
 	spin_lock(&memcg->access_lock);
 
+	/* right after cooling, use the histograms the pass completed with */
+	hotness_hg = memcg->cooled ? memcg->hotness_snap : memcg->hotness_hg;
+	ebp_hotness_hg = memcg->cooled ? memcg->ebp_hotness_snap :
+					 memcg->ebp_hotness_hg;
+
 	for (idx_hot = 15; idx_hot >= 0; idx_hot--) {
-		unsigned long nr_pages = memcg->hotness_hg[idx_hot];
+		unsigned long nr_pages = hotness_hg[idx_hot];
 		if (nr_active + nr_pages > max_nr_pages)
 			break;
 		nr_active += nr_pages;
@@ -1270,7 +2370,7 @@ static void __adjust_active_threshold(struct mm_struct *mm,
 	/* for the estimated base page histogram */
 	nr_active = 0;
 	for (idx_bp = 15; idx_bp >= 0; idx_bp--) {
-		unsigned long nr_pages = memcg->ebp_hotness_hg[idx_bp];
+		unsigned long nr_pages = ebp_hotness_hg[idx_bp];
 		if (nr_active + nr_pages > max_nr_pages)
 			break;
 		nr_active += nr_pages;
@@ -1346,28 +2446,18 @@ static bool need_memcg_cooling(struct mem_cgroup *memcg)
 	return false;
 }
 
-void update_pginfo(pid_t pid, unsigned long address, enum events e,
-		   u64 timestamp)
+/* the vma based (locked) path of update_pginfo() */
+static int htmm_update_pginfo_locked(struct mm_struct *mm,
+				     struct mem_cgroup *memcg,
+				     unsigned long address, u64 timestamp,
+				     int event_id,
+				     struct htmm_sample_nid *snid)
 {
-	struct pid *pid_struct = find_get_pid(pid);
-	struct task_struct *p =
-		pid_struct ? pid_task(pid_struct, PIDTYPE_PID) : NULL;
-	struct mm_struct *mm = p ? p->mm : NULL;
 	struct vm_area_struct *vma;
-	struct mem_cgroup *memcg;
-	int ret;
-
-	if (htmm_mode == HTMM_NO_MIG) {
-		goto put_task;
-	}
-
-	if (!mm) {
-		goto put_task;
-	}
+	int ret = 0;
 
-	if (!mmap_read_trylock(mm)) {
-		goto put_task;
-	}
+	if (!mmap_read_trylock(mm))
+		return -EAGAIN;
 
 	vma = find_vma(mm, address);
 	if (unlikely(!vma)) {
@@ -1400,16 +2490,109 @@ void update_pginfo(pid_t pid, unsigned long address, enum events e,
 	//trace_printk("[Welford-!!!debug:VMA-PASSED] addr=0x%lx flags=0x%lx",
 	//	     address, vma->vm_flags);
 
+	if (is_vm_hugetlb_page(vma))
+		ret = __update_hugetlb_pginfo(vma, memcg, address, event_id,
+					      snid);
+	else
+		ret = __update_pginfo(vma, memcg, address, timestamp,
+				      event_id, snid);
+mmap_unlock:
+	mmap_read_unlock(mm);
+	return ret;
+}
+
+/* ksamplingd and kmigraterd run in the root cgroup, so the time they spend
+ * for a memcg is charged to it here; @start is a local_clock() stamp taken
+ * when the work began. It also feeds the tiering cpu budget.
+ */
+void htmm_charge_work(struct mem_cgroup *memcg, enum htmm_work work, u64 start)
+{
+	u64 delta = local_clock() - start;
+
+	atomic64_add(delta, &memcg->htmm_work_ns[work]);
+	atomic64_add(delta, &memcg->htmm_budget_used);
+}
+
+/* the budget is accounted over windows of one second */
+bool htmm_over_cpu_budget(struct mem_cgroup *memcg)
+{
+	u64 budget = READ_ONCE(memcg->htmm_cpu_budget);
+	u64 now;
+
+	if (budget == U64_MAX)
+		return false;
+
+	now = ktime_get_ns();
+	if (now - READ_ONCE(memcg->htmm_budget_start) >= NSEC_PER_SEC) {
+		WRITE_ONCE(memcg->htmm_budget_start, now);
+		atomic64_set(&memcg->htmm_budget_used, 0);
+		return false;
+	}
+
+	if (atomic64_read(&memcg->htmm_budget_used) < budget)
+		return false;
+
+	atomic64_inc(&memcg->htmm_nr_throttled);
+	return true;
+}
+
+/* Returns -EAGAIN if the sample could not be resolved because of mmap lock
+ * contention; the caller may retry it later.
+ */
+int update_pginfo(pid_t pid, pid_t tid, unsigned long address, enum events e,
+		  u64 timestamp, int nid)
+{
+	struct pid *pid_struct = find_get_pid(pid);
+	struct task_struct *p =
+		pid_struct ? get_pid_task(pid_struct, PIDTYPE_PID) : NULL;
+	struct mm_struct *mm = p ? get_task_mm(p) : NULL;
+	struct mem_cgroup *memcg = NULL;
+	struct htmm_sample_nid snid = {
+		.cpu_nid = nid,
+		.page_nid = NUMA_NO_NODE,
+	};
+	u64 start = local_clock();
+	int ret = 0;
+
+	if (htmm_mode == HTMM_NO_MIG) {
+		goto put_task;
+	}
+
+	if (!mm || !mm->htmm_enabled) {
+		goto put_task;
+	}
+
 	memcg = get_mem_cgroup_from_mm(mm);
 	if (!memcg || !memcg->htmm_enabled) {
 		//trace_printk(
 		//	"[Welford-!!!debug:FILTER-MEMCG_DISABLED]"); // 🔍 DEBUG: memcg 未启用过滤
-		goto mmap_unlock;
+		goto put_task;
+	}
+
+	/* over its budget: the sample is dropped */
+	if (htmm_over_cpu_budget(memcg))
+		goto put_task;
+
+	ret = htmm_update_pginfo_lockless(mm, memcg, address, timestamp, e,
+					  &snid);
+	if (ret == -EAGAIN)
+		ret = htmm_update_pginfo_locked(mm, memcg, address, timestamp,
+						e, &snid);
+	else
+		count_vm_event(HTMM_SAMPLE_LOCKLESS);
+
+	/* page walks are accounted apart from the accesses */
+	if (htmm_walk_event(e)) {
+		if (ret > 0) {
+			memcg->nr_walk_sampled++;
+			count_vm_event(HTMM_WALK_SAMPLED);
+		}
+		goto put_task;
 	}
 
 	/* increase sample counts only for valid records */
-	ret = __update_pginfo(vma, address, timestamp, e);
 	if (ret == 1) { /* memory accesses to DRAM */
+		htmm_coschedule_vote(tid, memcg, snid.page_nid);
 		memcg->nr_sampled++;
 		memcg->nr_sampled_for_split++;
 		memcg->nr_dram_sampled++;
@@ -1419,7 +2602,7 @@ void update_pginfo(pid_t pid, unsigned long address, enum events e,
 		memcg->nr_sampled_for_split++;
 		memcg->nr_max_sampled++;
 	} else
-		goto mmap_unlock;
+		goto put_task;
 
 	/* cooling and split decision */
 	if (memcg->nr_sampled % htmm_cooling_period == 0 ||
@@ -1435,6 +2618,11 @@ void update_pginfo(pid_t pid, unsigned long address, enum events e,
 			memcg->prev_max_dram_sampled >>= 1;
 			memcg->prev_max_dram_sampled += memcg->max_dram_sampled;
 			memcg->max_dram_sampled = 0;
+			/* page walks per sampled access of the period */
+			memcg->walk_permil = (memcg->walk_permil +
+				memcg->nr_walk_sampled * 1000 /
+				(memcg->nr_walk_sampled + htmm_cooling_period)) >> 1;
+			memcg->nr_walk_sampled = 0;
 
 			/* split decision period */
 			/* split should be performed after cooling due to skewness factor */
@@ -1457,7 +2645,7 @@ void update_pginfo(pid_t pid, unsigned long address, enum events e,
 						    (temp_rhr * 103 /
 						     100)) { // 3%
 							htmm_thres_split = 0;
-							goto mmap_unlock;
+							goto put_task;
 						}
 					}
 					memcg->split_happen = false;
@@ -1483,8 +2671,15 @@ void update_pginfo(pid_t pid, unsigned long address, enum events e,
 		__adjust_active_threshold(mm, memcg);
 	}
 
-mmap_unlock:
-	mmap_read_unlock(mm);
 put_task:
+	if (memcg) {
+		htmm_charge_work(memcg, HTMM_WORK_SAMPLE, start);
+		css_put(&memcg->css);
+	}
+	if (mm)
+		mmput(mm);
+	if (p)
+		put_task_struct(p);
 	put_pid(pid_struct);
+	return ret;
 }
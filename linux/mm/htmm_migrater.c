@@ -13,16 +13,29 @@
 #include <linux/rmap.h>
 #include <linux/delay.h>
 #include <linux/node.h>
+#include <linux/memory.h>
 #include <linux/htmm.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/vmstat.h>
+#include <linux/sched/mm.h>
+#include <linux/math64.h>
+#include <linux/hugetlb.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
 
 #include "internal.h"
 
+/* defaults until htmm_update_watermarks() has observed the memcg */
 #define MIN_WATERMARK_LOWER_LIMIT   128 * 100 // 50MB
 #define MIN_WATERMARK_UPPER_LIMIT   2560 * 100 // 1000MB
 #define MAX_WATERMARK_LOWER_LIMIT   256 * 100 // 100MB
 #define MAX_WATERMARK_UPPER_LIMIT   3840 * 100 // 1500MB
+#define HTMM_WMARK_MIN		    256 * 8 // 8MB
+
+/* isolate_lru_pages(): leave long-term pinned pages on the lru */
+#define HTMM_ISOLATE_UNPINNED	    ((__force isolate_mode_t)0x100)
 
 #ifdef ARCH_HAS_PREFETCHW
 #define prefetchw_prev_lru_page(_page, _base, _field)                   \
@@ -62,6 +75,7 @@ void del_memcg_from_kmigraterd(struct mem_cgroup *memcg, int nid)
 {
     struct mem_cgroup_per_node *mz, *pn = memcg->nodeinfo[nid];
     pg_data_t *pgdat = NODE_DATA(nid);
+    LIST_HEAD(page_list);
     
     if (!pgdat)
 	return;
@@ -74,9 +88,25 @@ void del_memcg_from_kmigraterd(struct mem_cgroup *memcg, int nid)
 	}
     }
     spin_unlock(&pgdat->kmigraterd_lock);
+
+    /* nobody retries the busy pages anymore, give them back */
+    spin_lock(&pn->busy_lock);
+    list_splice_init(&pn->busy_list, &page_list);
+    pn->busy_nr = 0;
+    pn->busy_backoff = 0;
+    spin_unlock(&pn->busy_lock);
+
+    while (!list_empty(&page_list)) {
+	struct page *page = lru_to_page(&page_list);
+
+	list_del(&page->lru);
+	mod_node_page_state(page_pgdat(page), NR_ISOLATED_ANON +
+		page_is_file_lru(page), -thp_nr_pages(page));
+	putback_lru_page(page);
+    }
 }
 
-unsigned long get_memcg_demotion_watermark(unsigned long max_nr_pages)
+static unsigned long default_demotion_watermark(unsigned long max_nr_pages)
 {
     max_nr_pages = max_nr_pages * 2 / 100; // 2%
     if (max_nr_pages < MIN_WATERMARK_LOWER_LIMIT)
@@ -87,7 +117,7 @@ unsigned long get_memcg_demotion_watermark(unsigned long max_nr_pages)
 	return max_nr_pages;
 }
 
-unsigned long get_memcg_promotion_watermark(unsigned long max_nr_pages)
+static unsigned long default_promotion_watermark(unsigned long max_nr_pages)
 {
     max_nr_pages = max_nr_pages * 3 / 100; // 3%
     if (max_nr_pages < MAX_WATERMARK_LOWER_LIMIT)
@@ -98,17 +128,116 @@ unsigned long get_memcg_promotion_watermark(unsigned long max_nr_pages)
 	return max_nr_pages;
 }
 
+/* free room kept on fast tier node @nid; below it, demotion starts */
+unsigned long get_memcg_demotion_watermark(struct mem_cgroup *memcg, int nid)
+{
+    struct mem_cgroup_per_node *pn = memcg->nodeinfo[nid];
+    unsigned long wmark = READ_ONCE(pn->demotion_wmark);
+
+    return wmark ? wmark : default_demotion_watermark(pn->max_nr_base_pages);
+}
+
+/* free room demotion restores on fast tier node @nid */
+unsigned long get_memcg_promotion_watermark(struct mem_cgroup *memcg, int nid)
+{
+    struct mem_cgroup_per_node *pn = memcg->nodeinfo[nid];
+    unsigned long wmark = READ_ONCE(pn->promotion_wmark);
+
+    return wmark ? wmark : default_promotion_watermark(pn->max_nr_base_pages);
+}
+
+unsigned long get_memcg_fasttier_promotion_watermark(struct mem_cgroup *memcg)
+{
+    unsigned long wmark = 0;
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+	if (htmm_node_is_toptier(nid))
+	    wmark += get_memcg_promotion_watermark(memcg, nid);
+    }
+    return wmark;
+}
+
+/* cxl mode tier order: each node points to the nearest node of the other
+ * tier (see htmm_node_is_toptier()). Rebuilt on memory hotplug.
+ */
+static int htmm_cxl_promotion[MAX_NUMNODES] __read_mostly =
+	{[0 ...  MAX_NUMNODES - 1] = NUMA_NO_NODE};
+static int htmm_cxl_demotion[MAX_NUMNODES] __read_mostly =
+	{[0 ...  MAX_NUMNODES - 1] = NUMA_NO_NODE};
+
+static int htmm_nearest_node(int nid, bool toptier)
+{
+    int n, best = NUMA_NO_NODE;
+
+    for_each_node_state(n, N_MEMORY) {
+	if (n == nid || node_state(n, N_CPU) != toptier)
+	    continue;
+	if (best == NUMA_NO_NODE ||
+	    node_distance(nid, n) < node_distance(nid, best))
+	    best = n;
+    }
+    return best;
+}
+
+static void htmm_rebuild_cxl_tiers(void)
+{
+    int nid;
+
+    for_each_node(nid) {
+	int promotion = NUMA_NO_NODE, demotion = NUMA_NO_NODE;
+
+	if (node_state(nid, N_MEMORY)) {
+	    if (node_state(nid, N_CPU))
+		demotion = htmm_nearest_node(nid, false);
+	    else
+		promotion = htmm_nearest_node(nid, true);
+	}
+	WRITE_ONCE(htmm_cxl_promotion[nid], promotion);
+	WRITE_ONCE(htmm_cxl_demotion[nid], demotion);
+    }
+}
+
+/* the next node in the promotion/demotion path of the given node */
+int htmm_promotion_target(int nid)
+{
+    if (htmm_cxl_mode)
+	return READ_ONCE(htmm_cxl_promotion[nid]);
+    return next_promotion_node(nid);
+}
+
+int htmm_demotion_target(int nid)
+{
+    if (htmm_cxl_mode)
+	return READ_ONCE(htmm_cxl_demotion[nid]);
+    return next_demotion_node(nid);
+}
+
+unsigned long htmm_nr_resident(struct mem_cgroup *memcg, int nid,
+	enum htmm_resident type)
+{
+    return percpu_counter_read_positive(&memcg->nodeinfo[nid]->nr_resident[type]);
+}
+
+/* pages @memcg has on @pgdat, isolated ones included. off by at most
+ * MEMCG_CHARGE_BATCH pages per cpu and type.
+ */
 unsigned long get_nr_lru_pages_node(struct mem_cgroup *memcg, pg_data_t *pgdat)
 {
-    struct lruvec *lruvec;
-    unsigned long nr_pages = 0;
-    enum lru_list lru;
+    return htmm_nr_resident(memcg, pgdat->node_id, HTMM_RES_ANON) +
+	htmm_nr_resident(memcg, pgdat->node_id, HTMM_RES_FILE);
+}
 
-    lruvec = mem_cgroup_lruvec(memcg, pgdat);
+/* fast tier pages not covered by the access histograms */
+unsigned long get_memcg_fasttier_file_pages(struct mem_cgroup *memcg)
+{
+    unsigned long nr_pages = 0;
+    int nid;
 
-    for_each_lru(lru)
-	nr_pages += lruvec_lru_size(lruvec, lru, MAX_NR_ZONES);
-   
+    for_each_node_state(nid, N_MEMORY) {
+	if (htmm_node_is_toptier(nid))
+	    nr_pages += htmm_nr_resident(memcg, nid, HTMM_RES_FILE);
+    }
     return nr_pages;
 }
 
@@ -136,7 +265,7 @@ static bool need_toptier_demotion(pg_data_t *pgdat, struct mem_cgroup *memcg, un
     unsigned long nr_lru_pages, max_nr_pages;
     unsigned long nr_need_promoted;
     unsigned long fasttier_max_watermark, fasttier_min_watermark;
-    int target_nid = htmm_cxl_mode ? 1 : next_demotion_node(pgdat->node_id);
+    int target_nid = htmm_demotion_target(pgdat->node_id);
     pg_data_t *target_pgdat;
   
     if (target_nid == NUMA_NO_NODE)
@@ -147,8 +276,8 @@ static bool need_toptier_demotion(pg_data_t *pgdat, struct mem_cgroup *memcg, un
     max_nr_pages = memcg->nodeinfo[pgdat->node_id]->max_nr_base_pages;
     nr_lru_pages = get_nr_lru_pages_node(memcg, pgdat);
 
-    fasttier_max_watermark = get_memcg_promotion_watermark(max_nr_pages);
-    fasttier_min_watermark = get_memcg_demotion_watermark(max_nr_pages);
+    fasttier_max_watermark = get_memcg_promotion_watermark(memcg, pgdat->node_id);
+    fasttier_min_watermark = get_memcg_demotion_watermark(memcg, pgdat->node_id);
 
     if (need_direct_demotion(pgdat, memcg)) {
 	if (nr_lru_pages + fasttier_max_watermark <= max_nr_pages)
@@ -157,7 +286,9 @@ static bool need_toptier_demotion(pg_data_t *pgdat, struct mem_cgroup *memcg, un
 	    *nr_exceeded = fasttier_max_watermark - (max_nr_pages - nr_lru_pages);
 	else
 	    *nr_exceeded = nr_lru_pages + fasttier_max_watermark - max_nr_pages;
-	*nr_exceeded += 1U * 128 * 100; // 100 MB
+	/* plus the band, so that the next allocation burst fits as well */
+	*nr_exceeded += max(fasttier_max_watermark - fasttier_min_watermark,
+			    (unsigned long)HTMM_WMARK_MIN);
 	return true;
     }
 
@@ -199,6 +330,40 @@ static unsigned long node_free_pages(pg_data_t *pgdat)
     return (unsigned long)total;
 }
 
+/* Samples are only useful while part of @memcg lives on the slow tier or
+ * its fast tier share is about to overflow (allocations will spill over).
+ */
+bool htmm_memcg_needs_sampling(struct mem_cgroup *memcg)
+{
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+	pg_data_t *pgdat = NODE_DATA(nid);
+	unsigned long nr_lru_pages = get_nr_lru_pages_node(memcg, pgdat);
+	unsigned long max_nr_pages;
+
+	if (!htmm_node_is_toptier(nid)) {
+	    if (nr_lru_pages)
+		return true;
+	    continue;
+	}
+
+	if (need_direct_demotion(pgdat, memcg))
+	    return true;
+
+	max_nr_pages = memcg->nodeinfo[nid]->max_nr_base_pages;
+	if (max_nr_pages == ULONG_MAX) {
+	    /* only bounded by the node */
+	    if (!node_free_pages(pgdat))
+		return true;
+	} else if (nr_lru_pages + get_memcg_promotion_watermark(memcg, nid) >
+		   max_nr_pages) {
+	    return true;
+	}
+    }
+    return false;
+}
+
 static bool promotion_available(int target_nid, struct mem_cgroup *memcg,
 	unsigned long *nr_to_promote)
 {
@@ -217,7 +382,7 @@ static bool promotion_available(int target_nid, struct mem_cgroup *memcg,
     nr_isolated = node_page_state(pgdat, NR_ISOLATED_ANON) +
 		  node_page_state(pgdat, NR_ISOLATED_FILE);
     
-    fasttier_max_watermark = get_memcg_promotion_watermark(max_nr_pages);
+    fasttier_max_watermark = get_memcg_promotion_watermark(memcg, target_nid);
 
     if (max_nr_pages == ULONG_MAX) {
 	*nr_to_promote = node_free_pages(pgdat);
@@ -230,6 +395,86 @@ static bool promotion_available(int target_nid, struct mem_cgroup *memcg,
     return false;
 }
 
+/* whether @memcg can still take pages on fast tier node @nid without demoting */
+bool htmm_node_has_room(int nid, struct mem_cgroup *memcg)
+{
+    unsigned long nr_to_promote = 0;
+
+    if (!htmm_node_is_toptier(nid))
+	return false;
+    return promotion_available(nid, memcg, &nr_to_promote) && nr_to_promote;
+}
+
+#define HTMM_WMARK_EWMA(old, new) ((old) ? ((old) * 3 + (new)) / 4 : (new))
+
+/* Adaptive watermarks of the share of @memcg on fast tier node @pgdat,
+ * refreshed every demotion cycle:
+ *  - demotion: what allocations take while demotion reacts (two periods),
+ *    stretched by up to 4x when demotion runs slower than allocation;
+ *  - promotion: demotion plus the band a demotion round frees, that is one
+ *    period of allocations and the part of the promotion backlog one period
+ *    of demotion work can make room for.
+ * Both stay within [HTMM_WMARK_MIN, a quarter of the share].
+ */
+static void htmm_update_watermarks(pg_data_t *pgdat, struct mem_cgroup *memcg)
+{
+    struct mem_cgroup_per_node *pn = memcg->nodeinfo[pgdat->node_id];
+    int target_nid = htmm_demotion_target(pgdat->node_id);
+    unsigned long nr_lru = get_nr_lru_pages_node(memcg, pgdat);
+    unsigned long max_nr_pages = pn->max_nr_base_pages;
+    unsigned long inflow, alloc_rate, demote_rate, backlog;
+    unsigned long period_pages, low, high, cap;
+    u64 now = ktime_get_ns();
+    u64 elapsed = now - pn->wmark_stamp;
+
+    if (!pn->wmark_stamp || elapsed < NSEC_PER_SEC / 10) {
+	if (!pn->wmark_stamp) {
+	    pn->wmark_stamp = now;
+	    pn->wmark_nr_lru = nr_lru;
+	}
+	return;
+    }
+
+    /* pages that landed on the node, whether they stayed or were demoted */
+    inflow = nr_lru + pn->wmark_nr_demoted;
+    inflow = inflow > pn->wmark_nr_lru ? inflow - pn->wmark_nr_lru : 0;
+    alloc_rate = div64_u64((u64)inflow * NSEC_PER_SEC, elapsed);
+    alloc_rate = HTMM_WMARK_EWMA(pn->wmark_alloc_rate, alloc_rate);
+
+    demote_rate = pn->wmark_demote_rate;
+    if (pn->wmark_demote_ns)
+	demote_rate = HTMM_WMARK_EWMA(demote_rate,
+		div64_u64((u64)pn->wmark_nr_demoted * NSEC_PER_SEC,
+		    pn->wmark_demote_ns));
+
+    backlog = target_nid == NUMA_NO_NODE ? 0 :
+	need_lowertier_promotion(NODE_DATA(target_nid), memcg);
+
+    period_pages = alloc_rate * htmm_demotion_period_in_ms / MSEC_PER_SEC;
+    low = 2 * period_pages;
+    if (demote_rate && alloc_rate > demote_rate)
+	low *= min(DIV_ROUND_UP(alloc_rate, demote_rate), 4UL);
+    high = low + period_pages +
+	min(backlog, demote_rate * htmm_demotion_period_in_ms / MSEC_PER_SEC);
+
+    if (max_nr_pages == ULONG_MAX)
+	max_nr_pages = node_present_pages(pgdat->node_id);
+    cap = max(max_nr_pages / 4, (unsigned long)HTMM_WMARK_MIN);
+    low = clamp(low, (unsigned long)HTMM_WMARK_MIN, cap);
+    high = clamp(high, low, cap);
+
+    WRITE_ONCE(pn->wmark_alloc_rate, alloc_rate);
+    WRITE_ONCE(pn->wmark_demote_rate, demote_rate);
+    WRITE_ONCE(pn->wmark_backlog, backlog);
+    WRITE_ONCE(pn->demotion_wmark, low);
+    WRITE_ONCE(pn->promotion_wmark, high);
+
+    pn->wmark_stamp = now;
+    pn->wmark_nr_lru = nr_lru;
+    pn->wmark_nr_demoted = 0;
+    pn->wmark_demote_ns = 0;
+}
+
 static bool need_lru_cooling(struct mem_cgroup_per_node *pn)
 {
     return READ_ONCE(pn->need_cooling);
@@ -277,6 +522,12 @@ static unsigned long isolate_lru_pages(unsigned long nr_to_scan,
 	    list_move(&page->lru, src);
 	    continue;
 	}
+	/* a long-term pin fails every migration, do not even isolate it */
+	if ((mode & HTMM_ISOLATE_UNPINNED) && page_maybe_dma_pinned(page)) {
+	    __count_vm_events(HTMM_PIN_SKIPPED, nr_pages);
+	    list_move(&page->lru, src);
+	    continue;
+	}
 	if (unlikely(!get_page_unless_zero(page))) {
 	    list_move(&page->lru, src);
 	    continue;
@@ -307,8 +558,13 @@ static struct page *alloc_migrate_page(struct page *page, unsigned long node)
 		  __GFP_NORETRY | __GFP_NOWARN) &
 		  ~__GFP_RECLAIM;
 
-    if (PageHuge(page))
-	return NULL;
+    if (PageHuge(page)) {
+	struct hstate *h = page_hstate(compound_head(page));
+	nodemask_t nmask = nodemask_of_node(nid);
+
+	return alloc_huge_page_nodemask(h, nid, &nmask,
+		htlb_alloc_mask(h) | __GFP_THISNODE | __GFP_NOWARN);
+    }
 
     zidx = zone_idx(page_zone(page));
     if (is_highmem_idx(zidx) || zidx == ZONE_MOVABLE)
@@ -336,9 +592,9 @@ static unsigned long migrate_page_list(struct list_head *migrate_list,
     unsigned int nr_succeeded = 0;
 
     if (promotion)
-	target_nid = htmm_cxl_mode ? 0 : next_promotion_node(pgdat->node_id);
+	target_nid = htmm_promotion_target(pgdat->node_id);
     else
-	target_nid = htmm_cxl_mode ? 1 : next_demotion_node(pgdat->node_id);
+	target_nid = htmm_demotion_target(pgdat->node_id);
 
     if (list_empty(migrate_list))
 	return 0;
@@ -357,9 +613,66 @@ static unsigned long migrate_page_list(struct list_head *migrate_list,
     return nr_succeeded;
 }
 
+/* Pin time placement: kmigraterd cannot move a long-term pinned page, so
+ * with htmm_pin_fasttier the slow tier pages of htmm memcgs are promoted
+ * right before they get pinned (see check_and_migrate_movable_pages()).
+ */
+bool htmm_isolate_pin_page(struct page *page, struct list_head *list)
+{
+    struct mem_cgroup *memcg;
+    int nid = page_to_nid(page), target_nid;
+
+    if (!htmm_pin_fasttier || htmm_node_is_toptier(nid) || PageHuge(page))
+	return false;
+
+    memcg = page_memcg(page);
+    if (!memcg || !memcg->htmm_enabled)
+	return false;
+    target_nid = htmm_promotion_target(nid);
+    if (target_nid == NUMA_NO_NODE || !htmm_node_has_room(target_nid, memcg))
+	return false;
+
+    if (isolate_lru_page(page))
+	return false;
+    list_add_tail(&page->lru, list);
+    mod_node_page_state(page_pgdat(page), NR_ISOLATED_ANON +
+	    page_is_file_lru(page), thp_nr_pages(page));
+    return true;
+}
+
+void htmm_promote_pin_pages(struct list_head *page_list)
+{
+    LIST_HEAD(batch);
+    struct page *page, *next;
+    unsigned int nr_succeeded, nr_placed = 0;
+    int target_nid;
+
+    /* the pages may come from slow tier nodes with different targets:
+     * migrate them in one batch per target */
+    while (!list_empty(page_list)) {
+	page = lru_to_page(page_list);
+	target_nid = htmm_promotion_target(page_to_nid(page));
+	list_for_each_entry_safe(page, next, page_list, lru) {
+	    if (htmm_promotion_target(page_to_nid(page)) == target_nid)
+		list_move_tail(&page->lru, &batch);
+	}
+
+	if (target_nid != NUMA_NO_NODE) {
+	    nr_succeeded = 0;
+	    migrate_pages(&batch, alloc_migrate_page, NULL, target_nid,
+		    MIGRATE_SYNC, MR_LONGTERM_PIN, &nr_succeeded);
+	    nr_placed += nr_succeeded;
+	}
+	if (!list_empty(&batch))
+	    putback_movable_pages(&batch);
+    }
+
+    count_vm_events(HTMM_PIN_PLACED, nr_placed);
+}
+
 static unsigned long shrink_page_list(struct list_head *page_list,
 	pg_data_t* pgdat, struct mem_cgroup *memcg, bool shrink_active,
-	unsigned long nr_to_reclaim)
+	unsigned long nr_to_reclaim, struct list_head *busy_list)
 {
     LIST_HEAD(demote_pages);
     LIST_HEAD(ret_pages);
@@ -375,13 +688,13 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 	list_del(&page->lru);
 
 	if (!trylock_page(page))
-	    goto keep;
+	    goto busy;
 	if (!shrink_active && PageAnon(page) && PageActive(page))
 	    goto keep_locked;
 	if (unlikely(!page_evictable(page)))
 	    goto keep_locked;
 	if (PageWriteback(page))
-	    goto keep_locked;
+	    goto busy_locked;
 	if (PageTransHuge(page) && !thp_migration_supported())
 	    goto keep_locked;
 	if (!PageAnon(page) && nr_demotion_cand > nr_to_reclaim + HTMM_MIN_FREE_PAGES)
@@ -391,12 +704,12 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 	    if (PageTransHuge(page)) {
 		struct page *meta = get_meta_page(page);
 
-		if (meta->idx >= memcg->warm_threshold)
+		if (!htmm_is_demotion_victim(memcg, page, meta->idx))
 		    goto keep_locked;
 	    } else {
 		unsigned int idx = get_pginfo_idx(page);
 
-		if (idx >= memcg->warm_threshold)
+		if (!htmm_is_demotion_victim(memcg, page, idx))
 		    goto keep_locked;
 	    }
 	}
@@ -406,9 +719,13 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 	nr_demotion_cand += compound_nr(page);
 	continue;
 
+busy_locked:
+	unlock_page(page);
+busy:
+	list_add(&page->lru, busy_list);
+	continue;
 keep_locked:
 	unlock_page(page);
-keep:
 	list_add(&page->lru, &ret_pages);
     }
 
@@ -421,7 +738,7 @@ keep:
 }
 
 static unsigned long promote_page_list(struct list_head *page_list,
-	pg_data_t *pgdat)
+	pg_data_t *pgdat, struct list_head *busy_list)
 {
     LIST_HEAD(promote_pages);
     LIST_HEAD(ret_pages);
@@ -436,22 +753,26 @@ static unsigned long promote_page_list(struct list_head *page_list,
 	list_del(&page->lru);
 	
 	if (!trylock_page(page))
-	    goto __keep;
+	    goto __busy;
 	if (!PageActive(page) && htmm_mode != HTMM_NO_MIG)
 	    goto __keep_locked;
 	if (unlikely(!page_evictable(page)))
 	    goto __keep_locked;
 	if (PageWriteback(page))
-	    goto __keep_locked;
+	    goto __busy_locked;
 	if (PageTransHuge(page) && !thp_migration_supported())
 	    goto __keep_locked;
 
 	list_add(&page->lru, &promote_pages);
 	unlock_page(page);
 	continue;
+__busy_locked:
+	unlock_page(page);
+__busy:
+	list_add(&page->lru, busy_list);
+	continue;
 __keep_locked:
 	unlock_page(page);
-__keep:
 	list_add(&page->lru, &ret_pages);
     }
 
@@ -463,19 +784,128 @@ __keep:
     return nr_promoted;
 }
 
+/* Pages that are locked or under writeback when kmigraterd gets to them
+ * stay isolated on pn->busy_list rather than going back to the lru, where
+ * the next pass would isolate and reject them again. The list is retried
+ * HTMM_BUSY_BACKOFF << pn->busy_backoff jiffies later; the backoff doubles
+ * while pages stay busy and the ones still busy after
+ * HTMM_BUSY_MAX_BACKOFF retries go back to the lru. Every kmigraterd pass
+ * looks at the list, and once the node no longer needs the migration the
+ * pages go back at once. At most HTMM_BUSY_MAX_PAGES are kept isolated.
+ */
+#define HTMM_BUSY_BACKOFF	(HZ / 10)
+#define HTMM_BUSY_MAX_BACKOFF	4
+#define HTMM_BUSY_MAX_PAGES	(32UL << (20 - PAGE_SHIFT)) // 32MB
+
+static void busy_list_pages(struct list_head *page_list, unsigned long *nr)
+{
+    struct page *page;
+
+    nr[0] = nr[1] = 0;
+    list_for_each_entry(page, page_list, lru)
+	nr[page_is_file_lru(page)] += thp_nr_pages(page);
+}
+
+/* returns the number of base pages kept isolated */
+static unsigned long defer_busy_pages(struct mem_cgroup_per_node *pn,
+	struct list_head *busy_list)
+{
+    unsigned long nr[2];
+
+    if (list_empty(busy_list))
+	return 0;
+
+    busy_list_pages(busy_list, nr);
+    spin_lock(&pn->busy_lock);
+    /* del_memcg_from_kmigraterd() drains the list once htmm is off; a
+     * full list leaves the pages to the lru */
+    if (!READ_ONCE(pn->memcg->htmm_enabled) ||
+	    pn->busy_nr + nr[0] + nr[1] > HTMM_BUSY_MAX_PAGES) {
+	spin_unlock(&pn->busy_lock);
+	return 0;
+    }
+    if (list_empty(&pn->busy_list))
+	pn->busy_retry = jiffies + (HTMM_BUSY_BACKOFF << pn->busy_backoff);
+    list_splice_tail_init(busy_list, &pn->busy_list);
+    pn->busy_nr += nr[0] + nr[1];
+    spin_unlock(&pn->busy_lock);
+
+    count_vm_events(HTMM_BUSY_DEFERRED, nr[0] + nr[1]);
+    return nr[0] + nr[1];
+}
+
+/* called on every kmigraterd pass; @wanted tells whether the node still
+ * needs the migration the pages were isolated for */
+static unsigned long retry_busy_pages(pg_data_t *pgdat,
+	struct mem_cgroup *memcg, bool promotion, bool wanted)
+{
+    struct mem_cgroup_per_node *pn = memcg->nodeinfo[pgdat->node_id];
+    struct lruvec *lruvec = mem_cgroup_lruvec(memcg, pgdat);
+    unsigned long nr_taken[2], nr_busy[2] = { 0, 0 }, nr = 0;
+    LIST_HEAD(page_list);
+    LIST_HEAD(busy_list);
+
+    if (list_empty(&pn->busy_list) ||
+	    (wanted && time_before(jiffies, pn->busy_retry)))
+	return 0;
+
+    spin_lock(&pn->busy_lock);
+    list_splice_init(&pn->busy_list, &page_list);
+    pn->busy_nr = 0;
+    spin_unlock(&pn->busy_lock);
+    busy_list_pages(&page_list, nr_taken);
+
+    if (!wanted)
+	list_splice_init(&page_list, &busy_list);
+    else if (promotion)
+	nr = promote_page_list(&page_list, pgdat, &busy_list);
+    else
+	nr = shrink_page_list(&page_list, pgdat, memcg, true,
+		nr_taken[0] + nr_taken[1], &busy_list);
+
+    if (list_empty(&busy_list)) {
+	pn->busy_backoff = 0;
+    } else if (wanted && pn->busy_backoff < HTMM_BUSY_MAX_BACKOFF) {
+	busy_list_pages(&busy_list, nr_busy);
+	pn->busy_backoff++;
+	if (!defer_busy_pages(pn, &busy_list))
+	    nr_busy[0] = nr_busy[1] = 0;
+    } else {
+	busy_list_pages(&busy_list, nr_busy);
+	count_vm_events(HTMM_BUSY_EXPIRED, nr_busy[0] + nr_busy[1]);
+	nr_busy[0] = nr_busy[1] = 0;
+	pn->busy_backoff = 0;
+    }
+    list_splice(&busy_list, &page_list);
+
+    spin_lock_irq(&lruvec->lru_lock);
+    move_pages_to_lru(lruvec, &page_list);
+    __mod_node_page_state(pgdat, NR_ISOLATED_ANON, -(nr_taken[0] - nr_busy[0]));
+    __mod_node_page_state(pgdat, NR_ISOLATED_FILE, -(nr_taken[1] - nr_busy[1]));
+    spin_unlock_irq(&lruvec->lru_lock);
+
+    mem_cgroup_uncharge_list(&page_list);
+    free_unref_page_list(&page_list);
+
+    return nr;
+}
+
 static unsigned long demote_inactive_list(unsigned long nr_to_scan,
 	unsigned long nr_to_reclaim, struct lruvec *lruvec,
 	enum lru_list lru, bool shrink_active)
 {
     LIST_HEAD(page_list);
+    LIST_HEAD(busy_list);
     pg_data_t *pgdat = lruvec_pgdat(lruvec);
-    unsigned long nr_reclaimed = 0, nr_taken;
+    struct mem_cgroup *memcg = lruvec_memcg(lruvec);
+    unsigned long nr_reclaimed = 0, nr_taken, nr_busy;
     int file = is_file_lru(lru);
 
     lru_add_drain();
 
     spin_lock_irq(&lruvec->lru_lock);
-    nr_taken = isolate_lru_pages(nr_to_scan, lruvec, lru, &page_list, 0);
+    nr_taken = isolate_lru_pages(nr_to_scan, lruvec, lru, &page_list,
+	    HTMM_ISOLATE_UNPINNED);
     __mod_node_page_state(pgdat, NR_ISOLATED_ANON + file, nr_taken);
     spin_unlock_irq(&lruvec->lru_lock);
 
@@ -483,12 +913,14 @@ static unsigned long demote_inactive_list(unsigned long nr_to_scan,
 	return 0;
     }
 
-    nr_reclaimed = shrink_page_list(&page_list, pgdat, lruvec_memcg(lruvec),
-	    shrink_active, nr_to_reclaim);
+    nr_reclaimed = shrink_page_list(&page_list, pgdat, memcg,
+	    shrink_active, nr_to_reclaim, &busy_list);
+    nr_busy = defer_busy_pages(memcg->nodeinfo[pgdat->node_id], &busy_list);
+    list_splice(&busy_list, &page_list);
 
     spin_lock_irq(&lruvec->lru_lock);
     move_pages_to_lru(lruvec, &page_list);
-    __mod_node_page_state(pgdat, NR_ISOLATED_ANON + file, -nr_taken);
+    __mod_node_page_state(pgdat, NR_ISOLATED_ANON + file, -(nr_taken - nr_busy));
     spin_unlock_irq(&lruvec->lru_lock);
 
     mem_cgroup_uncharge_list(&page_list);
@@ -501,24 +933,29 @@ static unsigned long promote_active_list(unsigned long nr_to_scan,
 	struct lruvec *lruvec, enum lru_list lru)
 {
     LIST_HEAD(page_list);
+    LIST_HEAD(busy_list);
     pg_data_t *pgdat = lruvec_pgdat(lruvec);
-    unsigned long nr_taken, nr_promoted;
+    struct mem_cgroup *memcg = lruvec_memcg(lruvec);
+    unsigned long nr_taken, nr_promoted, nr_busy;
     
     lru_add_drain();
 
     spin_lock_irq(&lruvec->lru_lock);
-    nr_taken = isolate_lru_pages(nr_to_scan, lruvec, lru, &page_list, 0);
+    nr_taken = isolate_lru_pages(nr_to_scan, lruvec, lru, &page_list,
+	    HTMM_ISOLATE_UNPINNED);
     __mod_node_page_state(pgdat, NR_ISOLATED_ANON, nr_taken);
     spin_unlock_irq(&lruvec->lru_lock);
 
     if (nr_taken == 0)
 	return 0;
 
-    nr_promoted = promote_page_list(&page_list, pgdat);
+    nr_promoted = promote_page_list(&page_list, pgdat, &busy_list);
+    nr_busy = defer_busy_pages(memcg->nodeinfo[pgdat->node_id], &busy_list);
+    list_splice(&busy_list, &page_list);
 
     spin_lock_irq(&lruvec->lru_lock);
     move_pages_to_lru(lruvec, &page_list);
-    __mod_node_page_state(pgdat, NR_ISOLATED_ANON, -nr_taken);
+    __mod_node_page_state(pgdat, NR_ISOLATED_ANON, -(nr_taken - nr_busy));
     spin_unlock_irq(&lruvec->lru_lock);
 
     mem_cgroup_uncharge_list(&page_list);
@@ -602,16 +1039,12 @@ static unsigned long demote_node(pg_data_t *pgdat, struct mem_cgroup *memcg,
     if (nr_exceeded > nr_evictable_pages && need_direct_demotion(pgdat, memcg))
 	shrink_active = true;
 
-    do {
+    for (; priority && nr_reclaimed < nr_to_reclaim; priority--)
 	nr_reclaimed += demote_lruvec(nr_to_reclaim - nr_reclaimed, priority,
 					pgdat, lruvec, shrink_active);
-	if (nr_reclaimed >= nr_to_reclaim)
-	    break;
-	priority--;
-    } while (priority);
 
     if (htmm_nowarm == 0) {
-	int target_nid = htmm_cxl_mode ? 1 : next_demotion_node(pgdat->node_id);
+	int target_nid = htmm_demotion_target(pgdat->node_id);
 	unsigned long nr_lowertier_active =
 	    target_nid == NUMA_NO_NODE ? 0: need_lowertier_promotion(NODE_DATA(target_nid), memcg);
 	
@@ -625,7 +1058,7 @@ static unsigned long demote_node(pg_data_t *pgdat, struct mem_cgroup *memcg,
     do {
 	unsigned long max = memcg->nodeinfo[pgdat->node_id]->max_nr_base_pages;
 	if (get_nr_lru_pages_node(memcg, pgdat) +
-		get_memcg_demotion_watermark(max) < max)
+		get_memcg_demotion_watermark(memcg, pgdat->node_id) < max)
 	    WRITE_ONCE(memcg->nodeinfo[pgdat->node_id]->need_demotion, false);
     } while (0);
     return nr_reclaimed;
@@ -637,7 +1070,7 @@ static unsigned long promote_node(pg_data_t *pgdat, struct mem_cgroup *memcg)
     unsigned long nr_to_promote, nr_promoted = 0, tmp;
     enum lru_list lru = LRU_ACTIVE_ANON;
     short priority = DEF_PRIORITY;
-    int target_nid = htmm_cxl_mode ? 0 : next_promotion_node(pgdat->node_id);
+    int target_nid = htmm_promotion_target(pgdat->node_id);
 
     if (!promotion_available(target_nid, memcg, &nr_to_promote))
 	return 0;
@@ -709,7 +1142,7 @@ static unsigned long cooling_active_list(unsigned long nr_to_scan,
 #endif
 		check_transhuge_cooling((void *)memcg, page, false);
 
-		if (meta->idx >= memcg->active_threshold)
+		if (htmm_is_promotion_candidate(memcg, page, meta->idx))
 		    still_hot = 2;
 		else
 		    still_hot = 1;
@@ -755,11 +1188,15 @@ static unsigned long cooling_active_list(unsigned long nr_to_scan,
     return nr_taken;
 }
 
-static void cooling_node(pg_data_t *pgdat, struct mem_cgroup *memcg)
+/* this node's share of a cooling pass, cut short at htmm_cooling_timeout.
+ * returns true if it completed the pass.
+ */
+static bool cooling_node(pg_data_t *pgdat, struct mem_cgroup *memcg)
 {
     unsigned long nr_to_scan, nr_scanned = 0, nr_max_scan = 12;
     struct lruvec *lruvec = mem_cgroup_lruvec(memcg, pgdat);
-    struct mem_cgroup_per_node *pn = memcg->nodeinfo[pgdat->node_id];
+    unsigned long deadline = READ_ONCE(memcg->cooling_start) +
+	msecs_to_jiffies(htmm_cooling_timeout);
     enum lru_list lru = LRU_ACTIVE_ANON; 
 
 re_cooling:
@@ -767,6 +1204,8 @@ re_cooling:
     do {
 	unsigned long scan = nr_to_scan >> 3; /* 12.5% */
 
+	if (time_after(jiffies, deadline))
+	    goto done;
 	if (!scan)
 	    scan = nr_to_scan;
 	/* limits the num. of scanned pages to reduce the lock holding time */
@@ -784,8 +1223,8 @@ re_cooling:
     /* active file list */
     cooling_active_list(lruvec_lru_size(lruvec, LRU_ACTIVE_FILE, MAX_NR_ZONES),
 					lruvec, LRU_ACTIVE_FILE);
-    //if (nr_scanned >= nr_to_scan)
-    WRITE_ONCE(pn->need_cooling, false);
+done:
+    return htmm_cooling_done(memcg, pgdat->node_id);
 }
 
 static unsigned long adjusting_lru_list(unsigned long nr_to_scan,
@@ -841,7 +1280,7 @@ static unsigned long adjusting_lru_list(unsigned long nr_to_scan,
 	if (PageTransHuge(compound_head(page))) {
 	    struct page *meta = get_meta_page(page);
 	    
-	    if (meta->idx >= memcg->active_threshold)
+	    if (htmm_is_promotion_candidate(memcg, page, meta->idx))
 		status = 2;
 	    else
 		status = 1;
@@ -919,6 +1358,323 @@ static void adjusting_node(pg_data_t *pgdat, struct mem_cgroup *memcg, bool acti
 	WRITE_ONCE(pn->need_adjusting_all, false);
 }
 
+/* hugetlb pages move between the hugetlb pools of the tiers: the promotion
+ * side fills the free pages of the fast tier pool with hot pages and reports
+ * the hot pages left over, for which the demotion side makes room by moving
+ * as many cold pages to the slow tier pool.
+ */
+#define HTMM_HUGETLB_BATCH 32
+
+static unsigned int hugetlb_pool_free(struct hstate *h, int nid)
+{
+    return READ_ONCE(h->free_huge_pages_node[nid]);
+}
+
+/* isolates pages of @pn for which @pick() is true, up to nr[hstate index];
+ * the picked pages that did not fit are counted in @nr_left
+ */
+static void isolate_hugetlb_pages(struct mem_cgroup_per_node *pn,
+	bool (*pick)(struct htmm_hugetlb_info *), unsigned int *nr,
+	unsigned int *nr_left, struct list_head *page_list)
+{
+    struct page *pages[HTMM_HUGETLB_BATCH];
+    struct htmm_hugetlb_info *info;
+    unsigned int nr_pages = 0, i;
+
+    spin_lock_irq(&pn->hugetlb_lock);
+    list_for_each_entry(info, &pn->hugetlb_list, list) {
+	int hidx = hstate_index(page_hstate(info->page));
+
+	if (!pick(info))
+	    continue;
+	if (!nr[hidx] || nr_pages == HTMM_HUGETLB_BATCH) {
+	    if (nr_left)
+		nr_left[hidx]++;
+	    continue;
+	}
+	/* pinned until isolated, records may go away once unlocked */
+	if (!get_page_unless_zero(info->page))
+	    continue;
+	pages[nr_pages++] = info->page;
+	nr[hidx]--;
+    }
+    spin_unlock_irq(&pn->hugetlb_lock);
+
+    for (i = 0; i < nr_pages; i++) {
+	isolate_huge_page(pages[i], page_list);
+	put_page(pages[i]);
+    }
+}
+
+static unsigned long hugetlb_list_pages(struct list_head *page_list)
+{
+    struct page *page;
+    unsigned long nr_pages = 0;
+
+    list_for_each_entry(page, page_list, lru)
+	nr_pages += compound_nr(page);
+    return nr_pages;
+}
+
+/* returns the number of base pages migrated */
+static unsigned long migrate_hugetlb_list(struct list_head *page_list,
+	int target_nid)
+{
+    unsigned long nr_pages;
+
+    if (list_empty(page_list))
+	return 0;
+
+    nr_pages = hugetlb_list_pages(page_list);
+    migrate_pages(page_list, alloc_migrate_page, NULL, target_nid,
+	    MIGRATE_ASYNC, MR_NUMA_MISPLACED, NULL);
+    nr_pages -= hugetlb_list_pages(page_list);
+    putback_movable_pages(page_list);
+
+    return nr_pages;
+}
+
+static unsigned long promote_hugetlb_node(pg_data_t *pgdat,
+	struct mem_cgroup *memcg)
+{
+    struct mem_cgroup_per_node *pn = memcg->nodeinfo[pgdat->node_id];
+    int target_nid = htmm_promotion_target(pgdat->node_id);
+    unsigned int room[HUGE_MAX_HSTATE] = {}, waiting[HUGE_MAX_HSTATE] = {};
+    LIST_HEAD(page_list);
+    unsigned long nr_promoted;
+    struct hstate *h;
+    int i;
+
+    if (target_nid == NUMA_NO_NODE)
+	return 0;
+
+    for_each_hstate(h)
+	room[hstate_index(h)] = hugetlb_pool_free(h, target_nid);
+    isolate_hugetlb_pages(pn, htmm_hugetlb_is_hot, room, waiting, &page_list);
+    for (i = 0; i < HUGE_MAX_HSTATE; i++)
+	WRITE_ONCE(pn->hugetlb_waiting[i], waiting[i]);
+
+    nr_promoted = migrate_hugetlb_list(&page_list, target_nid);
+    count_vm_events(HTMM_HUGETLB_PROMOTED, nr_promoted);
+    return nr_promoted;
+}
+
+static unsigned long demote_hugetlb_node(pg_data_t *pgdat,
+	struct mem_cgroup *memcg)
+{
+    struct mem_cgroup_per_node *pn = memcg->nodeinfo[pgdat->node_id];
+    int target_nid = htmm_demotion_target(pgdat->node_id);
+    unsigned int need[HUGE_MAX_HSTATE] = {};
+    LIST_HEAD(page_list);
+    unsigned long nr_demoted;
+    bool demote = false;
+    struct hstate *h;
+    int nid;
+
+    if (target_nid == NUMA_NO_NODE)
+	return 0;
+
+    for_each_hstate(h) {
+	int hidx = hstate_index(h);
+	unsigned int waiting = 0, nr_free;
+
+	for_each_node_state(nid, N_MEMORY) {
+	    if (!htmm_node_is_toptier(nid) &&
+		htmm_promotion_target(nid) == pgdat->node_id)
+		waiting += READ_ONCE(memcg->nodeinfo[nid]->hugetlb_waiting[hidx]);
+	}
+	nr_free = hugetlb_pool_free(h, pgdat->node_id);
+	if (waiting <= nr_free)
+	    continue;
+	need[hidx] = min(waiting - nr_free, hugetlb_pool_free(h, target_nid));
+	if (need[hidx])
+	    demote = true;
+    }
+    if (!demote)
+	return 0;
+
+    isolate_hugetlb_pages(pn, htmm_hugetlb_is_cold, need, NULL, &page_list);
+    nr_demoted = migrate_hugetlb_list(&page_list, target_nid);
+    count_vm_events(HTMM_HUGETLB_DEMOTED, nr_demoted);
+    return nr_demoted;
+}
+
+/* THP bloat: a THP faulted in by a sparse heap holds 2MB of the fast tier
+ * for a few used subpages. Cold THPs with at most htmm_thp_bloat_thres
+ * sampled subpages, whose other subpages are zero up to that many, are
+ * split; the split drops the zero subpages that were never sampled (see
+ * try_to_unmap_clean()) and the room goes to promotion right away.
+ */
+#define HTMM_BLOAT_SCAN 256 /* lru entries per pass */
+
+static bool subpage_is_zero(struct page *page)
+{
+    void *addr = kmap_local_page(page);
+    bool zero = !memchr_inv(addr, 0, PAGE_SIZE);
+
+    kunmap_local(addr);
+    return zero;
+}
+
+/* runs under the lru lock, on sampling stats only */
+static bool thp_may_be_bloated(struct page *page)
+{
+    unsigned int i, nr_accessed = 0;
+
+    if (!PageTransHuge(page) || !PageAnon(page) || !PageHtmm(&page[3]))
+	return false;
+
+    for (i = 0; i < HPAGE_PMD_NR; i++) {
+	if (htmm_thp_subpage_accessed(page, i) &&
+		++nr_accessed > htmm_thp_bloat_thres)
+	    return false;
+    }
+    return true;
+}
+
+static bool thp_is_bloated(struct page *page)
+{
+    unsigned int i, nr_kept = 0;
+
+    for (i = 0; i < HPAGE_PMD_NR; i++) {
+	if ((htmm_thp_subpage_accessed(page, i) ||
+		    !subpage_is_zero(page + i)) &&
+		++nr_kept > htmm_thp_bloat_thres)
+	    return false;
+    }
+    return true;
+}
+
+static unsigned long isolate_bloated_thps(struct lruvec *lruvec,
+	struct list_head *dst)
+{
+    struct list_head *src = &lruvec->lists[LRU_INACTIVE_ANON];
+    unsigned long nr_zone_taken[MAX_NR_ZONES] = { 0 };
+    unsigned long nr_taken = 0;
+    struct page *page, *prev;
+    int scan = 0;
+
+    /* from the cold end, leaving the other pages in place */
+    list_for_each_entry_safe_reverse(page, prev, src, lru) {
+	if (scan++ >= HTMM_BLOAT_SCAN)
+	    break;
+	if (!thp_may_be_bloated(page))
+	    continue;
+	if (!__isolate_lru_page_prepare(page, 0))
+	    continue;
+	if (unlikely(!get_page_unless_zero(page)))
+	    continue;
+	if (!TestClearPageLRU(page)) {
+	    put_page(page);
+	    continue;
+	}
+
+	nr_taken += HPAGE_PMD_NR;
+	nr_zone_taken[page_zonenum(page)] += HPAGE_PMD_NR;
+	list_move(&page->lru, dst);
+    }
+
+    update_lru_sizes(lruvec, LRU_INACTIVE_ANON, nr_zone_taken);
+    return nr_taken;
+}
+
+/* wakes the kmigraterd of @pgdat up with @pn as its next memcg */
+static void kick_kmigraterd(pg_data_t *pgdat, struct mem_cgroup_per_node *pn)
+{
+    struct mem_cgroup_per_node *mz;
+
+    spin_lock(&pgdat->kmigraterd_lock);
+    list_for_each_entry(mz, &pgdat->kmigraterd_head, kmigraterd_list) {
+	if (mz == pn) {
+	    list_move(&pn->kmigraterd_list, &pgdat->kmigraterd_head);
+	    break;
+	}
+    }
+    spin_unlock(&pgdat->kmigraterd_lock);
+
+    WRITE_ONCE(pgdat->kmigraterd_kicked, true);
+    wake_up_interruptible(&pgdat->kmigraterd_wait);
+}
+
+/* lets the promotion side fill the room freed on the fast tier node @pgdat */
+static void kick_promotion(pg_data_t *pgdat, struct mem_cgroup *memcg)
+{
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+	if (htmm_node_is_toptier(nid) ||
+		htmm_promotion_target(nid) != pgdat->node_id)
+	    continue;
+
+	kick_kmigraterd(NODE_DATA(nid), memcg->nodeinfo[nid]);
+    }
+}
+
+/* starts the cooling pass set up by __cooling() on all nodes together */
+void htmm_kick_cooling(struct mem_cgroup *memcg)
+{
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+	if (NODE_DATA(nid)->kmigraterd)
+	    kick_kmigraterd(NODE_DATA(nid), memcg->nodeinfo[nid]);
+    }
+}
+
+static unsigned long reclaim_thp_bloat(pg_data_t *pgdat,
+	struct mem_cgroup *memcg)
+{
+    struct lruvec *lruvec = mem_cgroup_lruvec(memcg, pgdat);
+    unsigned long nr_taken, nr_freed = 0;
+    LIST_HEAD(page_list);
+    LIST_HEAD(ret_list);
+
+    lru_add_drain();
+
+    spin_lock_irq(&lruvec->lru_lock);
+    nr_taken = isolate_bloated_thps(lruvec, &page_list);
+    __mod_node_page_state(pgdat, NR_ISOLATED_ANON, nr_taken);
+    spin_unlock_irq(&lruvec->lru_lock);
+
+    if (nr_taken == 0)
+	return 0;
+
+    while (!list_empty(&page_list)) {
+	struct page *page = lru_to_page(&page_list);
+	unsigned long nr_left = 0;
+	LIST_HEAD(split_list);
+	struct list_head *pos;
+
+	list_move(&page->lru, &split_list);
+	if (!thp_is_bloated(page) || !trylock_page(page)) {
+	    list_splice(&split_list, &ret_list);
+	    continue;
+	}
+
+	if (!split_huge_page_to_list(page, &split_list)) {
+	    list_for_each(pos, &split_list)
+		nr_left++;
+	    nr_freed += HPAGE_PMD_NR - nr_left;
+	    count_vm_event(HTMM_THP_BLOAT_SPLIT);
+	}
+	unlock_page(page);
+	list_splice(&split_list, &ret_list);
+    }
+
+    spin_lock_irq(&lruvec->lru_lock);
+    move_pages_to_lru(lruvec, &ret_list);
+    __mod_node_page_state(pgdat, NR_ISOLATED_ANON, -nr_taken);
+    spin_unlock_irq(&lruvec->lru_lock);
+
+    mem_cgroup_uncharge_list(&ret_list);
+    free_unref_page_list(&ret_list);
+
+    count_vm_events(HTMM_THP_BLOAT_FREED, nr_freed);
+    if (nr_freed)
+	kick_promotion(pgdat, memcg);
+    return nr_freed;
+}
+
 static struct mem_cgroup_per_node *next_memcg_cand(pg_data_t *pgdat)
 {
     struct mem_cgroup_per_node *pn;
@@ -935,18 +1691,35 @@ static struct mem_cgroup_per_node *next_memcg_cand(pg_data_t *pgdat)
     return pn;
 }
 
-static int kmigraterd_demotion(pg_data_t *pgdat)
+/* kmigraterd runs next to the fast tier node it demotes from or promotes
+ * to; a tier change or a cpu hotplug calls it again for the running ones.
+ */
+static void kmigraterd_bind(pg_data_t *pgdat, struct task_struct *km)
 {
-    const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+    int nid = pgdat->node_id;
+    const struct cpumask *cpumask;
+
+    if (!htmm_node_is_toptier(nid))
+	nid = htmm_promotion_target(nid);
+    if (nid == NUMA_NO_NODE)
+	return;
 
-    if (!cpumask_empty(cpumask))
-	set_cpus_allowed_ptr(pgdat->kmigraterd, cpumask);
+    cpumask = cpumask_of_node(nid);
+    if (cpumask_any_and(cpu_online_mask, cpumask) < nr_cpu_ids)
+	set_cpus_allowed_ptr(km, cpumask);
+}
+
+static int kmigraterd_demotion(pg_data_t *pgdat)
+{
+    kmigraterd_bind(pgdat, current);
 
     for ( ; ; ) {
 	struct mem_cgroup_per_node *pn;
 	struct mem_cgroup *memcg;
-	unsigned long nr_exceeded = 0;
+	unsigned long nr_exceeded = 0, nr_demoted;
+	bool demote = false;
 	LIST_HEAD(split_list);
+	u64 start;
 
 	if (kthread_should_stop())
 	    break;
@@ -966,6 +1739,11 @@ static int kmigraterd_demotion(pg_data_t *pgdat)
 	    continue;
 	}
 
+	/* over its tiering cpu budget: only the fast tier limit is enforced */
+	if (htmm_over_cpu_budget(memcg))
+	    goto demotion;
+
+	start = local_clock();
 	/* performs split */
 	if (htmm_thres_split != 0 &&
 		!list_empty(&(&pn->deferred_split_queue)->split_queue)) {
@@ -976,46 +1754,73 @@ static int kmigraterd_demotion(pg_data_t *pgdat)
 	    }
 	}
 	/* performs cooling */
-	if (need_lru_cooling(pn))
-	    cooling_node(pgdat, memcg);
-	else if (need_lru_adjusting(pn)) {
+	if (need_lru_cooling(pn)) {
+	    /* hotness has just been refreshed on all nodes; the page table
+	     * placement is fixed up once per pass, by the last node */
+	    if (cooling_node(pgdat, memcg))
+		htmm_rebalance_pgtables(memcg);
+	} else if (need_lru_adjusting(pn)) {
 	    adjusting_node(pgdat, memcg, true);
 	    if (pn->need_adjusting_all == true)
 		// adjusting the inactive list
 		adjusting_node(pgdat, memcg, false);
 	}
-	
+	htmm_charge_work(memcg, HTMM_WORK_COOLING, start);
+
+	if (htmm_thp_bloat_thres) {
+	    start = local_clock();
+	    reclaim_thp_bloat(pgdat, memcg);
+	    htmm_charge_work(memcg, HTMM_WORK_MIGRATE, start);
+	}
+
+demotion:
+	htmm_update_watermarks(pgdat, memcg);
 	/* demotes inactive lru pages */
 	if (need_toptier_demotion(pgdat, memcg, &nr_exceeded)) {
-	    demote_node(pgdat, memcg, nr_exceeded);
+	    demote = true;
+	    start = local_clock();
+	    nr_demoted = demote_node(pgdat, memcg, nr_exceeded);
+	    htmm_charge_work(memcg, HTMM_WORK_MIGRATE, start);
+	    pn->wmark_nr_demoted += nr_demoted;
+	    pn->wmark_demote_ns += local_clock() - start;
+	    atomic64_add(nr_demoted << PAGE_SHIFT, &memcg->htmm_migrate_bytes);
+	}
+	/* the busy pages are not left isolated once demotion stops */
+	start = local_clock();
+	nr_demoted = retry_busy_pages(pgdat, memcg, false, demote);
+	htmm_charge_work(memcg, HTMM_WORK_MIGRATE, start);
+	atomic64_add(nr_demoted << PAGE_SHIFT, &memcg->htmm_migrate_bytes);
+	/* makes room in the hugetlb pool for hot hugetlb pages */
+	if (htmm_hugetlb) {
+	    start = local_clock();
+	    nr_demoted = demote_hugetlb_node(pgdat, memcg);
+	    htmm_charge_work(memcg, HTMM_WORK_MIGRATE, start);
+	    atomic64_add(nr_demoted << PAGE_SHIFT, &memcg->htmm_migrate_bytes);
 	}
 	//if (need_direct_demotion(pgdat, memcg))
 	  //  goto demotion;
 
 	/* default: wait 50 ms */
 	wait_event_interruptible_timeout(pgdat->kmigraterd_wait,
-	    need_direct_demotion(pgdat, memcg),
+	    need_direct_demotion(pgdat, memcg) ||
+	    READ_ONCE(pgdat->kmigraterd_kicked),
 	    msecs_to_jiffies(htmm_demotion_period_in_ms));	    
+	WRITE_ONCE(pgdat->kmigraterd_kicked, false);
     }
     return 0;
 }
 
 static int kmigraterd_promotion(pg_data_t *pgdat)
 {
-    const struct cpumask *cpumask;
-
-    if (htmm_cxl_mode)
-    	cpumask = cpumask_of_node(pgdat->node_id);
-    else
-	cpumask = cpumask_of_node(pgdat->node_id - 2);
-
-    if (!cpumask_empty(cpumask))
-	set_cpus_allowed_ptr(pgdat->kmigraterd, cpumask);
+    kmigraterd_bind(pgdat, current);
 
     for ( ; ; ) {
 	struct mem_cgroup_per_node *pn;
 	struct mem_cgroup *memcg;
+	unsigned long nr_promoted;
+	bool promote = false;
 	LIST_HEAD(split_list);
+	u64 start;
 
 	if (kthread_should_stop())
 	    break;
@@ -1035,6 +1840,11 @@ static int kmigraterd_promotion(pg_data_t *pgdat)
 	    continue;
 	}
 
+	/* over its tiering cpu budget: nothing is promoted */
+	if (htmm_over_cpu_budget(memcg))
+	    goto sleep;
+
+	start = local_clock();
 	/* performs split */
 	if (htmm_thres_split != 0 &&
 		!list_empty(&(&pn->deferred_split_queue)->split_queue)) {
@@ -1045,21 +1855,49 @@ static int kmigraterd_promotion(pg_data_t *pgdat)
 	    }
 	}
 
-	if (need_lru_cooling(pn))
-	    cooling_node(pgdat, memcg);
-	else if (need_lru_adjusting(pn)) {
+	if (need_lru_cooling(pn)) {
+	    if (cooling_node(pgdat, memcg))
+		htmm_rebalance_pgtables(memcg);
+	} else if (need_lru_adjusting(pn)) {
 	    adjusting_node(pgdat, memcg, true);
 	    if (pn->need_adjusting_all == true)
 		// adjusting the inactive list
 		adjusting_node(pgdat, memcg, false);
 	}
-
-	/* promotes hot pages to fast memory node */
-	if (need_lowertier_promotion(pgdat, memcg)) {
-	    promote_node(pgdat, memcg);
+	htmm_charge_work(memcg, HTMM_WORK_COOLING, start);
+
+	/* promotes hot pages to fast memory node, unless the fast tier is
+	 * already the slower one (bandwidth balancing)
+	 */
+	if (need_lowertier_promotion(pgdat, memcg) &&
+	    htmm_bw_promotion_allowed()) {
+	    promote = true;
+	    start = local_clock();
+	    nr_promoted = promote_node(pgdat, memcg);
+	    htmm_charge_work(memcg, HTMM_WORK_MIGRATE, start);
+	    atomic64_add(nr_promoted << PAGE_SHIFT, &memcg->htmm_migrate_bytes);
+	}
+	if (htmm_hugetlb && htmm_bw_promotion_allowed()) {
+	    start = local_clock();
+	    nr_promoted = promote_hugetlb_node(pgdat, memcg);
+	    htmm_charge_work(memcg, HTMM_WORK_MIGRATE, start);
+	    atomic64_add(nr_promoted << PAGE_SHIFT, &memcg->htmm_migrate_bytes);
 	}
 
-	msleep_interruptible(htmm_promotion_period_in_ms);
+sleep:
+	/* the busy pages are not left isolated once promotion stops */
+	start = local_clock();
+	nr_promoted = retry_busy_pages(pgdat, memcg, true, promote);
+	htmm_charge_work(memcg, HTMM_WORK_MIGRATE, start);
+	atomic64_add(nr_promoted << PAGE_SHIFT, &memcg->htmm_migrate_bytes);
+
+	/* woken early when the fast tier gained room, see kick_promotion(),
+	 * or for a cooling pass, see htmm_kick_cooling()
+	 */
+	wait_event_interruptible_timeout(pgdat->kmigraterd_wait,
+	    READ_ONCE(pgdat->kmigraterd_kicked),
+	    msecs_to_jiffies(htmm_promotion_period_in_ms));
+	WRITE_ONCE(pgdat->kmigraterd_kicked, false);
     }
 
     return 0;
@@ -1070,14 +1908,7 @@ static int kmigraterd(void *p)
     pg_data_t *pgdat = (pg_data_t *)p;
     int nid = pgdat->node_id;
 
-    if (htmm_cxl_mode) {
-	if (nid == 0)
-	    return kmigraterd_demotion(pgdat);
-	else
-	    return kmigraterd_promotion(pgdat);
-    }
-
-    if (node_is_toptier(nid))
+    if (htmm_node_is_toptier(nid))
 	return kmigraterd_demotion(pgdat);
     else
 	return kmigraterd_promotion(pgdat);
@@ -1108,6 +1939,8 @@ void kmigraterd_stop(void)
 {
     int nid;
 
+    /* against kmigraterd_rebind() */
+    cpus_read_lock();
     for_each_node_state(nid, N_MEMORY) {
 	struct task_struct *km = NODE_DATA(nid)->kmigraterd;
 
@@ -1116,6 +1949,7 @@ void kmigraterd_stop(void)
 	    NODE_DATA(nid)->kmigraterd = NULL;
 	}
     }
+    cpus_read_unlock();
 }
 
 int kmigraterd_init(void)
@@ -1126,3 +1960,327 @@ int kmigraterd_init(void)
 	kmigraterd_run(nid);
     return 0;
 }
+
+/* must hold the cpu hotplug lock, which keeps the threads from stopping */
+static void kmigraterd_rebind(void)
+{
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+	pg_data_t *pgdat = NODE_DATA(nid);
+
+	if (pgdat->kmigraterd)
+	    kmigraterd_bind(pgdat, pgdat->kmigraterd);
+    }
+}
+
+/* one of the cpus of a node came back: restore the affinity, as kcompactd */
+static int kmigraterd_cpu_online(unsigned int cpu)
+{
+    kmigraterd_rebind();
+    return 0;
+}
+
+/* Memory hotplug: a node that gains its first memory (a CXL expander being
+ * onlined) joins the tier hierarchy, and one that loses all of it leaves.
+ * The tier order is rebuilt synchronously; creating cgroup files and
+ * kmigraterd threads is deferred to a work item since the notifier runs
+ * under the memory hotplug lock.
+ */
+static void htmm_hotplug_workfn(struct work_struct *work)
+{
+    struct mem_cgroup *memcg;
+    bool enabled = false;
+    int nid;
+
+    for_each_node(nid) {
+	pg_data_t *pgdat = NODE_DATA(nid);
+
+	if (!pgdat || node_state(nid, N_MEMORY))
+	    continue;
+	if (pgdat->kmigraterd) {
+	    cpus_read_lock();
+	    kthread_stop(pgdat->kmigraterd);
+	    pgdat->kmigraterd = NULL;
+	    cpus_read_unlock();
+	}
+	mem_cgroup_per_node_htmm_exit(nid);
+    }
+
+    mem_cgroup_per_node_htmm_init();
+
+    for (memcg = mem_cgroup_iter(NULL, NULL, NULL); memcg;
+	 memcg = mem_cgroup_iter(NULL, memcg, NULL)) {
+	if (!memcg->htmm_enabled)
+	    continue;
+
+	enabled = true;
+	for_each_node(nid) {
+	    pg_data_t *pgdat = NODE_DATA(nid);
+
+	    if (!pgdat)
+		continue;
+	    if (node_state(nid, N_MEMORY)) {
+		WRITE_ONCE(pgdat->kswapd_failures, MAX_RECLAIM_RETRIES);
+		add_memcg_to_kmigraterd(memcg, nid);
+	    } else {
+		del_memcg_from_kmigraterd(memcg, nid);
+	    }
+	}
+	mem_cgroup_htmm_update_dram_max(memcg);
+	/* recompute the thresholds against the new capacity */
+	set_lru_adjusting(memcg, true);
+    }
+
+    if (!enabled)
+	return;
+
+    kmigraterd_init();
+    /* the promotion targets may have changed with the tiers */
+    cpus_read_lock();
+    kmigraterd_rebind();
+    cpus_read_unlock();
+    for_each_node_state(nid, N_MEMORY)
+	kmigraterd_wakeup(nid);
+}
+static DECLARE_WORK(htmm_hotplug_work, htmm_hotplug_workfn);
+
+static int htmm_memory_callback(struct notifier_block *self,
+				unsigned long action, void *_arg)
+{
+    struct memory_notify *arg = _arg;
+
+    if (arg->status_change_nid < 0)
+	return notifier_from_errno(0);
+
+    switch (action) {
+    case MEM_ONLINE:
+    case MEM_OFFLINE:
+	htmm_rebuild_cxl_tiers();
+	schedule_work(&htmm_hotplug_work);
+	break;
+    }
+
+    return notifier_from_errno(0);
+}
+
+static int __init htmm_hotplug_init(void)
+{
+    int ret;
+
+    htmm_rebuild_cxl_tiers();
+    /* after migrate_on_reclaim_callback() rebuilt the demotion order */
+    hotplug_memory_notifier(htmm_memory_callback, 90);
+
+    ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "mm/kmigraterd:online",
+				    kmigraterd_cpu_online, NULL);
+    if (ret < 0)
+	pr_err("kmigraterd: failed to register hotplug callbacks.\n");
+    return 0;
+}
+late_initcall(htmm_hotplug_init);
+
+/*
+ * Migration benchmark, driven by tools/testing/selftests/vm/htmm_migrate_bench.
+ * Writing to htmm/migrate_bench/run moves up to nr_pages anon pages of the
+ * memcg of pid to the other tier through migrate_page_list(), batch pages
+ * per call and without the hotness filters. The write returns once done;
+ * result then reports what it took.
+ */
+static DEFINE_MUTEX(htmm_bench_lock);
+static u32 htmm_bench_pid;
+static u64 htmm_bench_nr_pages = 65536;
+static u32 htmm_bench_batch = SWAP_CLUSTER_MAX;
+static bool htmm_bench_promote = true;
+
+static struct {
+    u64 nr_migrated; /* base pages */
+    u64 nr_thp;
+    u64 nr_batches;
+    u64 elapsed_ns;
+    u64 migrate_ns; /* spent in migrate_page_list() */
+    u64 nr_tlb_flushes;
+} htmm_bench_result;
+
+static unsigned long htmm_nr_thp_on_list(struct list_head *list)
+{
+    struct page *page;
+    unsigned long nr = 0;
+
+    list_for_each_entry(page, list, lru) {
+	if (PageTransHuge(page))
+	    nr++;
+    }
+    return nr;
+}
+
+static unsigned long htmm_bench_lruvec(struct lruvec *lruvec, bool promotion,
+	unsigned long nr_to_move)
+{
+    pg_data_t *pgdat = lruvec_pgdat(lruvec);
+    unsigned long nr_moved = 0;
+    enum lru_list lru;
+
+    for (lru = LRU_INACTIVE_ANON; lru <= LRU_ACTIVE_ANON; lru++) {
+	while (nr_moved < nr_to_move && !fatal_signal_pending(current)) {
+	    LIST_HEAD(page_list);
+	    unsigned long nr_taken, nr_thp, nr;
+	    u64 start;
+
+	    spin_lock_irq(&lruvec->lru_lock);
+	    nr_taken = isolate_lru_pages(min_t(unsigned long, htmm_bench_batch,
+			nr_to_move - nr_moved), lruvec, lru, &page_list, 0);
+	    __mod_node_page_state(pgdat, NR_ISOLATED_ANON, nr_taken);
+	    spin_unlock_irq(&lruvec->lru_lock);
+	    if (!nr_taken)
+		break;
+
+	    nr_thp = htmm_nr_thp_on_list(&page_list);
+	    start = local_clock();
+	    nr = migrate_page_list(&page_list, pgdat, promotion);
+	    htmm_bench_result.migrate_ns += local_clock() - start;
+	    htmm_bench_result.nr_thp += nr_thp - htmm_nr_thp_on_list(&page_list);
+	    htmm_bench_result.nr_batches++;
+	    nr_moved += nr;
+
+	    spin_lock_irq(&lruvec->lru_lock);
+	    move_pages_to_lru(lruvec, &page_list);
+	    __mod_node_page_state(pgdat, NR_ISOLATED_ANON, -nr_taken);
+	    spin_unlock_irq(&lruvec->lru_lock);
+
+	    mem_cgroup_uncharge_list(&page_list);
+	    free_unref_page_list(&page_list);
+
+	    /* the target is full or the pages are busy */
+	    if (!nr)
+		break;
+	    cond_resched();
+	}
+    }
+    return nr_moved;
+}
+
+static u64 htmm_bench_tlb_flushes(void)
+{
+#ifdef CONFIG_DEBUG_TLBFLUSH
+    unsigned long *events;
+    u64 nr;
+
+    events = kcalloc(NR_VM_EVENT_ITEMS, sizeof(unsigned long), GFP_KERNEL);
+    if (!events)
+	return 0;
+    all_vm_events(events);
+    nr = events[NR_TLB_REMOTE_FLUSH];
+    kfree(events);
+    return nr;
+#else
+    return 0;
+#endif
+}
+
+static int htmm_bench_run(void)
+{
+    struct task_struct *p;
+    struct mm_struct *mm;
+    struct mem_cgroup *memcg;
+    unsigned long nr_moved = 0;
+    u64 start, tlb_start;
+    int nid;
+
+    rcu_read_lock();
+    p = find_task_by_vpid(htmm_bench_pid);
+    if (p)
+	get_task_struct(p);
+    rcu_read_unlock();
+    if (!p)
+	return -ESRCH;
+    mm = get_task_mm(p);
+    put_task_struct(p);
+    if (!mm)
+	return -EINVAL;
+
+    memcg = get_mem_cgroup_from_mm(mm);
+    mmput(mm);
+    if (!memcg)
+	return -EINVAL;
+    if (!memcg->htmm_enabled) {
+	css_put(&memcg->css);
+	return -EINVAL;
+    }
+
+    memset(&htmm_bench_result, 0, sizeof(htmm_bench_result));
+    lru_add_drain_all();
+    tlb_start = htmm_bench_tlb_flushes();
+    start = local_clock();
+
+    /* promotion drains the slow tier nodes, demotion the fast ones */
+    for_each_node_state(nid, N_MEMORY) {
+	if (htmm_node_is_toptier(nid) == htmm_bench_promote)
+	    continue;
+	nr_moved += htmm_bench_lruvec(mem_cgroup_lruvec(memcg, NODE_DATA(nid)),
+		htmm_bench_promote, htmm_bench_nr_pages - nr_moved);
+	if (nr_moved >= htmm_bench_nr_pages)
+	    break;
+    }
+
+    htmm_bench_result.elapsed_ns = local_clock() - start;
+    htmm_bench_result.nr_migrated = nr_moved;
+    htmm_bench_result.nr_tlb_flushes = htmm_bench_tlb_flushes() - tlb_start;
+    css_put(&memcg->css);
+    return 0;
+}
+
+static int htmm_bench_run_set(void *data, u64 val)
+{
+    int ret;
+
+    if (!val)
+	return 0;
+
+    mutex_lock(&htmm_bench_lock);
+    ret = htmm_bench_run();
+    mutex_unlock(&htmm_bench_lock);
+    return ret;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(htmm_bench_run_fops, NULL, htmm_bench_run_set,
+	"%llu\n");
+
+static int htmm_bench_result_show(struct seq_file *m, void *v)
+{
+    u64 elapsed;
+
+    mutex_lock(&htmm_bench_lock);
+    elapsed = max(htmm_bench_result.elapsed_ns, 1ULL);
+    seq_printf(m, "pages %llu\n", htmm_bench_result.nr_migrated);
+    seq_printf(m, "thp %llu\n", htmm_bench_result.nr_thp);
+    seq_printf(m, "batches %llu\n", htmm_bench_result.nr_batches);
+    seq_printf(m, "elapsed_ns %llu\n", htmm_bench_result.elapsed_ns);
+    seq_printf(m, "migrate_ns %llu\n", htmm_bench_result.migrate_ns);
+    seq_printf(m, "pages_per_sec %llu\n",
+	    mul_u64_u64_div_u64(htmm_bench_result.nr_migrated, NSEC_PER_SEC,
+		elapsed));
+    seq_printf(m, "mb_per_sec %llu\n",
+	    mul_u64_u64_div_u64(htmm_bench_result.nr_migrated << PAGE_SHIFT,
+		NSEC_PER_SEC, elapsed) >> 20);
+#ifdef CONFIG_DEBUG_TLBFLUSH
+    seq_printf(m, "tlb_shootdowns %llu\n", htmm_bench_result.nr_tlb_flushes);
+#endif
+    mutex_unlock(&htmm_bench_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(htmm_bench_result);
+
+static int __init htmm_bench_init(void)
+{
+    struct dentry *dir;
+
+    dir = debugfs_create_dir("migrate_bench", htmm_debugfs_root);
+    debugfs_create_u32("pid", 0600, dir, &htmm_bench_pid);
+    debugfs_create_u64("nr_pages", 0600, dir, &htmm_bench_nr_pages);
+    debugfs_create_u32("batch", 0600, dir, &htmm_bench_batch);
+    debugfs_create_bool("promote", 0600, dir, &htmm_bench_promote);
+    debugfs_create_file_unsafe("run", 0200, dir, NULL, &htmm_bench_run_fops);
+    debugfs_create_file("result", 0400, dir, NULL, &htmm_bench_result_fops);
+    return 0;
+}
+late_initcall_sync(htmm_bench_init);
@@ -7,7 +7,12 @@
 #include <linux/sched.h>
 #include <linux/perf_event.h>
 #include <linux/delay.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
 #include <linux/sched/cputime.h>
+#include <linux/debugfs.h>
+#include <linux/random.h>
+#include <linux/srcu.h>
 
 #include "../kernel/events/internal.h"
 
@@ -139,6 +144,10 @@ static void heap_sift_up(struct event_heap *heap, u32 idx);
 static void heap_sift_down(struct event_heap *heap, u32 idx);
 static int heap_find(struct event_heap *heap, pginfo_t *pinfo);
 static void pebs_disable(void);
+static void htmm_walk_counters_open(int cpu);
+static void htmm_walk_counters_release(void);
+static void htmm_ldlat_open(int cpu);
+static void htmm_ldlat_release(void);
 
 // Phase 3.1: 自适应公式函数声明
 static u32 calculate_vibrate_score(enum event_type type);
@@ -156,9 +165,59 @@ void adaptive_update_work_handler(struct work_struct *work);
 static void adaptive_timer_init(void);
 static void adaptive_timer_stop(void);
 
+static void htmm_rotation_start(void);
+static void htmm_rotation_stop(void);
+static bool htmm_event_is_active(int event);
+static DEFINE_MUTEX(htmm_pmu_lock);
+/* ksamplingd reads the perf buffers of mem_event[cpu] under it */
+DEFINE_STATIC_SRCU(htmm_event_srcu);
+
+/* heartbeat sampling, see htmm_update_sampling_state() */
+#define HTMM_HEARTBEAT_PERIOD 10000019ULL
+#define HTMM_SUSPEND_CHECK_MS 1000
+/* heartbeat state of a cpu's events, guarded by htmm_pmu_lock */
+struct htmm_heartbeat {
+	bool suspended;
+	u64 saved_period[N_HTMMEVENTS]; /* restored on resume */
+};
+static DEFINE_PER_CPU(struct htmm_heartbeat, htmm_heartbeats);
+
 struct task_struct *access_sampling = NULL;
 struct perf_event ***mem_event;
 
+/* samples are written by htmm_overflow_handler() instead of perf_buffer */
+static bool use_sample_ring;
+static DEFINE_PER_CPU(struct htmm_sample_ring, htmm_sample_rings);
+
+/* htmm_stlb_sampling of the running htmm_start */
+static bool htmm_stlb_events;
+/* page walk counters of each cpu, see htmm_walk_update() */
+static DEFINE_PER_CPU(struct perf_event *, htmm_walk_active);
+static DEFINE_PER_CPU(struct perf_event *, htmm_walk_completed);
+
+/* htmm_bw_balance of the running htmm_start: only the balancing pays
+ * for the load latency event, see htmm_ldlat_open() */
+static bool htmm_ldlat_events;
+/* load latency of each tier seen by a cpu, see htmm_ldlat_update() */
+struct htmm_ldlat_stat {
+	u64 sum[2]; /* cycles, 0: fast tier, 1: slow tier */
+	u64 nr[2];
+};
+static DEFINE_PER_CPU(struct perf_event *, htmm_ldlat_event);
+static DEFINE_PER_CPU(struct htmm_ldlat_stat, htmm_ldlat_stats);
+
+/* sample injector, see htmm_inject_start() */
+static bool htmm_inject_only; /* next htmm_start opens no event */
+static bool htmm_no_pebs; /* htmm_inject_only of the running htmm_start */
+static bool htmm_inject_running;
+static struct {
+	u64 start;
+	u64 nr_drained;
+	u64 nr_timed;
+	u64 queue_ns; /* from the push to the drain */
+	u64 resolve_ns; /* htmm_update_sample() */
+} htmm_inject_stats;
+
 static bool valid_va(unsigned long addr)
 {
 	if (!(addr >> (PGDIR_SHIFT + 9)) && addr != 0)
@@ -188,17 +247,105 @@ static __u64 get_pebs_event(enum events e)
 		return ICL_LOCAL_PMM;
 	case MEMWRITE:
 		return ICL_ALL_STORES;
+	case STLB_MISS_LOAD:
+		return htmm_stlb_events ? STLB_MISS_LOADS : N_HTMMEVENTS;
+	case STLB_MISS_STORE:
+		return htmm_stlb_events ? STLB_MISS_STORES : N_HTMMEVENTS;
 	default:
 		return N_HTMMEVENTS;
 	}
 }
 
+/* Runs in the PMI (NMI) on the cpu the event is bound to, so it is the only
+ * producer of this cpu's ring. The record is published by the release of
+ * ring->head; a full ring drops the sample.
+ */
+static bool htmm_ring_push(struct htmm_sample_ring *ring, u64 addr,
+			   pid_t pid, pid_t tid, int event)
+{
+	unsigned long head = ring->head;
+	struct htmm_sample *sample;
+
+	if (unlikely(!ring->samples))
+		return false;
+
+	if (head - smp_load_acquire(&ring->tail) >= HTMM_RING_SIZE) {
+		ring->nr_dropped++;
+		return false;
+	}
+
+	sample = &ring->samples[head & (HTMM_RING_SIZE - 1)];
+	sample->addr = addr;
+	sample->time = local_clock();
+	sample->pid = pid;
+	sample->tid = tid;
+	sample->event = event;
+
+	smp_store_release(&ring->head, head + 1);
+	return true;
+}
+
+static void htmm_overflow_handler(struct perf_event *event,
+				  struct perf_sample_data *data,
+				  struct pt_regs *regs)
+{
+	htmm_ring_push(this_cpu_ptr(&htmm_sample_rings), data->addr,
+		       task_tgid_nr(current), task_pid_nr(current),
+		       (unsigned long)event->overflow_handler_context);
+}
+
+/* a ring survives the offlining of its cpu, see htmm_cpu_offline() */
+static int htmm_sample_ring_init(int cpu)
+{
+	struct htmm_sample_ring *ring = per_cpu_ptr(&htmm_sample_rings, cpu);
+	struct htmm_sample *samples;
+
+	if (ring->samples)
+		return 0;
+
+	samples = kvzalloc_node(sizeof(struct htmm_sample) * HTMM_RING_SIZE,
+				GFP_KERNEL, cpu_to_node(cpu));
+	if (!samples)
+		return -ENOMEM;
+
+	ring->head = ring->tail = 0;
+	ring->nr_dropped = 0;
+	/* the handler and ksamplingd see an empty ring */
+	smp_store_release(&ring->samples, samples);
+	return 0;
+}
+
+static int htmm_sample_rings_init(void)
+{
+	int cpu;
+
+	for_each_online_cpu (cpu) {
+		if (htmm_sample_ring_init(cpu))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/* the events must be disabled */
+static void htmm_sample_rings_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		struct htmm_sample_ring *ring = per_cpu_ptr(&htmm_sample_rings,
+							    cpu);
+
+		kvfree(ring->samples);
+		ring->samples = NULL;
+	}
+}
+
 static int __perf_event_open(__u64 config, __u64 config1, __u64 cpu, __u64 type,
-			     __u32 pid)
+			     __u32 pid, struct perf_event **eventp)
 {
 	struct perf_event_attr attr;
-	struct file *file;
-	int event_fd, __pid;
+	struct task_struct *task = NULL;
+	struct perf_event *event;
 
 	memset(&attr, 0, sizeof(struct perf_event_attr));
 
@@ -225,58 +372,280 @@ static int __perf_event_open(__u64 config, __u64 config1, __u64 cpu, __u64 type,
 	attr.exclude_callchain_user = 1;
 	attr.precise_ip = 1;
 	attr.enable_on_exec = 1;
-
-	if (pid == 0)
-		__pid = -1;
+	/* one PEBS record per PMI, so every record reaches the handler.
+	 * This turns large PEBS off: the rings cost a PMI per sample.
+	 */
+	if (use_sample_ring)
+		attr.wakeup_events = 1;
+
+	/* a kernel counter: no fd in the table of whoever opens it */
+	if (pid) {
+		task = find_get_task_by_vpid(pid);
+		if (!task)
+			return -ESRCH;
+	}
+	if (use_sample_ring)
+		event = perf_event_create_kernel_counter(&attr, cpu, task,
+						htmm_overflow_handler,
+						(void *)(unsigned long)type);
 	else
-		__pid = pid;
+		event = perf_event_create_kernel_counter(&attr, cpu, task, NULL,
+							 NULL);
+	if (task)
+		put_task_struct(task);
+	if (IS_ERR(event)) {
+		printk("[error htmm__perf_event_open failure] err: %ld, config %llx, config1 %llx\n",
+		       PTR_ERR(event), config, config1);
+		return PTR_ERR(event);
+	}
+
+	*eventp = event;
+	return 0;
+}
+
+/* pid given to htmm_start, used for the cpus onlined later */
+static pid_t htmm_sampled_pid;
+static int htmm_cpuhp_state;
+
+/* @events must be unreachable from ksamplingd, see htmm_cpu_offline() */
+static void htmm_release_cpu_events(struct perf_event **events)
+{
+	int event;
 
-	event_fd = htmm__perf_event_open(&attr, __pid, cpu, -1, 0);
-	//event_fd = htmm__perf_event_open(&attr, -1, cpu, -1, 0);
-	if (event_fd <= 0) {
-		printk("[error htmm__perf_event_open failure] event_fd: %d, config %llx, config1 %llx\n",
-		       event_fd, config, config1);
-		return -1;
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		if (events[event])
+			perf_event_release_kernel(events[event]);
 	}
+	kfree(events);
+}
+
+/* Opens the events of @cpu into a new array, which is published only once
+ * complete: ksamplingd and the adaptive controller skip a cpu whose
+ * mem_event[cpu] is NULL.
+ */
+static int htmm_open_cpu_events(int cpu, pid_t pid)
+{
+	struct perf_event **events;
+	int event, ret;
+
+	events = kzalloc(sizeof(struct perf_event *) * N_HTMMEVENTS,
+			 GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
 
-	file = fget(event_fd);
-	if (!file) {
-		printk("invalid file\n");
-		return -1;
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		if (get_pebs_event(event) == N_HTMMEVENTS)
+			continue;
+
+		ret = __perf_event_open(get_pebs_event(event), 0, cpu, event,
+					pid, &events[event]);
+		if (ret)
+			goto release;
+		/* the ring needs no perf_buffer */
+		if (use_sample_ring)
+			continue;
+		ret = htmm__perf_event_init(events[event], BUFFER_SIZE);
+		if (ret)
+			goto release;
+	}
+
+	smp_store_release(&mem_event[cpu], events);
+	return 0;
+
+release:
+	htmm_release_cpu_events(events);
+	return ret;
+}
+
+/* all cpus, once ksamplingd and the cpuhp callbacks are gone */
+static void htmm_release_events(void)
+{
+	int cpu;
+
+	if (!mem_event)
+		return;
+
+	for_each_possible_cpu (cpu) {
+		if (mem_event[cpu])
+			htmm_release_cpu_events(mem_event[cpu]);
+	}
+	kfree(mem_event);
+	mem_event = NULL;
+}
+
+/* must hold htmm_pmu_lock */
+static bool htmm_cpu_suspended(int cpu)
+{
+	return per_cpu_ptr(&htmm_heartbeats, cpu)->suspended;
+}
+
+/* must hold htmm_pmu_lock */
+static void htmm_set_cpu_periods(int cpu, bool heartbeat)
+{
+	struct htmm_heartbeat *hb = per_cpu_ptr(&htmm_heartbeats, cpu);
+	int event;
+
+	if (hb->suspended == heartbeat)
+		return;
+
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		struct perf_event *pe = mem_event[cpu][event];
+
+		if (!pe)
+			continue;
+		if (heartbeat) {
+			hb->saved_period[event] = pe->attr.sample_period;
+			perf_event_period(pe, HTMM_HEARTBEAT_PERIOD);
+		} else if (hb->saved_period[event]) {
+			perf_event_period(pe, hb->saved_period[event]);
+		}
 	}
-	mem_event[cpu][type] = fget(event_fd)->private_data;
+	hb->suspended = heartbeat;
+}
+
+/* must hold htmm_pmu_lock. The fresh events of an onlined @cpu take the
+ * state and periods of another sampled cpu.
+ */
+static void htmm_copy_cpu_periods(int cpu)
+{
+	struct htmm_heartbeat *hb = per_cpu_ptr(&htmm_heartbeats, cpu);
+	int src, event;
+
+	hb->suspended = false;
+	for_each_online_cpu (src) {
+		if (src != cpu && mem_event[src])
+			break;
+	}
+	if (src >= nr_cpu_ids)
+		return;
+
+	*hb = *per_cpu_ptr(&htmm_heartbeats, src);
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		if (mem_event[cpu][event] && mem_event[src][event])
+			perf_event_period(mem_event[cpu][event],
+				mem_event[src][event]->attr.sample_period);
+	}
+}
+
+/* Runs on @cpu as it comes online. The events of a cpu are released while
+ * it is offline, so they are opened again here, and a cpu seen for the
+ * first time also gets its ring. The ring survives the offlining.
+ * Never fails the hotplug operation: the cpu is just left unsampled.
+ */
+static int htmm_cpu_online(unsigned int cpu)
+{
+	int event;
+
+	if (use_sample_ring && htmm_sample_ring_init(cpu)) {
+		pr_warn("htmm: no sample ring for cpu %u\n", cpu);
+		return 0;
+	}
+	if (htmm_no_pebs)
+		return 0;
+
+	htmm_walk_counters_open(cpu);
+	htmm_ldlat_open(cpu);
+	if (!mem_event[cpu]) {
+		if (htmm_open_cpu_events(cpu, htmm_sampled_pid)) {
+			pr_warn("htmm: failed to open events on cpu %u\n",
+				cpu);
+			return 0;
+		}
+		/* the new events are enabled; apply the rotation below */
+		for (event = 0; event < N_HTMMEVENTS; event++) {
+			if (mem_event[cpu][event])
+				perf_event_disable(mem_event[cpu][event]);
+		}
+	}
+
+	mutex_lock(&htmm_pmu_lock);
+	/* the state may have changed while the cpu was offline */
+	htmm_copy_cpu_periods(cpu);
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		if (mem_event[cpu][event] && htmm_event_is_active(event))
+			perf_event_enable(mem_event[cpu][event]);
+	}
+	mutex_unlock(&htmm_pmu_lock);
+	return 0;
+}
+
+static int htmm_cpu_offline(unsigned int cpu)
+{
+	struct perf_event **events;
+
+	/* the period updates look the array up under htmm_pmu_lock */
+	mutex_lock(&htmm_pmu_lock);
+	events = mem_event[cpu];
+	WRITE_ONCE(mem_event[cpu], NULL);
+	mutex_unlock(&htmm_pmu_lock);
+	if (!events)
+		return 0;
+
+	/* ksamplingd may still be reading their buffers */
+	synchronize_srcu(&htmm_event_srcu);
+	htmm_release_cpu_events(events);
 	return 0;
 }
 
 static int pebs_init(pid_t pid, int node)
 {
-	int cpu, event;
+	int cpu, event, ret;
 
 	mem_event =
 		kzalloc(sizeof(struct perf_event **) * nr_cpu_ids, GFP_KERNEL);
-	for_each_online_cpu (cpu) {
-		mem_event[cpu] = kzalloc(
-			sizeof(struct perf_event *) * N_HTMMEVENTS, GFP_KERNEL);
-	}
+	if (!mem_event)
+		return -ENOMEM;
 
 	printk("pebs_init\n");
 
-	for_each_online_cpu (cpu) {
-		for (event = 0; event < N_HTMMEVENTS; event++) {
-			if (get_pebs_event(event) == N_HTMMEVENTS) {
-				mem_event[cpu][event] = NULL;
-				continue;
-			}
+	/* injected samples only go through the rings */
+	htmm_no_pebs = READ_ONCE(htmm_inject_only);
+	use_sample_ring = READ_ONCE(htmm_sample_ring) || htmm_no_pebs;
+	if (use_sample_ring && htmm_sample_rings_init()) {
+		htmm_sample_rings_free();
+		use_sample_ring = false;
+		if (htmm_no_pebs)
+			return -ENOMEM;
+	}
 
-			if (__perf_event_open(get_pebs_event(event), 0, cpu,
-					      event, pid))
-				return -1;
-			if (htmm__perf_event_init(mem_event[cpu][event],
-						  BUFFER_SIZE))
-				return -1;
+	htmm_sampled_pid = pid;
+	for_each_possible_cpu (cpu)
+		memset(per_cpu_ptr(&htmm_heartbeats, cpu), 0,
+		       sizeof(struct htmm_heartbeat));
+	htmm_stlb_events = READ_ONCE(htmm_stlb_sampling);
+	htmm_ldlat_events = READ_ONCE(htmm_bw_balance);
+	htmm_lat_ewma[2] = 0;
+
+	/* no cpu can come or go between the loop and the registration */
+	cpus_read_lock();
+	for_each_online_cpu (cpu) {
+		if (htmm_no_pebs)
+			break;
+		htmm_walk_counters_open(cpu);
+		htmm_ldlat_open(cpu);
+		ret = htmm_open_cpu_events(cpu, pid);
+		if (ret) {
+			cpus_read_unlock();
+			htmm_walk_counters_release();
+			htmm_ldlat_release();
+			htmm_release_events();
+			return ret;
 		}
 	}
 
+	/* keep only as many events as counters scheduled */
+	htmm_rotation_start();
+
+	ret = cpuhp_setup_state_nocalls_cpuslocked(CPUHP_AP_ONLINE_DYN,
+						   "mm/htmm:online",
+						   htmm_cpu_online,
+						   htmm_cpu_offline);
+	cpus_read_unlock();
+	if (ret < 0)
+		pr_warn("htmm: cpus onlined later will not be sampled\n");
+	else
+		htmm_cpuhp_state = ret;
+
 	// ============================================================================
 	// Phase 1: 初始化Event堆
 	// ============================================================================
@@ -329,28 +698,27 @@ static int pebs_init(pid_t pid, int node)
 
 static void pebs_disable(void)
 {
-	int cpu, event;
+	int event;
 	printk("pebs disable\n");
 
 	// ========================================================================
 	// Phase 3.2: 停止周期性Period自适应更新定时器
 	// ========================================================================
 	adaptive_timer_stop();
+	htmm_rotation_stop();
+
+	if (htmm_cpuhp_state > 0) {
+		cpuhp_remove_state_nocalls(htmm_cpuhp_state);
+		htmm_cpuhp_state = 0;
+	}
+	htmm_walk_counters_release();
+	htmm_ldlat_release();
 
 	/* Check if mem_event was initialized */
 	if (!mem_event)
 		return;
 
-	for_each_online_cpu (cpu) {
-		/* Check if this CPU's event array was allocated */
-		if (!mem_event[cpu])
-			continue;
-
-		for (event = 0; event < N_HTMMEVENTS; event++) {
-			if (mem_event[cpu][event])
-				perf_event_disable(mem_event[cpu][event]);
-		}
-	}
+	htmm_release_events();
 
 	// ============================================================================
 	// Phase 3.1: 验证自适应指标计算（销毁堆前）
@@ -395,6 +763,8 @@ static void pebs_enable(void)
 
 	printk("pebs enable\n");
 	for_each_online_cpu (cpu) {
+		if (!mem_event[cpu])
+			continue;
 		for (event = 0; event < N_HTMMEVENTS; event++) {
 			if (mem_event[cpu][event])
 				perf_event_enable(mem_event[cpu][event]);
@@ -406,7 +776,11 @@ static void pebs_update_period(uint64_t value, uint64_t inst_value)
 {
 	int cpu, event;
 
+	mutex_lock(&htmm_pmu_lock);
 	for_each_online_cpu (cpu) {
+		/* restored by htmm_update_sampling_state() */
+		if (!mem_event[cpu] || htmm_cpu_suspended(cpu))
+			continue;
 		for (event = 0; event < N_HTMMEVENTS; event++) {
 			int ret;
 			if (!mem_event[cpu][event])
@@ -440,6 +814,7 @@ static void pebs_update_period(uint64_t value, uint64_t inst_value)
 				printk("failed to update sample period");
 		}
 	}
+	mutex_unlock(&htmm_pmu_lock);
 }
 
 /**
@@ -527,7 +902,9 @@ void update_page_fluctuation(pginfo_t *pinfo, u64 now)
 
 	// 步骤 5.2：mean_n = mean_{n-1} + delta / n
 	// 注意：必须使用 div_s64 进行 64 位有符号除法
-	pinfo->mean_interval += (u64)div_s64(delta, n);
+	// n counts samples; the first one has no interval, so the mean is
+	// taken over n - 1 intervals
+	pinfo->mean_interval += (u64)div_s64(delta, n - 1);
 
 	// 步骤 5.3：delta2 = x - mean_n
 	delta2 = (s64)x_scaled - (s64)pinfo->mean_interval;
@@ -555,6 +932,416 @@ void update_page_fluctuation(pginfo_t *pinfo, u64 now)
   // interval); // 原始间隔（未缩放）
 }
 
+/* samples that lost the race for the mmap lock; retried once per sweep */
+#define HTMM_RETRY_SAMPLES 64
+
+struct htmm_retry_sample {
+	pid_t pid;
+	pid_t tid;
+	enum events e;
+	int nid;
+	u64 addr;
+	u64 time;
+};
+
+static struct htmm_retry_sample retry_samples[HTMM_RETRY_SAMPLES];
+static unsigned int nr_retry_samples;
+
+/* @nid is the node of the cpu that took the sample */
+static void htmm_update_sample(pid_t pid, pid_t tid, u64 addr, enum events e,
+			       u64 time, int nid)
+{
+	struct htmm_retry_sample *rs;
+
+	if (update_pginfo(pid, tid, addr, e, time, nid) != -EAGAIN)
+		return;
+
+	if (nr_retry_samples == HTMM_RETRY_SAMPLES) {
+		count_vm_event(HTMM_SAMPLE_DROPPED);
+		return;
+	}
+
+	rs = &retry_samples[nr_retry_samples++];
+	rs->pid = pid;
+	rs->tid = tid;
+	rs->e = e;
+	rs->nid = nid;
+	rs->addr = addr;
+	rs->time = time;
+	count_vm_event(HTMM_SAMPLE_RETRIED);
+}
+
+static void htmm_retry_deferred_samples(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_retry_samples; i++) {
+		struct htmm_retry_sample *rs = &retry_samples[i];
+
+		if (update_pginfo(rs->pid, rs->tid, rs->addr, rs->e, rs->time,
+				  rs->nid) == -EAGAIN)
+			count_vm_event(HTMM_SAMPLE_DROPPED);
+	}
+	nr_retry_samples = 0;
+}
+
+/*
+ * Bandwidth-aware balancing.
+ * The DRAMREAD and NVMREAD events carry no latency, so a load latency event
+ * samples the loads served by each tier. Once the fast tier saturates, its
+ * latency exceeds
+ * the slow tier's, and promoting more hot pages only makes things worse.
+ * htmm_bw_update() then lowers the share of hot traffic served by the
+ * fast tier: promotion stops while the share is above the target, and
+ * warm pages become demotion victims while it is well above it.
+ */
+#define HTMM_LAT_SHIFT 4 /* EWMA weight 1/16, latencies kept << 4 */
+#define HTMM_BW_STEP 50 /* permil */
+#define HTMM_BW_MARGIN 100 /* permil */
+
+/* 0: fast tier, 1: slow tier, 2: cycles per page walk */
+static unsigned long htmm_lat_ewma[3];
+static unsigned long htmm_lat_samples[2];
+static unsigned int htmm_fast_share_target = 1000; /* permil */
+static bool htmm_bw_no_promotion;
+static bool htmm_bw_reverse;
+
+static void htmm_lat_ewma_add(int idx, u64 val)
+{
+	if (!val)
+		return;
+	if (!htmm_lat_ewma[idx])
+		htmm_lat_ewma[idx] = val << HTMM_LAT_SHIFT;
+	else
+		htmm_lat_ewma[idx] += val -
+			(htmm_lat_ewma[idx] >> HTMM_LAT_SHIFT);
+}
+
+/* the share of hot traffic per tier is counted in samples */
+static void htmm_account_share(int event)
+{
+	if (event == DRAMREAD)
+		htmm_lat_samples[0]++;
+	else if (event == NVMREAD)
+		htmm_lat_samples[1]++;
+}
+
+/* 0: fast tier, 1: slow tier, -1: a cache or an unknown source */
+static int htmm_ldlat_tier(u64 data_src)
+{
+	union perf_mem_data_src src = { .val = data_src };
+
+	if (src.mem_lvl_num == PERF_MEM_LVLNUM_PMEM ||
+	    (src.mem_lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2)))
+		return 1;
+	if (src.mem_lvl & PERF_MEM_LVL_LOC_RAM)
+		return 0;
+	return -1;
+}
+
+static void htmm_ldlat_record(struct htmm_ldlat_stat *st, u64 data_src,
+			      u64 weight)
+{
+	int tier = htmm_ldlat_tier(data_src);
+
+	if (tier < 0 || !weight)
+		return;
+	WRITE_ONCE(st->sum[tier], st->sum[tier] + weight);
+	WRITE_ONCE(st->nr[tier], st->nr[tier] + 1);
+}
+
+/* runs in the PMI of the cpu the event is bound to */
+static void htmm_ldlat_overflow(struct perf_event *event,
+				struct perf_sample_data *data,
+				struct pt_regs *regs)
+{
+	htmm_ldlat_record(this_cpu_ptr(&htmm_ldlat_stats), data->data_src.val,
+			  data->weight.full);
+}
+
+/* Without the event, htmm_tier_latency() keeps the static estimates. A cpu
+ * without it only leaves the latencies less precise.
+ */
+static void htmm_ldlat_open(int cpu)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_RAW,
+		.size = sizeof(struct perf_event_attr),
+		.config = LOAD_LATENCY,
+		.config1 = HTMM_LDLAT_THRESHOLD,
+		.sample_period = HTMM_LDLAT_PERIOD,
+		.sample_type = PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC,
+		.precise_ip = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+	struct perf_event *event;
+
+	if (!htmm_ldlat_events || per_cpu(htmm_ldlat_event, cpu))
+		return;
+	event = perf_event_create_kernel_counter(&attr, cpu, NULL,
+						 htmm_ldlat_overflow, NULL);
+	if (!IS_ERR(event))
+		per_cpu(htmm_ldlat_event, cpu) = event;
+}
+
+static void htmm_ldlat_release(void)
+{
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		if (per_cpu(htmm_ldlat_event, cpu))
+			perf_event_release_kernel(per_cpu(htmm_ldlat_event, cpu));
+		per_cpu(htmm_ldlat_event, cpu) = NULL;
+	}
+}
+
+/* called every HTMM_SUSPEND_CHECK_MS by ksamplingd */
+static void htmm_ldlat_update(void)
+{
+	static u64 prev_sum[2], prev_nr[2];
+	u64 sum[2] = { 0 }, nr[2] = { 0 };
+	int cpu, tier;
+
+	for_each_possible_cpu (cpu) {
+		struct htmm_ldlat_stat *st = per_cpu_ptr(&htmm_ldlat_stats, cpu);
+
+		for (tier = 0; tier < 2; tier++) {
+			sum[tier] += READ_ONCE(st->sum[tier]);
+			nr[tier] += READ_ONCE(st->nr[tier]);
+		}
+	}
+
+	for (tier = 0; tier < 2; tier++) {
+		if (nr[tier] > prev_nr[tier])
+			htmm_lat_ewma_add(tier,
+					  div64_u64(sum[tier] - prev_sum[tier],
+						    nr[tier] - prev_nr[tier]));
+		prev_sum[tier] = sum[tier];
+		prev_nr[tier] = nr[tier];
+	}
+}
+
+/* measured latency of a tier, the static estimate before any sample */
+unsigned long htmm_tier_latency(bool fast)
+{
+	unsigned long lat = READ_ONCE(htmm_lat_ewma[fast ? 0 : 1]);
+
+	if (lat)
+		return max(lat >> HTMM_LAT_SHIFT, 1UL);
+	if (fast)
+		return DRAM_ACCESS_LATENCY;
+	return htmm_cxl_mode ? CXL_ACCESS_LATENCY : NVM_ACCESS_LATENCY;
+}
+
+/* What a page walk adds to a load: the cycles a walk is active for, per
+ * completed walk. The STLB miss samples carry no latency, so it comes from
+ * the walk counters. Before any count, one fast tier access.
+ */
+unsigned long htmm_walk_latency(void)
+{
+	unsigned long lat = READ_ONCE(htmm_lat_ewma[2]) >> HTMM_LAT_SHIFT;
+
+	return lat ? lat : htmm_tier_latency(true);
+}
+
+static struct perf_event *htmm_walk_counter(u64 config, int cpu)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_RAW,
+		.size = sizeof(struct perf_event_attr),
+		.config = config,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+	struct perf_event *event;
+
+	event = perf_event_create_kernel_counter(&attr, cpu, NULL, NULL, NULL);
+	return IS_ERR(event) ? NULL : event;
+}
+
+/* a cpu without the counters only leaves the walk cost less precise */
+static void htmm_walk_counters_open(int cpu)
+{
+	if (!htmm_stlb_events)
+		return;
+	if (!per_cpu(htmm_walk_active, cpu))
+		per_cpu(htmm_walk_active, cpu) =
+			htmm_walk_counter(DTLB_LOAD_WALK_ACTIVE, cpu);
+	if (!per_cpu(htmm_walk_completed, cpu))
+		per_cpu(htmm_walk_completed, cpu) =
+			htmm_walk_counter(DTLB_LOAD_WALK_COMPLETED, cpu);
+}
+
+static void htmm_walk_counters_release(void)
+{
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		if (per_cpu(htmm_walk_active, cpu))
+			perf_event_release_kernel(per_cpu(htmm_walk_active, cpu));
+		if (per_cpu(htmm_walk_completed, cpu))
+			perf_event_release_kernel(
+				per_cpu(htmm_walk_completed, cpu));
+		per_cpu(htmm_walk_active, cpu) = NULL;
+		per_cpu(htmm_walk_completed, cpu) = NULL;
+	}
+}
+
+/* called every HTMM_SUSPEND_CHECK_MS by ksamplingd */
+static void htmm_walk_update(void)
+{
+	static u64 prev_active, prev_completed;
+	u64 active = 0, completed = 0, enabled, running;
+	int cpu;
+
+	if (!htmm_stlb_events)
+		return;
+
+	for_each_possible_cpu (cpu) {
+		struct perf_event *a = per_cpu(htmm_walk_active, cpu);
+		struct perf_event *c = per_cpu(htmm_walk_completed, cpu);
+
+		if (!a || !c)
+			continue;
+		active += perf_event_read_value(a, &enabled, &running);
+		completed += perf_event_read_value(c, &enabled, &running);
+	}
+
+	/* counters of a cpu opened meanwhile restart the sums */
+	if (active > prev_active && completed > prev_completed)
+		htmm_lat_ewma_add(2, div64_u64(active - prev_active,
+					       completed - prev_completed));
+	prev_active = active;
+	prev_completed = completed;
+}
+
+bool htmm_bw_promotion_allowed(void)
+{
+	return !READ_ONCE(htmm_bw_balance) || !READ_ONCE(htmm_bw_no_promotion);
+}
+
+bool htmm_bw_demote_warm(void)
+{
+	return READ_ONCE(htmm_bw_balance) && READ_ONCE(htmm_bw_reverse);
+}
+
+/* called every HTMM_SUSPEND_CHECK_MS by ksamplingd */
+static void htmm_bw_update(void)
+{
+	unsigned long fast = htmm_tier_latency(true);
+	unsigned long slow = htmm_tier_latency(false);
+	unsigned long nr = htmm_lat_samples[0] + htmm_lat_samples[1];
+	unsigned int share;
+
+	if (!READ_ONCE(htmm_bw_balance) || !nr) {
+		htmm_fast_share_target = 1000;
+		WRITE_ONCE(htmm_bw_no_promotion, false);
+		WRITE_ONCE(htmm_bw_reverse, false);
+		goto out;
+	}
+
+	/* move the target towards the split where both latencies match */
+	if (fast * 100 > slow * 105)
+		htmm_fast_share_target -= min_t(unsigned int, HTMM_BW_STEP,
+						htmm_fast_share_target);
+	else if (fast * 100 < slow * 90)
+		htmm_fast_share_target = min(htmm_fast_share_target +
+					     HTMM_BW_STEP, 1000U);
+
+	share = htmm_lat_samples[0] * 1000 / nr;
+	WRITE_ONCE(htmm_bw_no_promotion, share >= htmm_fast_share_target &&
+					 htmm_fast_share_target < 1000);
+	WRITE_ONCE(htmm_bw_reverse,
+		   share > htmm_fast_share_target + HTMM_BW_MARGIN);
+out:
+	htmm_lat_samples[0] = htmm_lat_samples[1] = 0;
+}
+
+/* consumes all records of the ring and releases them at once */
+static unsigned long htmm_drain_sample_ring(int cpu, unsigned long *nr_events)
+{
+	struct htmm_sample_ring *ring = per_cpu_ptr(&htmm_sample_rings, cpu);
+	unsigned long head, tail, nr = 0;
+
+	if (!ring->samples)
+		return 0;
+
+	head = smp_load_acquire(&ring->head);
+	for (tail = ring->tail; tail != head; tail++) {
+		struct htmm_sample *sample =
+			&ring->samples[tail & (HTMM_RING_SIZE - 1)];
+		bool timed = READ_ONCE(htmm_inject_running);
+		u64 now = 0;
+
+		if (!valid_va(sample->addr))
+			continue;
+
+		if (timed) {
+			now = local_clock();
+			htmm_inject_stats.queue_ns += now - sample->time;
+		}
+		htmm_update_sample(sample->pid, sample->tid, sample->addr,
+				   sample->event, sample->time,
+				   cpu_to_node(cpu));
+		if (timed) {
+			htmm_inject_stats.resolve_ns += local_clock() - now;
+			htmm_inject_stats.nr_timed++;
+		}
+		htmm_account_share(sample->event);
+		if (sample->event < N_HTMMEVENTS)
+			nr_events[sample->event]++;
+		nr++;
+	}
+	smp_store_release(&ring->tail, tail);
+	htmm_inject_stats.nr_drained += nr;
+
+	return nr;
+}
+
+/* true if some htmm memcg has pages that could be migrated */
+static bool htmm_sampling_needed(void)
+{
+	struct mem_cgroup *memcg;
+
+	for (memcg = mem_cgroup_iter(NULL, NULL, NULL); memcg;
+	     memcg = mem_cgroup_iter(NULL, memcg, NULL)) {
+		if (memcg->htmm_enabled && htmm_memcg_needs_sampling(memcg)) {
+			mem_cgroup_iter_break(NULL, memcg);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * While every htmm memcg fits in the fast tier with room to spare, the
+ * samples cannot lead to any migration and only cost a page table walk
+ * each. The events are then slowed down to a heartbeat period, and the
+ * periods chosen by the controllers are restored as soon as a memcg gets
+ * slow tier pages or approaches its fast tier limit.
+ */
+static void htmm_update_sampling_state(void)
+{
+	bool suspend = !htmm_sampling_needed();
+	bool changed = false;
+	int cpu;
+
+	/* serialized with the period controllers */
+	mutex_lock(&htmm_pmu_lock);
+	for_each_online_cpu (cpu) {
+		if (!mem_event[cpu] || htmm_cpu_suspended(cpu) == suspend)
+			continue;
+		htmm_set_cpu_periods(cpu, suspend);
+		changed = true;
+	}
+	mutex_unlock(&htmm_pmu_lock);
+
+	if (changed)
+		count_vm_event(suspend ? HTMM_SAMPLING_SUSPENDED :
+					 HTMM_SAMPLING_RESUMED);
+}
+
 static int ksamplingd(void *data)
 {
 	unsigned long long nr_sampled = 0, nr_dram = 0, nr_nvm = 0,
@@ -580,6 +1367,7 @@ static int ksamplingd(void *data)
 
 	/* for analytic purpose */
 	unsigned long hr_dram = 0, hr_nvm = 0;
+	unsigned long next_suspend_check = jiffies;
 
 	/* orig impl: see read_sum_exec_runtime() */
 	trace_runtime = total_runtime = exec_runtime = t->se.sum_exec_runtime;
@@ -595,134 +1383,139 @@ static int ksamplingd(void *data)
 
 	while (!kthread_should_stop()) {
 		int cpu, event, cond = false;
+		int srcu_idx;
 
 		if (htmm_mode == HTMM_NO_MIG) {
 			msleep_interruptible(10000);
 			continue;
 		}
 
+		srcu_idx = srcu_read_lock(&htmm_event_srcu);
 		for_each_online_cpu (cpu) {
+			struct perf_event **events;
+
+			if (use_sample_ring) {
+				unsigned long nr_events[N_HTMMEVENTS] = { 0 };
+
+				nr_sampled += htmm_drain_sample_ring(cpu,
+								     nr_events);
+				nr_dram += nr_events[DRAMREAD];
+				hr_dram += nr_events[DRAMREAD];
+				nr_nvm += nr_events[NVMREAD];
+				hr_nvm += nr_events[NVMREAD];
+				nr_write += nr_events[MEMWRITE];
+				continue;
+			}
+
+			/* onlined, but its events are not opened yet */
+			events = smp_load_acquire(&mem_event[cpu]);
+			if (!events)
+				continue;
+
 			for (event = 0; event < N_HTMMEVENTS; event++) {
 				do {
-					struct perf_buffer *rb;
-					struct perf_event_mmap_page *up;
+					struct perf_buffer_reader reader;
 					struct perf_event_header *ph;
 					struct htmm_event *he;
-					unsigned long pg_index, offset;
-					int page_shift;
-					__u64 head;
+					u64 bounce[HTMM_BOUNCE_SIZE / sizeof(u64)];
+					unsigned long avail;
 
-					if (!mem_event[cpu][event]) {
+					if (!events[event]) {
 						//continue;
 						break;
 					}
 
-					__sync_synchronize();
-
-					rb = mem_event[cpu][event]->rb;
-					if (!rb) {
+					if (!events[event]->rb) {
 						printk("event->rb is NULL\n");
+						srcu_read_unlock(&htmm_event_srcu,
+								 srcu_idx);
 						return -1;
 					}
-					/* perf_buffer is ring buffer */
-					up = READ_ONCE(rb->user_page);
-					head = READ_ONCE(up->data_head);
-					if (head == up->data_tail) {
+
+					avail = perf_buffer_read_begin(
+						&reader, events[event]->rb,
+						bounce, sizeof(bounce));
+					if (!avail) {
 						if (cpu < 16)
 							nr_skip++;
 						//continue;
 						break;
 					}
 
-					head -= up->data_tail;
-					if (head >
-					    (BUFFER_SIZE *
-					     ksampled_max_sample_ratio / 100)) {
+					if (avail > (BUFFER_SIZE *
+						     ksampled_max_sample_ratio / 100)) {
 						cond = true;
-					} else if (head <
+					} else if (avail <
 						   (BUFFER_SIZE *
 						    ksampled_min_sample_ratio /
 						    100)) {
 						cond = false;
 					}
 
-					/* read barrier */
-					smp_rmb();
-
-					page_shift =
-						PAGE_SHIFT + page_order(rb);
-					/* get address of a tail sample */
-					offset = READ_ONCE(up->data_tail);
-					pg_index = (offset >> page_shift) &
-						   (rb->nr_pages - 1);
-					offset &= (1 << page_shift) - 1;
-
-					ph = (void *)(rb->data_pages[pg_index] +
-						      offset);
-					switch (ph->type) {
-					case PERF_RECORD_SAMPLE:
-						he = (struct htmm_event *)ph;
-
-						// ============================================================
-						// 🆕 新增：使用 trace_printk 记录 PEBS 采样
-						// Event 编号含义：
-						//   0=L1_HIT, 1=L1_MISS, 2=L2_HIT, 3=L2_MISS,
-						//   4=L3_HIT, 5=L3_MISS, 6=DRAMREAD, 7=NVMREAD, 8=MEMWRITE
-						// ============================================================
-
-						if (!valid_va(he->addr)) {
+					while ((ph = perf_buffer_read_next(&reader))) {
+						switch (ph->type) {
+						case PERF_RECORD_SAMPLE:
+							he = (struct htmm_event *)ph;
+							//   0=L1_HIT, 1=L1_MISS, 2=L2_HIT, 3=L2_MISS,
+							//   4=L3_HIT, 5=L3_MISS, 6=DRAMREAD, 7=NVMREAD, 8=MEMWRITE,
+							//   9=STLB_MISS_LOAD, 10=STLB_MISS_STORE
+							if (!valid_va(he->addr))
+								break;
+
+							htmm_update_sample(he->pid, he->tid,
+									   he->addr, event,
+									   he->time,
+									   cpu_to_node(cpu));
+							htmm_account_share(event);
+							nr_sampled++;
+
+							if (event == DRAMREAD) {
+								nr_dram++;
+								hr_dram++;
+							} else if (event == NVMREAD) {
+								nr_nvm++;
+								hr_nvm++;
+							} else if (event == MEMWRITE) {
+								nr_write++;
+							}
+							break;
+						case PERF_RECORD_THROTTLE:
+						case PERF_RECORD_UNTHROTTLE:
+							nr_throttled++;
+							break;
+						case PERF_RECORD_LOST_SAMPLES:
+							nr_lost++;
+							break;
+						default:
+							nr_unknown++;
 							break;
 						}
-      // trace_printk(
-       // "[PEBS] CPU=%d Event=%d PID=%u TID=%u Addr=0x%llx IP=0x%llx Time=%llu\n",
-       // cpu, event, he->pid,
-       // he->tid, he->addr,
-       // he->ip, he->time);
-						update_pginfo(he->pid, he->addr,
-							      event, he->time);
-						//count_vm_event(HTMM_NR_SAMPLED);
-						nr_sampled++;
-
-						// 暂时保持 DRAM/NVM 统计，L1/L2/L3 只计入 nr_sampled
-						if (event == DRAMREAD) {
-							nr_dram++;
-							hr_dram++;
-						} else if (event == NVMREAD) {
-							nr_nvm++;
-							hr_nvm++;
-						} else if (event == MEMWRITE) {
-							nr_write++;
-						}
-						// L1/L2/L3 事件暂不单独统计
-						break;
-					case PERF_RECORD_THROTTLE:
-					case PERF_RECORD_UNTHROTTLE:
-						nr_throttled++;
-						break;
-					case PERF_RECORD_LOST_SAMPLES:
-						nr_lost++;
-						break;
-					default:
-						nr_unknown++;
-						break;
 					}
+					nr_lost += reader.nr_skipped;
+					/* releases the whole batch at once */
+					perf_buffer_read_end(&reader);
+
 					if (nr_sampled % 500000 == 0) {
-      // trace_printk(
-       // "nr_sampled: %llu, nr_dram: %llu, nr_nvm: %llu, nr_write: %llu, nr_throttled: %llu \n",
-       // nr_sampled, nr_dram,
-       // nr_nvm, nr_write,
-       // nr_throttled);
 						nr_dram = 0;
 						nr_nvm = 0;
 						nr_write = 0;
 					}
-					/* read, write barrier */
-					smp_mb();
-					WRITE_ONCE(up->data_tail,
-						   up->data_tail + ph->size);
 				} while (cond);
 			}
 		}
+		srcu_read_unlock(&htmm_event_srcu, srcu_idx);
+		/* the other tasks had a whole sweep to release their mmap lock */
+		htmm_retry_deferred_samples();
+
+		if (time_after_eq(jiffies, next_suspend_check)) {
+			htmm_update_sampling_state();
+			htmm_ldlat_update();
+			htmm_bw_update();
+			htmm_walk_update();
+			next_suspend_check = jiffies +
+				msecs_to_jiffies(HTMM_SUSPEND_CHECK_MS);
+		}
+
 		/* if ksampled_soft_cpu_quota is zero, disable dynamic pebs feature */
 		if (!ksampled_soft_cpu_quota)
 			continue;
@@ -979,7 +1772,8 @@ static enum event_type get_event_type_from_id(int event_id)
 	case 8:
 		return EVENT_MEM_WRITE;
 	default:
-		return EVENT_L1_HIT; // Fallback
+		/* the STLB events keep their period, see htmm_rotation_weight() */
+		return EVENT_TYPE_MAX;
 	}
 }
 
@@ -995,7 +1789,8 @@ static void heap_update_or_insert(struct event_heap *heap, pginfo_t *pinfo)
 	idx = heap_find(heap, pinfo);
 	if (idx >= 0) {
 		heap->entries[idx].event_hit_count++;
-		heap_sift_up(heap, idx); // 重新排序
+		/* a larger key moves away from the root of the min-heap */
+		heap_sift_down(heap, idx);
   // trace_printk("[Heap-Update] pinfo=%p new_hit=%u\n", pinfo,
         // heap->entries[idx].event_hit_count);
 		spin_unlock_irqrestore(&heap->lock, flags);
@@ -1387,23 +2182,28 @@ static u64 get_current_period(enum event_type type)
 	int event_idx;
 	u64 period = 0;
 
+	mutex_lock(&htmm_pmu_lock);
 	// 遍历所有CPU，找到第一个匹配的Event
 	for_each_online_cpu (cpu) {
-		if (!mem_event || !mem_event[cpu])
+		/* a cpu in heartbeat sampling has no adaptive period */
+		if (!mem_event || !mem_event[cpu] || htmm_cpu_suspended(cpu))
 			continue;
 
 		for (event_idx = 0; event_idx < N_HTMMEVENTS; event_idx++) {
+			if (get_event_type_from_id(event_idx) == EVENT_TYPE_MAX)
+				continue;
 			if (get_event_type_from_id(event_idx) == type) {
 				struct perf_event *event =
 					mem_event[cpu][event_idx];
 				if (event) {
 					period = event->attr.sample_period;
-					return period; // 返回第一个找到的
+					goto out; // 返回第一个找到的
 				}
 			}
 		}
 	}
-
+out:
+	mutex_unlock(&htmm_pmu_lock);
 	return period;
 }
 
@@ -1419,12 +2219,16 @@ static void update_pebs_event_period(enum event_type type, u64 new_period)
 {
 	int cpu, event_idx;
 
+	mutex_lock(&htmm_pmu_lock);
 	// 遍历所有CPU
 	for_each_online_cpu (cpu) {
-		if (!mem_event || !mem_event[cpu])
+		/* left alone during heartbeat sampling */
+		if (!mem_event || !mem_event[cpu] || htmm_cpu_suspended(cpu))
 			continue;
 
 		for (event_idx = 0; event_idx < N_HTMMEVENTS; event_idx++) {
+			if (get_event_type_from_id(event_idx) == EVENT_TYPE_MAX)
+				continue;
 			if (get_event_type_from_id(event_idx) == type) {
 				struct perf_event *event =
 					mem_event[cpu][event_idx];
@@ -1437,11 +2241,14 @@ static void update_pebs_event_period(enum event_type type, u64 new_period)
 					local64_set(&event->hw.period_left,
 						    new_period);
 
-					perf_event_enable(event);
+					/* rotated out events stay off */
+					if (htmm_event_is_active(event_idx))
+						perf_event_enable(event);
 				}
 			}
 		}
 	}
+	mutex_unlock(&htmm_pmu_lock);
 }
 
 
@@ -1471,6 +2278,7 @@ void adaptive_update_work_handler(struct work_struct *work)
 	for (type = 0; type < EVENT_TYPE_MAX; type++) {
 		struct adaptive_metrics *metrics = &global_adaptive_metrics[type];
 		u64 current_score, target_period, current_period, new_period;
+		int bpf_period;
 
 		// 1. 读取当前分数
 		current_score = metrics->V_normalized;
@@ -1485,6 +2293,7 @@ void adaptive_update_work_handler(struct work_struct *work)
 		target_period = map_score_to_period((u32)current_score);
 
 		// 3. 读取当前Period
+		/* 0 also while every cpu is in heartbeat sampling */
 		current_period = get_current_period(type);
 		if (current_period == 0) {
    // trace_printk(
@@ -1496,6 +2305,12 @@ void adaptive_update_work_handler(struct work_struct *work)
 		// 4. EMA平滑调整
 		new_period = apply_ema_to_period(current_period, target_period);
 
+		// 4.1 a BPF policy may override the period
+		bpf_period = htmm_bpf_event_period(type, (u32)current_score,
+						   new_period);
+		if (bpf_period > 0)
+			new_period = bpf_period;
+
 		// 5. 更新硬件Period
 		update_pebs_event_period(type, new_period);
 // 
@@ -1548,6 +2363,401 @@ static void adaptive_timer_stop(void)
  // trace_printk("[Adaptive-Timer] Timer stopped successfully\n");
 }
 
+// ============================================================================
+// PMU budget: rotate the events over the available counters
+// ============================================================================
+
+/*
+ * Opening every event on every cpu oversubscribes the general-purpose
+ * counters, and perf then multiplexes them on each tick regardless of
+ * their value. Instead only htmm_pmu_counters events are enabled at a time.
+ * Each rotation window hands the counters to the events with the most
+ * credit, and credit grows with V_normalized, so an event gets a share of
+ * the windows proportional to its score (smooth weighted round robin).
+ */
+#define HTMM_ROTATION_MIN_WEIGHT (ADAPTIVE_SCALE / 20) // floor: 5%
+#define HTMM_ROTATION_MIN_WINDOW_MS 100
+
+static DECLARE_BITMAP(htmm_active_events, N_HTMMEVENTS);
+static s64 htmm_rotation_credit[N_HTMMEVENTS];
+static bool htmm_rotation_running;
+
+static void htmm_rotation_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(htmm_rotation_work, htmm_rotation_work_fn);
+
+static bool htmm_event_is_active(int event)
+{
+	return test_bit(event, htmm_active_events);
+}
+
+/* counters held by the events that are not rotated */
+static unsigned int htmm_reserved_counters(void)
+{
+	/* the load latency event, the two page walk counters */
+	return (htmm_ldlat_events ? 1 : 0) + (htmm_stlb_events ? 2 : 0);
+}
+
+static s64 htmm_rotation_weight(int event)
+{
+	enum event_type type = get_event_type_from_id(event);
+
+	/* the adaptive metrics only cover the access events */
+	if (type == EVENT_TYPE_MAX)
+		return HTMM_ROTATION_MIN_WEIGHT;
+
+	return max_t(s64, global_adaptive_metrics[type].V_normalized,
+		     HTMM_ROTATION_MIN_WEIGHT);
+}
+
+/* must hold htmm_pmu_lock */
+static void htmm_set_active_events(unsigned long *next)
+{
+	int cpu, event;
+
+	if (!mem_event)
+		return;
+
+	for_each_online_cpu (cpu) {
+		if (!mem_event[cpu])
+			continue;
+
+		for (event = 0; event < N_HTMMEVENTS; event++) {
+			struct perf_event *pe = mem_event[cpu][event];
+			bool on = test_bit(event, next);
+
+			if (!pe || on == htmm_event_is_active(event))
+				continue;
+			if (on)
+				perf_event_enable(pe);
+			else
+				perf_event_disable(pe);
+		}
+	}
+	bitmap_copy(htmm_active_events, next, N_HTMMEVENTS);
+}
+
+static void htmm_rotate_events(void)
+{
+	DECLARE_BITMAP(next, N_HTMMEVENTS);
+	unsigned int nr_counters = READ_ONCE(htmm_pmu_counters);
+	s64 total = 0;
+	int event, nr_valid = 0, i;
+
+	bitmap_zero(next, N_HTMMEVENTS);
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		if (get_pebs_event(event) == N_HTMMEVENTS)
+			continue;
+		__set_bit(event, next);
+		nr_valid++;
+		total += htmm_rotation_weight(event);
+	}
+
+	/* 0 lets perf multiplex; otherwise at least one event runs */
+	if (nr_counters > htmm_reserved_counters())
+		nr_counters -= htmm_reserved_counters();
+	else if (nr_counters)
+		nr_counters = 1;
+
+	/* enough counters: nothing to rotate */
+	if (!nr_counters || nr_counters >= nr_valid)
+		goto apply;
+
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		if (!test_bit(event, next))
+			continue;
+		htmm_rotation_credit[event] +=
+			htmm_rotation_weight(event) * nr_counters;
+		/* an event cannot bank more than one window ahead */
+		htmm_rotation_credit[event] =
+			min(htmm_rotation_credit[event], total);
+	}
+
+	bitmap_zero(next, N_HTMMEVENTS);
+	for (i = 0; i < nr_counters; i++) {
+		int best = -1;
+
+		for (event = 0; event < N_HTMMEVENTS; event++) {
+			if (get_pebs_event(event) == N_HTMMEVENTS ||
+			    test_bit(event, next))
+				continue;
+			if (best < 0 || htmm_rotation_credit[event] >
+						htmm_rotation_credit[best])
+				best = event;
+		}
+		__set_bit(best, next);
+		htmm_rotation_credit[best] -= total;
+	}
+
+apply:
+	mutex_lock(&htmm_pmu_lock);
+	htmm_set_active_events(next);
+	mutex_unlock(&htmm_pmu_lock);
+}
+
+static void htmm_rotation_work_fn(struct work_struct *work)
+{
+	htmm_rotate_events();
+
+	if (READ_ONCE(htmm_rotation_running))
+		schedule_delayed_work(&htmm_rotation_work,
+			msecs_to_jiffies(max_t(unsigned int,
+					       READ_ONCE(htmm_rotation_window),
+					       HTMM_ROTATION_MIN_WINDOW_MS)));
+}
+
+/* the events are opened enabled */
+static void htmm_rotation_start(void)
+{
+	int event;
+
+	bitmap_zero(htmm_active_events, N_HTMMEVENTS);
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		htmm_rotation_credit[event] = 0;
+		if (get_pebs_event(event) != N_HTMMEVENTS)
+			__set_bit(event, htmm_active_events);
+	}
+
+	WRITE_ONCE(htmm_rotation_running, true);
+	htmm_rotation_work_fn(NULL);
+}
+
+static void htmm_rotation_stop(void)
+{
+	WRITE_ONCE(htmm_rotation_running, false);
+	cancel_delayed_work_sync(&htmm_rotation_work);
+}
+
+/*
+ * Sample injector: one kthread per online cpu pushes synthetic records
+ * into the cpu's ring at htmm_inject_rate records per second, so that the
+ * throughput of ksamplingd and of the accounting paths can be measured
+ * without PEBS. With inject_only set before htmm_start no event is opened
+ * at all. The injector is the single producer of a ring: it refuses to run
+ * while the cpus have events of their own.
+ */
+#define HTMM_INJECT_TICK_US 1000
+
+static DEFINE_MUTEX(htmm_inject_lock);
+static struct task_struct **htmm_inject_threads;
+static atomic64_t htmm_nr_injected;
+
+static u32 htmm_inject_pid; /* 0: the pid given to htmm_start */
+static u64 htmm_inject_rate = 100000; /* per cpu */
+static u64 htmm_inject_base = 0x7f0000000000ULL;
+static u64 htmm_inject_span = 1ULL << 30;
+static u64 htmm_inject_hot_span = 1ULL << 26;
+static u32 htmm_inject_hot_permil; /* share sent to the hot span */
+static u32 htmm_inject_mix[N_HTMMEVENTS] = {
+	[DRAMREAD] = 1,
+	[NVMREAD] = 1,
+};
+
+static u64 htmm_inject_addr(void)
+{
+	u64 span = READ_ONCE(htmm_inject_span), offset;
+
+	if (prandom_u32_max(1000) < READ_ONCE(htmm_inject_hot_permil))
+		span = min(span, READ_ONCE(htmm_inject_hot_span));
+	if (!span)
+		return READ_ONCE(htmm_inject_base);
+	div64_u64_rem((u64)prandom_u32() << 32 | prandom_u32(), span, &offset);
+	return READ_ONCE(htmm_inject_base) + offset;
+}
+
+static int htmm_inject_event(void)
+{
+	u32 total = 0, pick;
+	int event;
+
+	for (event = 0; event < N_HTMMEVENTS; event++)
+		total += READ_ONCE(htmm_inject_mix[event]);
+	if (!total)
+		return DRAMREAD;
+
+	pick = prandom_u32_max(total);
+	for (event = 0; event < N_HTMMEVENTS; event++) {
+		u32 weight = READ_ONCE(htmm_inject_mix[event]);
+
+		if (pick < weight)
+			break;
+		pick -= weight;
+	}
+	return event;
+}
+
+static int htmm_inject_fn(void *data)
+{
+	struct htmm_sample_ring *ring =
+		per_cpu_ptr(&htmm_sample_rings, (long)data);
+	u64 start = local_clock(), nr = 0;
+
+	while (!kthread_should_stop()) {
+		pid_t pid = READ_ONCE(htmm_inject_pid) ? : htmm_sampled_pid;
+		u64 target = mul_u64_u64_div_u64(local_clock() - start,
+						 READ_ONCE(htmm_inject_rate),
+						 NSEC_PER_SEC);
+
+		/* do not catch up on more than a ring after a stall */
+		if (target - nr > HTMM_RING_SIZE)
+			nr = target - HTMM_RING_SIZE;
+		for (; nr < target; nr++) {
+			if (htmm_ring_push(ring, htmm_inject_addr(), pid, pid,
+					   htmm_inject_event()))
+				atomic64_inc(&htmm_nr_injected);
+		}
+		usleep_range(HTMM_INJECT_TICK_US, HTMM_INJECT_TICK_US + 100);
+	}
+	return 0;
+}
+
+/* must hold htmm_inject_lock */
+static void htmm_inject_stop(void)
+{
+	int cpu;
+
+	if (!htmm_inject_threads)
+		return;
+
+	for_each_possible_cpu (cpu) {
+		if (htmm_inject_threads[cpu])
+			kthread_stop(htmm_inject_threads[cpu]);
+	}
+	kfree(htmm_inject_threads);
+	htmm_inject_threads = NULL;
+	WRITE_ONCE(htmm_inject_running, false);
+}
+
+/* must hold htmm_inject_lock */
+static int htmm_inject_start(void)
+{
+	int cpu;
+
+	if (htmm_inject_threads)
+		return 0;
+	if (!access_sampling || !use_sample_ring)
+		return -ENODEV;
+
+	cpus_read_lock();
+	for_each_online_cpu (cpu) {
+		if (mem_event[cpu]) {
+			cpus_read_unlock();
+			return -EBUSY;
+		}
+	}
+
+	htmm_inject_threads = kcalloc(nr_cpu_ids, sizeof(struct task_struct *),
+				      GFP_KERNEL);
+	if (!htmm_inject_threads) {
+		cpus_read_unlock();
+		return -ENOMEM;
+	}
+
+	memset(&htmm_inject_stats, 0, sizeof(htmm_inject_stats));
+	htmm_inject_stats.start = local_clock();
+	atomic64_set(&htmm_nr_injected, 0);
+	for_each_online_cpu (cpu) {
+		struct htmm_sample_ring *ring =
+			per_cpu_ptr(&htmm_sample_rings, cpu);
+		struct task_struct *t;
+
+		ring->nr_dropped = 0;
+		t = kthread_create_on_cpu(htmm_inject_fn, (void *)(long)cpu,
+					  cpu, "khtmm_inject/%u");
+		if (IS_ERR(t))
+			continue;
+		htmm_inject_threads[cpu] = t;
+		wake_up_process(t);
+	}
+	cpus_read_unlock();
+
+	WRITE_ONCE(htmm_inject_running, true);
+	return 0;
+}
+
+static int htmm_inject_enable_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(htmm_inject_running);
+	return 0;
+}
+
+static int htmm_inject_enable_set(void *data, u64 val)
+{
+	int ret = 0;
+
+	mutex_lock(&htmm_inject_lock);
+	if (val)
+		ret = htmm_inject_start();
+	else
+		htmm_inject_stop();
+	mutex_unlock(&htmm_inject_lock);
+	return ret;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(htmm_inject_enable_fops, htmm_inject_enable_get,
+			 htmm_inject_enable_set, "%llu\n");
+
+static int htmm_inject_stats_show(struct seq_file *m, void *v)
+{
+	u64 elapsed = local_clock() - htmm_inject_stats.start;
+	u64 nr_timed = max(htmm_inject_stats.nr_timed, 1ULL);
+	unsigned long nr_dropped = 0;
+	int cpu;
+
+	for_each_possible_cpu (cpu)
+		nr_dropped += per_cpu_ptr(&htmm_sample_rings, cpu)->nr_dropped;
+
+	seq_printf(m, "injected %lld\n", atomic64_read(&htmm_nr_injected));
+	seq_printf(m, "processed %llu\n", htmm_inject_stats.nr_drained);
+	seq_printf(m, "dropped %lu\n", nr_dropped);
+	seq_printf(m, "elapsed_ms %llu\n", div_u64(elapsed, NSEC_PER_MSEC));
+	seq_printf(m, "processed_per_sec %llu\n",
+		   mul_u64_u64_div_u64(htmm_inject_stats.nr_drained,
+				       NSEC_PER_SEC, max(elapsed, 1ULL)));
+	seq_printf(m, "queue_ns_avg %llu\n",
+		   div64_u64(htmm_inject_stats.queue_ns, nr_timed));
+	seq_printf(m, "resolve_ns_avg %llu\n",
+		   div64_u64(htmm_inject_stats.resolve_ns, nr_timed));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(htmm_inject_stats);
+
+static const char *const htmm_event_names[] = {
+	"l1_hit", "l1_miss", "l2_hit", "l2_miss", "l3_hit", "l3_miss",
+	"dramread", "nvmread", "memwrite", "stlb_miss_load", "stlb_miss_store",
+};
+
+/* also holds the files of htmm_migrater.c, created at late_initcall_sync */
+struct dentry *htmm_debugfs_root;
+
+static int __init htmm_debugfs_init(void)
+{
+	struct dentry *inject, *mix;
+	int event;
+
+	BUILD_BUG_ON(ARRAY_SIZE(htmm_event_names) != N_HTMMEVENTS);
+
+	htmm_debugfs_root = debugfs_create_dir("htmm", NULL);
+	inject = debugfs_create_dir("inject", htmm_debugfs_root);
+	debugfs_create_bool("only", 0600, inject, &htmm_inject_only);
+	debugfs_create_file_unsafe("enable", 0600, inject, NULL,
+				   &htmm_inject_enable_fops);
+	debugfs_create_u32("pid", 0600, inject, &htmm_inject_pid);
+	debugfs_create_u64("rate", 0600, inject, &htmm_inject_rate);
+	debugfs_create_x64("base", 0600, inject, &htmm_inject_base);
+	debugfs_create_x64("span", 0600, inject, &htmm_inject_span);
+	debugfs_create_x64("hot_span", 0600, inject, &htmm_inject_hot_span);
+	debugfs_create_u32("hot_permil", 0600, inject,
+			   &htmm_inject_hot_permil);
+	debugfs_create_file("stats", 0400, inject, NULL,
+			    &htmm_inject_stats_fops);
+
+	mix = debugfs_create_dir("mix", inject);
+	for (event = 0; event < N_HTMMEVENTS; event++)
+		debugfs_create_u32(htmm_event_names[event], 0600, mix,
+				   &htmm_inject_mix[event]);
+	return 0;
+}
+late_initcall(htmm_debugfs_init);
+
 int ksamplingd_init(pid_t pid, int node)
 {
 	int ret;
@@ -1566,9 +2776,17 @@ int ksamplingd_init(pid_t pid, int node)
 
 void ksamplingd_exit(void)
 {
+	mutex_lock(&htmm_inject_lock);
+	htmm_inject_stop();
+	mutex_unlock(&htmm_inject_lock);
+
 	if (access_sampling) {
 		kthread_stop(access_sampling);
 		access_sampling = NULL;
 	}
 	pebs_disable();
+	if (use_sample_ring)
+		htmm_sample_rings_free();
 }
+
+#include "htmm-test.h"
@@ -2159,6 +2159,8 @@ static void __split_huge_pmd_locked(struct vm_area_struct *vma, pmd_t *pmd,
 
 		spin_lock(&memcg->access_lock);
 		memcg->hotness_hg[get_idx(pte_pginfo->total_accesses)]++;
+		htmm_node_hg_add(memcg, page_to_nid(page),
+				 get_idx(pte_pginfo->total_accesses), 1);
 		spin_unlock(&memcg->access_lock);
 		/* Htmm flag will be cleared later */
 		/* ClearPageHtmm(&page[i]); */
@@ -2839,6 +2841,7 @@ int split_huge_page_to_list(struct page *page, struct list_head *list)
 			memcg->hotness_hg[idx] = 0;
 		    else
 			memcg->hotness_hg[idx] -= HPAGE_PMD_NR;
+		    htmm_node_hg_sub(memcg, page_to_nid(head), idx, HPAGE_PMD_NR);
 
 		    spin_unlock(&memcg->access_lock);
 		}
@@ -41,6 +41,9 @@
 #include <linux/hugetlb_cgroup.h>
 #include <linux/node.h>
 #include <linux/page_owner.h>
+#ifdef CONFIG_HTMM
+#include <linux/htmm.h>
+#endif
 #include "internal.h"
 #include "hugetlb_vmemmap.h"
 
@@ -1589,6 +1592,9 @@ void free_huge_page(struct page *page)
 
 	hugetlb_set_page_subpool(page, NULL);
 	page->mapping = NULL;
+#ifdef CONFIG_HTMM
+	htmm_hugetlb_free(page);
+#endif
 	restore_reserve = HPageRestoreReserve(page);
 	ClearHPageRestoreReserve(page);
 
@@ -6298,6 +6304,9 @@ void move_hugetlb_state(struct page *oldpage, struct page *newpage, int reason)
 
 	hugetlb_cgroup_migrate(oldpage, newpage);
 	set_page_owner_migrate_reason(newpage, reason);
+#ifdef CONFIG_HTMM
+	htmm_hugetlb_migrate(oldpage, newpage);
+#endif
 
 	/*
 	 * transfer temporary state of the new huge page. This is
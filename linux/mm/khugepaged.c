@@ -1268,6 +1268,7 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 	bool writable = false;
 #ifdef CONFIG_HTMM
 	pginfo_t *pginfo;
+	bool walked = false;
 #endif
 
 	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
@@ -1280,6 +1281,11 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 
 	memset(khugepaged_node_load, 0, sizeof(khugepaged_node_load));
 	pte = pte_offset_map_lock(mm, pmd, address, &ptl);
+#ifdef CONFIG_HTMM
+	/* a region with frequent page walks gains from a huge page anyway */
+	if (mm->htmm_enabled)
+		walked = htmm_region_walk_heavy(pte);
+#endif
 	for (_address = address, _pte = pte; _pte < pte+HPAGE_PMD_NR;
 	     _pte++, _address += PAGE_SIZE) {
 		pte_t pteval = *_pte;
@@ -1330,7 +1336,7 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 		    if (!pginfo)
 			goto out_unmap;
 		    
-		    if (!pginfo->may_hot)
+		    if (!pginfo->may_hot && !walked)
 			goto out_unmap;
 		}
 #endif
@@ -1561,7 +1567,11 @@ void collapse_pte_mapped_thp(struct mm_struct *mm, unsigned long addr)
 	_pmd = pmdp_collapse_flush(vma, haddr, pmd);
 	spin_unlock(ptl);
 	mm_dec_nr_ptes(mm);
+#ifdef CONFIG_HTMM
+	htmm_pte_free(mm, pmd_pgtable(_pmd));
+#else
 	pte_free(mm, pmd_pgtable(_pmd));
+#endif
 
 drop_hpage:
 	unlock_page(hpage);
@@ -1645,7 +1655,11 @@ static void retract_page_tables(struct address_space *mapping, pgoff_t pgoff)
 				_pmd = pmdp_collapse_flush(vma, addr, pmd);
 				spin_unlock(ptl);
 				mm_dec_nr_ptes(mm);
+#ifdef CONFIG_HTMM
+				htmm_pte_free(mm, pmd_pgtable(_pmd));
+#else
 				pte_free(mm, pmd_pgtable(_pmd));
+#endif
 			}
 			mmap_write_unlock(mm);
 		} else {
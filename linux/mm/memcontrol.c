@@ -734,6 +734,25 @@ void __mod_memcg_lruvec_state(struct lruvec *lruvec, enum node_stat_item idx,
 
 	/* Update lruvec */
 	__this_cpu_add(pn->lruvec_stats_percpu->state[idx], val);
+#ifdef CONFIG_HTMM
+	/* the rstat copies above lag, htmm needs the residency as it is */
+	switch (idx) {
+	case NR_ANON_MAPPED:
+		percpu_counter_add_batch(&pn->nr_resident[HTMM_RES_ANON], val,
+					 MEMCG_CHARGE_BATCH);
+		break;
+	case NR_ANON_THPS:
+		percpu_counter_add_batch(&pn->nr_resident[HTMM_RES_ANON_THP],
+					 val, MEMCG_CHARGE_BATCH);
+		break;
+	case NR_FILE_PAGES:
+		percpu_counter_add_batch(&pn->nr_resident[HTMM_RES_FILE], val,
+					 MEMCG_CHARGE_BATCH);
+		break;
+	default:
+		break;
+	}
+#endif
 
 	memcg_rstat_updated(memcg, val);
 }
@@ -5138,10 +5157,28 @@ static int alloc_mem_cgroup_per_node_info(struct mem_cgroup *memcg, int node)
 	INIT_LIST_HEAD(&pn->deferred_split_queue.split_queue);
 	INIT_LIST_HEAD(&pn->deferred_list);
 	pn->deferred_split_queue.split_queue_len = 0;
+	spin_lock_init(&pn->hugetlb_lock);
+	INIT_LIST_HEAD(&pn->hugetlb_list);
+	spin_lock_init(&pn->busy_lock);
+	INIT_LIST_HEAD(&pn->busy_list);
+	pn->busy_nr = 0;
+	pn->busy_backoff = 0;
+	for (tmp = 0; tmp < NR_HTMM_RES; tmp++) {
+		if (percpu_counter_init(&pn->nr_resident[tmp], 0, GFP_KERNEL))
+			goto free_resident;
+	}
 #endif
 
 	memcg->nodeinfo[node] = pn;
 	return 0;
+#ifdef CONFIG_HTMM
+free_resident:
+	while (--tmp >= 0)
+		percpu_counter_destroy(&pn->nr_resident[tmp]);
+	free_percpu(pn->lruvec_stats_percpu);
+	kfree(pn);
+	return 1;
+#endif
 }
 
 static void free_mem_cgroup_per_node_info(struct mem_cgroup *memcg, int node)
@@ -5151,6 +5188,14 @@ static void free_mem_cgroup_per_node_info(struct mem_cgroup *memcg, int node)
 	if (!pn)
 		return;
 
+#ifdef CONFIG_HTMM
+	{
+		int i;
+
+		for (i = 0; i < NR_HTMM_RES; i++)
+			percpu_counter_destroy(&pn->nr_resident[i]);
+	}
+#endif
 	free_percpu(pn->lruvec_stats_percpu);
 	kfree(pn);
 }
@@ -5243,6 +5288,8 @@ static struct mem_cgroup *mem_cgroup_alloc(void)
 	memcg->max_dram_sampled = 0;
 	memcg->prev_max_dram_sampled = 0;
 	memcg->nr_max_sampled = 0;
+	memcg->nr_walk_sampled = 0;
+	memcg->walk_permil = 0;
 	/* thresholds */
 	memcg->active_threshold = htmm_thres_hot;
 	memcg->warm_threshold = htmm_thres_hot;
@@ -5261,7 +5308,13 @@ static struct mem_cgroup *mem_cgroup_alloc(void)
 	for (i = 0; i < 16; i++) {
 	    memcg->hotness_hg[i] = 0;
 	    memcg->ebp_hotness_hg[i] = 0;
+	    memcg->htmm_mrc_pages[i] = 0;
+	    memcg->htmm_mrc_hit[i] = 0;
+	    memcg->hotness_snap[i] = 0;
+	    memcg->ebp_hotness_snap[i] = 0;
 	}
+	memcg->nr_cooling_nodes = 0;
+	memcg->cooling_start = 0;
 
 	spin_lock_init(&memcg->access_lock);
 	memcg->cooled = false;
@@ -5269,6 +5322,13 @@ static struct mem_cgroup *mem_cgroup_alloc(void)
 	memcg->need_split = false;
 	memcg->cooling_clock = 0;
 	memcg->nr_alloc = 0;
+	for (i = 0; i < NR_HTMM_WORK; i++)
+	    atomic64_set(&memcg->htmm_work_ns[i], 0);
+	atomic64_set(&memcg->htmm_migrate_bytes, 0);
+	atomic64_set(&memcg->htmm_nr_throttled, 0);
+	memcg->htmm_cpu_budget = U64_MAX;
+	memcg->htmm_budget_start = 0;
+	atomic64_set(&memcg->htmm_budget_used, 0);
 #endif
 	idr_replace(&mem_cgroup_idr, memcg, memcg->id.id);
 	return memcg;
@@ -7722,6 +7782,249 @@ static int __init mem_cgroup_hotness_stat_init(void)
 }
 subsys_initcall(mem_cgroup_hotness_stat_init);
 
+static int memcg_htmm_cpu_stat_show(struct seq_file *m, void *v)
+{
+    struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
+
+    seq_printf(m, "sample_usec %llu\n",
+	    div_u64(atomic64_read(&memcg->htmm_work_ns[HTMM_WORK_SAMPLE]),
+		NSEC_PER_USEC));
+    seq_printf(m, "migrate_usec %llu\n",
+	    div_u64(atomic64_read(&memcg->htmm_work_ns[HTMM_WORK_MIGRATE]),
+		NSEC_PER_USEC));
+    seq_printf(m, "cooling_usec %llu\n",
+	    div_u64(atomic64_read(&memcg->htmm_work_ns[HTMM_WORK_COOLING]),
+		NSEC_PER_USEC));
+    seq_printf(m, "migrate_bytes %llu\n",
+	    (u64)atomic64_read(&memcg->htmm_migrate_bytes));
+    seq_printf(m, "nr_throttled %llu\n",
+	    (u64)atomic64_read(&memcg->htmm_nr_throttled));
+
+    return 0;
+}
+
+/* usec of htmm work per second of wall time, or "max" */
+static int memcg_htmm_cpu_budget_show(struct seq_file *m, void *v)
+{
+    struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
+    u64 budget = READ_ONCE(memcg->htmm_cpu_budget);
+
+    if (budget == U64_MAX)
+	seq_puts(m, "max\n");
+    else
+	seq_printf(m, "%llu\n", div_u64(budget, NSEC_PER_USEC));
+
+    return 0;
+}
+
+static ssize_t memcg_htmm_cpu_budget_write(struct kernfs_open_file *of,
+	char *buf, size_t nbytes, loff_t off)
+{
+    struct mem_cgroup *memcg = mem_cgroup_from_css(of_css(of));
+    u64 budget;
+    int err;
+
+    buf = strstrip(buf);
+    if (!strcmp(buf, "max")) {
+	budget = U64_MAX;
+    } else {
+	err = kstrtou64(buf, 10, &budget);
+	if (err)
+	    return err;
+	if (budget > USEC_PER_SEC)
+	    return -EINVAL;
+	budget *= NSEC_PER_USEC;
+    }
+
+    WRITE_ONCE(memcg->htmm_cpu_budget, budget);
+    return nbytes;
+}
+
+/* one "<fast tier bytes> <hit permil>" line per point of the curve */
+static int memcg_htmm_mrc_show(struct seq_file *m, void *v)
+{
+    struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
+    unsigned long nr_pages[16];
+    unsigned int hit[16];
+    int i;
+
+    spin_lock(&memcg->access_lock);
+    memcpy(nr_pages, memcg->htmm_mrc_pages, sizeof(nr_pages));
+    memcpy(hit, memcg->htmm_mrc_hit, sizeof(hit));
+    spin_unlock(&memcg->access_lock);
+
+    for (i = 0; i < 16; i++) {
+	/* empty buckets add no point */
+	if (!nr_pages[i] || (i && nr_pages[i] == nr_pages[i - 1]))
+	    continue;
+	seq_printf(m, "%lu %u\n", nr_pages[i] << PAGE_SHIFT, hit[i]);
+    }
+
+    return 0;
+}
+
+/* per fast tier node, in pages (rates in pages/sec) */
+static int memcg_htmm_watermarks_show(struct seq_file *m, void *v)
+{
+    struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+	struct mem_cgroup_per_node *pn = memcg->nodeinfo[nid];
+
+	if (!htmm_node_is_toptier(nid))
+	    continue;
+	seq_printf(m, "node%d demotion %lu promotion %lu alloc_rate %lu "
+		"demote_rate %lu backlog %lu\n", nid,
+		get_memcg_demotion_watermark(memcg, nid),
+		get_memcg_promotion_watermark(memcg, nid),
+		READ_ONCE(pn->wmark_alloc_rate),
+		READ_ONCE(pn->wmark_demote_rate),
+		READ_ONCE(pn->wmark_backlog));
+    }
+
+    return 0;
+}
+
+enum {
+    HTMM_NUMA_ANON,
+    HTMM_NUMA_ANON_THP,
+    HTMM_NUMA_FILE,
+    HTMM_NUMA_HOT,
+    HTMM_NUMA_WARM,
+    HTMM_NUMA_COLD,
+    NR_HTMM_NUMA_STAT,
+};
+
+static const char * const htmm_numa_stat_names[NR_HTMM_NUMA_STAT] = {
+    "anon", "anon_thp", "file", "hot", "warm", "cold",
+};
+
+/* resident pages of @memcg on node @nid. cold is whatever is resident and
+ * neither hot nor warm, sampled or not.
+ */
+static void htmm_numa_stat_node(struct mem_cgroup *memcg, int nid,
+	unsigned long *ns)
+{
+    struct mem_cgroup_per_node *pn = memcg->nodeinfo[nid];
+    unsigned long resident;
+    int i;
+
+    ns[HTMM_NUMA_ANON_THP] =
+	percpu_counter_sum_positive(&pn->nr_resident[HTMM_RES_ANON_THP]);
+    ns[HTMM_NUMA_ANON] =
+	percpu_counter_sum_positive(&pn->nr_resident[HTMM_RES_ANON]);
+    ns[HTMM_NUMA_ANON] -= min(ns[HTMM_NUMA_ANON], ns[HTMM_NUMA_ANON_THP]);
+    ns[HTMM_NUMA_FILE] =
+	percpu_counter_sum_positive(&pn->nr_resident[HTMM_RES_FILE]);
+
+    ns[HTMM_NUMA_HOT] = ns[HTMM_NUMA_WARM] = 0;
+    spin_lock(&memcg->access_lock);
+    for (i = 15; i >= 0; i--) {
+	if (i >= memcg->active_threshold)
+	    ns[HTMM_NUMA_HOT] += pn->hotness_hg[i];
+	else if (i >= memcg->warm_threshold)
+	    ns[HTMM_NUMA_WARM] += pn->hotness_hg[i];
+    }
+    spin_unlock(&memcg->access_lock);
+
+    resident = ns[HTMM_NUMA_ANON] + ns[HTMM_NUMA_ANON_THP] +
+	ns[HTMM_NUMA_FILE];
+    ns[HTMM_NUMA_HOT] = min(ns[HTMM_NUMA_HOT], resident);
+    ns[HTMM_NUMA_WARM] = min(ns[HTMM_NUMA_WARM], resident - ns[HTMM_NUMA_HOT]);
+    ns[HTMM_NUMA_COLD] = resident - ns[HTMM_NUMA_HOT] - ns[HTMM_NUMA_WARM];
+}
+
+/* in pages, laid out as memory.numa_stat */
+static int memcg_htmm_numa_stat_show(struct seq_file *m, void *v)
+{
+    struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
+    unsigned long ns[NR_HTMM_NUMA_STAT];
+    int nid, i;
+
+    for (i = 0; i < NR_HTMM_NUMA_STAT; i++) {
+	seq_puts(m, htmm_numa_stat_names[i]);
+	for_each_node_state(nid, N_MEMORY) {
+	    htmm_numa_stat_node(memcg, nid, ns);
+	    seq_printf(m, " N%d=%lu", nid, ns[i]);
+	}
+	seq_putc(m, '\n');
+    }
+
+    return 0;
+}
+
+/* page walk cost as measured by the STLB miss events */
+static int memcg_htmm_tlb_show(struct seq_file *m, void *v)
+{
+    struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
+
+    seq_printf(m, "walk_samples %lu\n", READ_ONCE(memcg->nr_walk_sampled));
+    seq_printf(m, "walk_permil %u\n", READ_ONCE(memcg->walk_permil));
+    seq_printf(m, "walk_latency %lu\n", htmm_walk_latency());
+
+    return 0;
+}
+
+static struct cftype memcg_htmm_cpu_files[] = {
+    {
+	.name = "htmm_cpu_stat",
+	.flags = CFTYPE_NOT_ON_ROOT,
+	.seq_show = memcg_htmm_cpu_stat_show,
+    },
+    {
+	.name = "htmm_cpu_budget",
+	.flags = CFTYPE_NOT_ON_ROOT,
+	.seq_show = memcg_htmm_cpu_budget_show,
+	.write = memcg_htmm_cpu_budget_write,
+    },
+    {
+	.name = "htmm_mrc",
+	.flags = CFTYPE_NOT_ON_ROOT,
+	.seq_show = memcg_htmm_mrc_show,
+    },
+    {
+	.name = "htmm_watermarks",
+	.flags = CFTYPE_NOT_ON_ROOT,
+	.seq_show = memcg_htmm_watermarks_show,
+    },
+    {
+	.name = "htmm_tlb",
+	.flags = CFTYPE_NOT_ON_ROOT,
+	.seq_show = memcg_htmm_tlb_show,
+    },
+    {
+	.name = "htmm_numa_stat",
+	.flags = CFTYPE_NOT_ON_ROOT,
+	.seq_show = memcg_htmm_numa_stat_show,
+    },
+    {},
+};
+
+static int __init mem_cgroup_htmm_cpu_init(void)
+{
+    WARN_ON(cgroup_add_dfl_cftypes(&memory_cgrp_subsys,
+		memcg_htmm_cpu_files));
+    return 0;
+}
+subsys_initcall(mem_cgroup_htmm_cpu_init);
+
+/* fast tier capacity of @memcg, from the limits of the online nodes */
+void mem_cgroup_htmm_update_dram_max(struct mem_cgroup *memcg)
+{
+    unsigned long nr_dram_pages = 0;
+    int n;
+
+    for_each_node_state(n, N_MEMORY) {
+	if (htmm_node_is_toptier(n)) {
+	    if (memcg->nodeinfo[n]->max_nr_base_pages != ULONG_MAX)
+		nr_dram_pages += memcg->nodeinfo[n]->max_nr_base_pages;
+	}
+    }
+    if (nr_dram_pages)
+	memcg->max_nr_dram_pages = nr_dram_pages;
+}
+
 static int memcg_per_node_max_show(struct seq_file *m, void *v)
 {
     struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
@@ -7743,8 +8046,8 @@ static ssize_t memcg_per_node_max_write(struct kernfs_open_file *of,
     struct mem_cgroup *memcg = mem_cgroup_from_css(of_css(of));
     struct cftype *cur_file = of_cft(of);
     int nid = cur_file->numa_node_id;
-    unsigned long max, nr_dram_pages = 0;
-    int err, n;
+    unsigned long max;
+    int err;
 
     buf = strstrip(buf);
     err = page_counter_memparse(buf, "max", &max);
@@ -7752,15 +8055,7 @@ static ssize_t memcg_per_node_max_write(struct kernfs_open_file *of,
 	return err;
 
     xchg(&memcg->nodeinfo[nid]->max_nr_base_pages, max);
-    
-    for_each_node_state(n, N_MEMORY) {
-	if (node_is_toptier(n)) {
-	    if (memcg->nodeinfo[n]->max_nr_base_pages != ULONG_MAX)
-		nr_dram_pages += memcg->nodeinfo[n]->max_nr_base_pages;
-	}
-    }
-    if (nr_dram_pages)
-	memcg->max_nr_dram_pages = nr_dram_pages;
+    mem_cgroup_htmm_update_dram_max(memcg);
 
     return nbytes;
 }
@@ -7803,4 +8098,20 @@ int mem_cgroup_per_node_htmm_init(void)
     return 0;
 }
 subsys_initcall(mem_cgroup_per_node_htmm_init);
+
+/* removes the files of a node whose memory went offline */
+void mem_cgroup_per_node_htmm_exit(int nid)
+{
+    struct pglist_data *pgdat = NODE_DATA(nid);
+
+    if (!pgdat || !pgdat->memcg_htmm_file)
+	return;
+
+    cgroup_rm_cftypes(pgdat->memcg_htmm_file);
+#ifdef CONFIG_LOCKDEP
+    lockdep_unregister_key(&(pgdat->memcg_htmm_file->lockdep_key));
+#endif
+    kfree(pgdat->memcg_htmm_file);
+    pgdat->memcg_htmm_file = NULL;
+}
 #endif /* CONFIG_HTMM */
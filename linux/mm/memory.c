@@ -1363,7 +1363,8 @@ again:
 					mark_page_accessed(page);
 			}
 #ifdef CONFIG_HTMM
-			uncharge_htmm_pte(pte, get_mem_cgroup_from_mm(vma->vm_mm));
+			uncharge_htmm_pte(pte, page,
+					  get_mem_cgroup_from_mm(vma->vm_mm));
 #endif
 			rss[mm_counter(page)]--;
 			page_remove_rmap(page, false);
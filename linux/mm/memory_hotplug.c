@@ -1155,9 +1155,6 @@ int __ref online_pages(unsigned long pfn, unsigned long nr_pages,
 
 	memory_notify(MEM_ONLINE, &arg);
 	mem_hotplug_done();
-#ifdef CONFIG_HTMM /* online_pages() */
-	mem_cgroup_per_node_htmm_init();
-#endif
 
 	return 0;
 
@@ -2141,12 +2141,23 @@ struct page *alloc_pages_vma(gfp_t gfp, int order, struct vm_area_struct *vma,
 		kmigraterd_wakeup(orig_nid);
 	    }
 	    else if (max_nr_pages <= (get_nr_lru_pages_node(memcg, pgdat) +
-			get_memcg_demotion_watermark(max_nr_pages))) {
+			get_memcg_demotion_watermark(memcg, nid))) {
 		WRITE_ONCE(memcg->nodeinfo[nid]->need_demotion, true);
 		kmigraterd_wakeup(nid);
 	    }
 	    
 	    mpol_cond_put(pol);
+	    /* a long-term pin stays where it is allocated: take the fast tier
+	     * while it has free pages, the demotion kicked above catches up */
+	    if (orig_nid != nid && htmm_pin_fasttier &&
+		    (p->flags & PF_MEMALLOC_PIN) && htmm_node_is_toptier(orig_nid)) {
+		page = __alloc_pages_node(orig_nid, (gfp | __GFP_THISNODE |
+			    __GFP_NOWARN) & ~__GFP_DIRECT_RECLAIM, order);
+		if (page) {
+		    count_vm_events(HTMM_PIN_PLACED, 1U << order);
+		    goto out;
+		}
+	    }
 	    page = __alloc_pages_node(nid, gfp | __GFP_THISNODE, order);
 	    goto out;
 	}
@@ -3047,6 +3058,19 @@ bool htmm_cxl_mode = false;
 bool htmm_skip_cooling = true;
 unsigned int htmm_thres_cooling_alloc = 256 * 1024 * 10; // unit: 4KiB, default: 10GB
 unsigned int ksampled_soft_cpu_quota = 30; // 3 %
+bool htmm_pgtable_placement = true;
+bool htmm_sample_ring = false; // a PMI per sample: large PEBS is off
+unsigned int htmm_pmu_counters = 4; // 0: open every event and let perf multiplex
+unsigned int htmm_rotation_window = 1000; // ms
+bool htmm_bw_balance = false;
+bool htmm_replica_detect = false;
+bool htmm_coschedule = false;
+bool htmm_hugetlb = false;
+unsigned int htmm_thp_bloat_thres = 0;
+bool htmm_pin_fasttier = false;
+bool htmm_stlb_sampling = false;
+unsigned int htmm_walk_thres = 4;
+unsigned int htmm_cooling_timeout = 1000; // unit: ms
 #endif
 
 #ifdef CONFIG_SYSFS
@@ -3604,6 +3628,349 @@ static struct kobj_attribute htmm_thres_cooling_alloc_attr =
 	__ATTR(htmm_thres_cooling_alloc, 0644, htmm_thres_cooling_alloc_show,
 	       htmm_thres_cooling_alloc_store);
 
+/* sysfs related to page table and pginfo placement */
+static ssize_t htmm_pgtable_placement_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_pgtable_placement)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_pgtable_placement_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_pgtable_placement = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_pgtable_placement = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_pgtable_placement_attr =
+	__ATTR(htmm_pgtable_placement, 0644, htmm_pgtable_placement_show,
+	       htmm_pgtable_placement_store);
+
+/* takes effect on the next htmm_start */
+static ssize_t htmm_sample_ring_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_sample_ring)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_sample_ring_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_sample_ring = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_sample_ring = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_sample_ring_attr =
+	__ATTR(htmm_sample_ring, 0644, htmm_sample_ring_show,
+	       htmm_sample_ring_store);
+
+
+static ssize_t htmm_pmu_counters_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", htmm_pmu_counters);
+}
+
+static ssize_t htmm_pmu_counters_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned int val;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(htmm_pmu_counters, val);
+	return count;
+}
+
+static struct kobj_attribute htmm_pmu_counters_attr =
+	__ATTR(htmm_pmu_counters, 0644, htmm_pmu_counters_show,
+	       htmm_pmu_counters_store);
+
+static ssize_t htmm_rotation_window_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", htmm_rotation_window);
+}
+
+static ssize_t htmm_rotation_window_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned int val;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(htmm_rotation_window, val);
+	return count;
+}
+
+static struct kobj_attribute htmm_rotation_window_attr =
+	__ATTR(htmm_rotation_window, 0644, htmm_rotation_window_show,
+	       htmm_rotation_window_store);
+
+static ssize_t htmm_bw_balance_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_bw_balance)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_bw_balance_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_bw_balance = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_bw_balance = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_bw_balance_attr =
+	__ATTR(htmm_bw_balance, 0644, htmm_bw_balance_show,
+	       htmm_bw_balance_store);
+
+static ssize_t htmm_replica_detect_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_replica_detect)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_replica_detect_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_replica_detect = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_replica_detect = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_replica_detect_attr =
+	__ATTR(htmm_replica_detect, 0644, htmm_replica_detect_show,
+	       htmm_replica_detect_store);
+
+static ssize_t htmm_coschedule_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_coschedule)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_coschedule_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_coschedule = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_coschedule = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_coschedule_attr =
+	__ATTR(htmm_coschedule, 0644, htmm_coschedule_show,
+	       htmm_coschedule_store);
+
+static ssize_t htmm_hugetlb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_hugetlb)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_hugetlb_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_hugetlb = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_hugetlb = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_hugetlb_attr =
+	__ATTR(htmm_hugetlb, 0644, htmm_hugetlb_show,
+	       htmm_hugetlb_store);
+
+static ssize_t htmm_thp_bloat_thres_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", htmm_thp_bloat_thres);
+}
+
+static ssize_t htmm_thp_bloat_thres_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned int val;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(htmm_thp_bloat_thres, val);
+	return count;
+}
+
+static struct kobj_attribute htmm_thp_bloat_thres_attr =
+	__ATTR(htmm_thp_bloat_thres, 0644, htmm_thp_bloat_thres_show,
+	       htmm_thp_bloat_thres_store);
+
+static ssize_t htmm_pin_fasttier_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_pin_fasttier)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_pin_fasttier_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_pin_fasttier = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_pin_fasttier = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_pin_fasttier_attr =
+	__ATTR(htmm_pin_fasttier, 0644, htmm_pin_fasttier_show,
+	       htmm_pin_fasttier_store);
+
+static ssize_t htmm_stlb_sampling_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	if (htmm_stlb_sampling)
+	    return sysfs_emit(buf, "[enabled] disabled\n");
+	else
+	    return sysfs_emit(buf, "enabled [disabled]\n");
+}
+
+static ssize_t htmm_stlb_sampling_store(struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "enabled"))
+	htmm_stlb_sampling = true;
+    else if (sysfs_streq(buf, "disabled"))
+	htmm_stlb_sampling = false;
+    else
+	return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute htmm_stlb_sampling_attr =
+	__ATTR(htmm_stlb_sampling, 0644, htmm_stlb_sampling_show,
+	       htmm_stlb_sampling_store);
+
+static ssize_t htmm_walk_thres_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", htmm_walk_thres);
+}
+
+static ssize_t htmm_walk_thres_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned int val;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(htmm_walk_thres, val);
+	return count;
+}
+
+static struct kobj_attribute htmm_walk_thres_attr =
+	__ATTR(htmm_walk_thres, 0644, htmm_walk_thres_show,
+	       htmm_walk_thres_store);
+
+static ssize_t htmm_cooling_timeout_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", htmm_cooling_timeout);
+}
+
+static ssize_t htmm_cooling_timeout_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned int val;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(htmm_cooling_timeout, val);
+	return count;
+}
+
+static struct kobj_attribute htmm_cooling_timeout_attr =
+	__ATTR(htmm_cooling_timeout, 0644, htmm_cooling_timeout_show,
+	       htmm_cooling_timeout_store);
 
 
 static struct attribute *htmm_attrs[] = {
@@ -3626,6 +3993,19 @@ static struct attribute *htmm_attrs[] = {
 	&htmm_cxl_mode_attr.attr,
 	&htmm_skip_cooling_attr.attr,
 	&htmm_thres_cooling_alloc_attr.attr,
+	&htmm_pgtable_placement_attr.attr,
+	&htmm_sample_ring_attr.attr,
+	&htmm_pmu_counters_attr.attr,
+	&htmm_rotation_window_attr.attr,
+	&htmm_bw_balance_attr.attr,
+	&htmm_replica_detect_attr.attr,
+	&htmm_coschedule_attr.attr,
+	&htmm_hugetlb_attr.attr,
+	&htmm_thp_bloat_thres_attr.attr,
+	&htmm_pin_fasttier_attr.attr,
+	&htmm_stlb_sampling_attr.attr,
+	&htmm_walk_thres_attr.attr,
+	&htmm_cooling_timeout_attr.attr,
 	NULL,
 };
 
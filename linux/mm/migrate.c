@@ -51,6 +51,8 @@
 #include <linux/oom.h>
 #include <linux/memory.h>
 #include <linux/htmm.h>
+#include <linux/anon_inodes.h>
+#include <linux/poll.h>
 
 #include <asm/tlbflush.h>
 
@@ -338,6 +340,9 @@ static bool remove_migration_pte(struct page *page, struct vm_area_struct *vma,
 			if (!pginfo)
 			    goto out_cooling_check;
 
+			htmm_node_hg_move(memcg, pvmw.page, new,
+				get_idx(pginfo->total_accesses),
+				pginfo->cooling_clock, 1);
 			check_base_cooling(pginfo, new, true);
 		}
 out_cooling_check:
@@ -2167,6 +2172,280 @@ SYSCALL_DEFINE6(move_pages, pid_t, pid, unsigned long, nr_pages,
 	return kernel_move_pages(pid, nr_pages, pages, nodes, status, flags);
 }
 
+/*
+ * Asynchronous move_pages(): the vectors are copied in and grouped by target
+ * node. Each node gets its own work on the unbound workqueue, so the nodes
+ * are migrated in parallel, MOVE_PAGES_ASYNC_BATCH pages per migrate_pages()
+ * call. The returned fd polls readable once every batch is done, and read()
+ * then returns the status array that move_pages() would have filled.
+ * At most MOVE_PAGES_ASYNC_INFLIGHT requests migrate an mm at a time; more
+ * get -EAGAIN. The vectors are charged to the caller's memcg.
+ */
+#define MOVE_PAGES_ASYNC_BATCH		512
+#define MOVE_PAGES_ASYNC_MAX		(1UL << 22)
+#define MOVE_PAGES_ASYNC_INFLIGHT	16
+
+struct move_pages_async;
+
+struct move_pages_async_work {
+	struct work_struct work;
+	struct move_pages_async *mpa;
+	int node;
+};
+
+struct move_pages_async {
+	struct mm_struct *mm;
+	unsigned long nr_pages;
+	unsigned long *addrs;
+	int *nodes;
+	int *status;
+	bool migrate_all;
+	atomic_t nr_running;
+	wait_queue_head_t wait;
+	int nr_works;
+	struct move_pages_async_work works[];
+};
+
+/* resolves the final status of the pages queued in [start, end) */
+static void move_pages_async_flush(struct move_pages_async *mpa, int node,
+				   struct list_head *pagelist,
+				   unsigned long start, unsigned long end)
+{
+	unsigned long i;
+	int err;
+
+	if (list_empty(pagelist))
+		return;
+
+	err = do_move_pages_to_node(mpa->mm, pagelist, node);
+	for (i = start; i < end; i++) {
+		if (mpa->nodes[i] != node || mpa->status[i] != -EINPROGRESS)
+			continue;
+		if (!err)
+			mpa->status[i] = node;
+		else
+			do_pages_stat_array(mpa->mm, 1,
+				(const void __user **)&mpa->addrs[i],
+				&mpa->status[i]);
+	}
+}
+
+static void move_pages_async_workfn(struct work_struct *work)
+{
+	struct move_pages_async_work *w =
+		container_of(work, struct move_pages_async_work, work);
+	struct move_pages_async *mpa = w->mpa;
+	unsigned long i, start = 0, nr_queued = 0;
+	LIST_HEAD(pagelist);
+	int err;
+
+	lru_cache_disable();
+	for (i = 0; i < mpa->nr_pages; i++) {
+		if (mpa->nodes[i] != w->node || mpa->status[i] != -EINPROGRESS)
+			continue;
+
+		err = add_page_for_migration(mpa->mm, mpa->addrs[i], w->node,
+					     &pagelist, mpa->migrate_all);
+		if (err <= 0) {
+			mpa->status[i] = err ? : w->node;
+			continue;
+		}
+
+		if (++nr_queued == MOVE_PAGES_ASYNC_BATCH) {
+			move_pages_async_flush(mpa, w->node, &pagelist,
+					       start, i + 1);
+			start = i + 1;
+			nr_queued = 0;
+		}
+		cond_resched();
+	}
+	move_pages_async_flush(mpa, w->node, &pagelist, start, mpa->nr_pages);
+	lru_cache_enable();
+
+	if (atomic_dec_and_test(&mpa->nr_running)) {
+		atomic_dec(&mpa->mm->nr_move_pages_async);
+		wake_up_interruptible_poll(&mpa->wait, EPOLLIN | EPOLLRDNORM);
+	}
+}
+
+static void move_pages_async_free(struct move_pages_async *mpa)
+{
+	if (mpa->mm)
+		mmput(mpa->mm);
+	kvfree(mpa->addrs);
+	kvfree(mpa->nodes);
+	kvfree(mpa->status);
+	kfree(mpa);
+}
+
+static __poll_t move_pages_async_poll(struct file *file, poll_table *wait)
+{
+	struct move_pages_async *mpa = file->private_data;
+
+	poll_wait(file, &mpa->wait, wait);
+	return atomic_read(&mpa->nr_running) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static ssize_t move_pages_async_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct move_pages_async *mpa = file->private_data;
+	int err;
+
+	if (atomic_read(&mpa->nr_running)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		err = wait_event_interruptible(mpa->wait,
+					       !atomic_read(&mpa->nr_running));
+		if (err)
+			return err;
+	}
+
+	return simple_read_from_buffer(buf, count, ppos, mpa->status,
+				       mpa->nr_pages * sizeof(*mpa->status));
+}
+
+static int move_pages_async_release(struct inode *inode, struct file *file)
+{
+	struct move_pages_async *mpa = file->private_data;
+	int i;
+
+	/* the works use the vectors until they are done */
+	for (i = 0; i < mpa->nr_works; i++)
+		flush_work(&mpa->works[i].work);
+	move_pages_async_free(mpa);
+	return 0;
+}
+
+static const struct file_operations move_pages_async_fops = {
+	.poll		= move_pages_async_poll,
+	.read		= move_pages_async_read,
+	.release	= move_pages_async_release,
+	.llseek		= noop_llseek,
+};
+
+static int kernel_move_pages_async(pid_t pid, unsigned long nr_pages,
+				   const void __user * __user *pages,
+				   const int __user *nodes, int flags)
+{
+	struct move_pages_async *mpa;
+	struct mm_struct *mm;
+	nodemask_t task_nodes, targets = NODE_MASK_NONE;
+	struct file *file;
+	unsigned long i;
+	int node, fd, err;
+
+	if (flags & ~(MPOL_MF_MOVE|MPOL_MF_MOVE_ALL))
+		return -EINVAL;
+
+	if ((flags & MPOL_MF_MOVE_ALL) && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	if (!nr_pages || nr_pages > MOVE_PAGES_ASYNC_MAX || !nodes)
+		return -EINVAL;
+
+	mpa = kzalloc(struct_size(mpa, works, nr_node_ids), GFP_KERNEL_ACCOUNT);
+	if (!mpa)
+		return -ENOMEM;
+	mpa->nr_pages = nr_pages;
+	mpa->migrate_all = flags & MPOL_MF_MOVE_ALL;
+	init_waitqueue_head(&mpa->wait);
+
+	err = -ENOMEM;
+	mpa->addrs = kvmalloc_array(nr_pages, sizeof(*mpa->addrs),
+				    GFP_KERNEL_ACCOUNT);
+	mpa->nodes = kvmalloc_array(nr_pages, sizeof(*mpa->nodes),
+				    GFP_KERNEL_ACCOUNT);
+	mpa->status = kvmalloc_array(nr_pages, sizeof(*mpa->status),
+				     GFP_KERNEL_ACCOUNT);
+	if (!mpa->addrs || !mpa->nodes || !mpa->status)
+		goto out_free;
+
+	err = -EFAULT;
+	if (in_compat_syscall()) {
+		if (get_compat_pages_array((const void __user **)mpa->addrs,
+					   pages, nr_pages))
+			goto out_free;
+	} else if (copy_from_user(mpa->addrs, pages,
+				  nr_pages * sizeof(*mpa->addrs))) {
+		goto out_free;
+	}
+	if (copy_from_user(mpa->nodes, nodes, nr_pages * sizeof(*mpa->nodes)))
+		goto out_free;
+
+	mm = find_mm_struct(pid, &task_nodes);
+	if (IS_ERR(mm)) {
+		err = PTR_ERR(mm);
+		goto out_free;
+	}
+	mpa->mm = mm;
+
+	/* bad targets are reported per page instead of failing the call */
+	for (i = 0; i < nr_pages; i++) {
+		mpa->addrs[i] = untagged_addr(mpa->addrs[i]);
+		node = mpa->nodes[i];
+		if (node < 0 || node >= MAX_NUMNODES ||
+		    !node_state(node, N_MEMORY)) {
+			mpa->status[i] = -ENODEV;
+		} else if (!node_isset(node, task_nodes)) {
+			mpa->status[i] = -EACCES;
+		} else {
+			mpa->status[i] = -EINPROGRESS;
+			node_set(node, targets);
+		}
+	}
+
+	for_each_node_mask(node, targets) {
+		struct move_pages_async_work *w = &mpa->works[mpa->nr_works++];
+
+		INIT_WORK(&w->work, move_pages_async_workfn);
+		w->mpa = mpa;
+		w->node = node;
+	}
+	atomic_set(&mpa->nr_running, mpa->nr_works);
+
+	/* dropped by the last work to finish */
+	if (mpa->nr_works &&
+	    atomic_inc_return(&mm->nr_move_pages_async) >
+	    MOVE_PAGES_ASYNC_INFLIGHT) {
+		atomic_dec(&mm->nr_move_pages_async);
+		err = -EAGAIN;
+		goto out_free;
+	}
+
+	fd = get_unused_fd_flags(O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err = fd;
+		goto out_uncount;
+	}
+	file = anon_inode_getfile("[move_pages_async]", &move_pages_async_fops,
+				  mpa, O_RDONLY | O_CLOEXEC);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		err = PTR_ERR(file);
+		goto out_uncount;
+	}
+
+	for (i = 0; i < mpa->nr_works; i++)
+		queue_work(system_unbound_wq, &mpa->works[i].work);
+	fd_install(fd, file);
+	return fd;
+
+out_uncount:
+	if (mpa->nr_works)
+		atomic_dec(&mm->nr_move_pages_async);
+out_free:
+	move_pages_async_free(mpa);
+	return err;
+}
+
+SYSCALL_DEFINE5(move_pages_async, pid_t, pid, unsigned long, nr_pages,
+		const void __user * __user *, pages,
+		const int __user *, nodes, int, flags)
+{
+	return kernel_move_pages_async(pid, nr_pages, pages, nodes, flags);
+}
+
 #ifdef CONFIG_NUMA_BALANCING
 /*
  * Returns true if this is a safe migration target node for misplaced NUMA
@@ -957,6 +957,7 @@ static bool cooling_page_one(struct page *page, struct vm_area_struct *vma,
 		cur_idx = get_idx(pginfo->total_accesses);
 		hca->memcg->hotness_hg[cur_idx]++;
 		hca->memcg->ebp_hotness_hg[cur_idx]++;
+		htmm_node_hg_add(hca->memcg, page_to_nid(page), cur_idx, 1);
 
 		if (cur_idx >= (hca->memcg->active_threshold - 1))
 		    hca->page_is_hot = 2;
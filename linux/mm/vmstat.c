@@ -1370,6 +1370,27 @@ const char * const vmstat_text[] = {
 	"htmm_missed_write",
 	"htmm_alloc_dram",
 	"htmm_alloc_nvm",
+	"htmm_pginfo_moved",
+	"htmm_pgtable_promoted",
+	"htmm_sample_lockless",
+	"htmm_sample_retried",
+	"htmm_sample_dropped",
+	"htmm_sampling_suspended",
+	"htmm_sampling_resumed",
+	"htmm_replica_candidate",
+	"htmm_replica_candidate_write",
+	"htmm_cosched_hint",
+	"htmm_hugetlb_promoted",
+	"htmm_hugetlb_demoted",
+	"htmm_thp_bloat_split",
+	"htmm_thp_bloat_freed",
+	"htmm_busy_deferred",
+	"htmm_busy_expired",
+	"htmm_pin_skipped",
+	"htmm_pin_placed",
+	"htmm_walk_sampled",
+	"htmm_cooling_done",
+	"htmm_cooling_expired",
 #endif
 #endif /* CONFIG_MEMORY_BALLOON */
 #ifdef CONFIG_DEBUG_TLBFLUSH
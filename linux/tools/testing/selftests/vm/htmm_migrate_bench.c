@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Tier migration throughput of the htmm migrater.
+ *
+ * Fills an htmm enabled memcg with anonymous memory bound to one node (use
+ * numa=fake to get a slow node without tiered hardware), then asks
+ * <debugfs>/htmm/migrate_bench to promote or demote it and prints what the
+ * kernel measured: pages/sec, MB/s and TLB shootdowns. An optional thread
+ * keeps reading the buffer meanwhile and reports the longest stall it saw
+ * and the time it lost against its own baseline.
+ *
+ * The caller must run in a cgroup with memory.htmm_enabled set, or pass -c.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "../kselftest.h"
+
+#define BENCH_DEBUGFS	"/sys/kernel/debug/htmm/migrate_bench/"
+#define THP_SIZE	(2UL << 20)
+#define LOAD_CHUNK	(64UL << 10)
+
+static size_t pagesize;
+static char *buf;
+static size_t size = 1UL << 30;
+static volatile bool load_stop;
+static uint64_t load_baseline_ns;
+static uint64_t load_max_ns, load_lost_ns, load_chunks;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_file(const char *path, const char *val)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	ret = write(fd, val, strlen(val));
+	close(fd);
+	return ret < 0 ? -errno : 0;
+}
+
+static int write_bench(const char *name, unsigned long val)
+{
+	char path[256], str[32];
+
+	snprintf(path, sizeof(path), BENCH_DEBUGFS "%s", name);
+	snprintf(str, sizeof(str), "%lu", val);
+	return write_file(path, str);
+}
+
+static void join_cgroup(const char *cgroup)
+{
+	char path[256], pid[32];
+
+	snprintf(path, sizeof(path), "%s/memory.htmm_enabled", cgroup);
+	if (write_file(path, "enabled"))
+		ksft_exit_skip("cannot enable htmm in %s\n", cgroup);
+	snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	if (write_file(path, pid))
+		ksft_exit_fail_msg("cannot join %s: %s\n", cgroup,
+				   strerror(errno));
+}
+
+/* the first thp_pct percent of the buffer is backed by THPs */
+static void fill(int node, int thp_pct)
+{
+	unsigned long mask = 1UL << node;
+	size_t thp_bytes = size / 100 * thp_pct & ~(THP_SIZE - 1);
+	size_t off;
+
+	buf = mmap(NULL, size + THP_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		ksft_exit_fail_msg("mmap: %s\n", strerror(errno));
+	buf = (char *)(((uintptr_t)buf + THP_SIZE - 1) & ~(THP_SIZE - 1));
+
+	if (thp_bytes)
+		madvise(buf, thp_bytes, MADV_HUGEPAGE);
+	if (thp_bytes < size)
+		madvise(buf + thp_bytes, size - thp_bytes, MADV_NOHUGEPAGE);
+	if (syscall(__NR_mbind, buf, size, MPOL_BIND, &mask,
+		    sizeof(mask) * 8, 0))
+		ksft_exit_skip("mbind to node %d: %s\n", node, strerror(errno));
+
+	for (off = 0; off < size; off += pagesize)
+		buf[off] = 1;
+}
+
+static uint64_t read_chunk(size_t off)
+{
+	volatile char *p = buf + off;
+	uint64_t start = now_ns();
+	size_t i;
+
+	for (i = 0; i < LOAD_CHUNK; i += 64)
+		(void)p[i];
+	return now_ns() - start;
+}
+
+/* reads the buffer in chunks until told to stop */
+static void *load_fn(void *arg)
+{
+	size_t off = 0;
+
+	while (!load_stop) {
+		uint64_t t = read_chunk(off);
+
+		if (t > load_max_ns)
+			load_max_ns = t;
+		if (t > load_baseline_ns)
+			load_lost_ns += t - load_baseline_ns;
+		load_chunks++;
+		off = (off + LOAD_CHUNK) % size;
+	}
+	return NULL;
+}
+
+/* median chunk time before the migration starts */
+static void load_calibrate(void)
+{
+	uint64_t t[101];
+	int i, j;
+
+	for (i = 0; i < 101; i++)
+		t[i] = read_chunk((i * LOAD_CHUNK) % size);
+	for (i = 1; i < 101; i++)
+		for (j = i; j > 0 && t[j - 1] > t[j]; j--) {
+			uint64_t tmp = t[j];
+
+			t[j] = t[j - 1];
+			t[j - 1] = tmp;
+		}
+	load_baseline_ns = t[50];
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s MB] [-t thp%%] [-b batch] [-n pages] [-d]\n"
+		"          [-f fast node] [-S slow node] [-l] [-c cgroup]\n"
+		"  -d  demote from the fast node instead of promoting\n"
+		"  -l  run a reader thread and report its stalls\n", prog);
+	exit(KSFT_FAIL);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr_pages = 0, batch = 32;
+	int fast = 0, slow = 1, thp_pct = 0;
+	bool demote = false, load = false;
+	const char *cgroup = NULL;
+	pthread_t load_thread;
+	char line[128];
+	FILE *result;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "s:t:b:n:df:S:lc:")) != -1) {
+		switch (opt) {
+		case 's':
+			size = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 't':
+			thp_pct = atoi(optarg);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			demote = true;
+			break;
+		case 'f':
+			fast = atoi(optarg);
+			break;
+		case 'S':
+			slow = atoi(optarg);
+			break;
+		case 'l':
+			load = true;
+			break;
+		case 'c':
+			cgroup = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!size || thp_pct < 0 || thp_pct > 100 || !batch)
+		usage(argv[0]);
+
+	if (access(BENCH_DEBUGFS "run", W_OK))
+		ksft_exit_skip("%s not available\n", BENCH_DEBUGFS);
+
+	pagesize = getpagesize();
+	if (!nr_pages)
+		nr_pages = size / pagesize;
+	if (cgroup)
+		join_cgroup(cgroup);
+
+	fill(demote ? fast : slow, thp_pct);
+
+	if (write_bench("pid", getpid()) ||
+	    write_bench("nr_pages", nr_pages) ||
+	    write_bench("batch", batch) ||
+	    write_bench("promote", !demote))
+		ksft_exit_fail_msg("cannot configure the benchmark\n");
+
+	if (load) {
+		load_calibrate();
+		if (pthread_create(&load_thread, NULL, load_fn, NULL))
+			ksft_exit_fail_msg("pthread_create failed\n");
+	}
+
+	ret = write_bench("run", 1);
+
+	if (load) {
+		load_stop = true;
+		pthread_join(load_thread, NULL);
+	}
+	if (ret)
+		ksft_exit_fail_msg("run: %s\n", strerror(-ret));
+
+	printf("# %s %lu MB, %d%% THP, batch %lu\n",
+	       demote ? "demote" : "promote", size >> 20, thp_pct, batch);
+	result = fopen(BENCH_DEBUGFS "result", "r");
+	if (!result)
+		ksft_exit_fail_msg("cannot read the result\n");
+	while (fgets(line, sizeof(line), result))
+		fputs(line, stdout);
+	fclose(result);
+
+	if (load) {
+		printf("load_baseline_ns %lu\n", (unsigned long)load_baseline_ns);
+		printf("load_stall_max_ns %lu\n", (unsigned long)load_max_ns);
+		printf("load_stall_total_ns %lu\n", (unsigned long)load_lost_ns);
+		printf("load_chunks %lu\n", (unsigned long)load_chunks);
+	}
+
+	return KSFT_PASS;
+}